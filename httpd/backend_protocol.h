@@ -0,0 +1,36 @@
+#ifndef BACKEND_PROTOCOL_H
+#define BACKEND_PROTOCOL_H
+
+#include <stdint.h>
+
+/**
+ * httpd2と常駐するバックエンドプロセスの間のフレーム形式
+ * 同じホストのUnixドメインソケットでしか使わないので、数値はホストのバイトオーダーのまま送る。
+ * 1つの接続に複数のリクエストを多重化し、idでどのリクエストのフレームかを区別する。
+ * レスポンスはリクエストの順番どおりに返さなくてよい。
+ *
+ * httpd2 → バックエンド: BACKEND_REQUEST 1つ、BACKEND_BODY 0個以上、中身が空のBACKEND_BODY(ボディの終わり)
+ *                        クライアントが切断した場合などは、途中でBACKEND_ABORTを送って取り消す
+ * バックエンド → httpd2: BACKEND_RESPONSE 1つ、BACKEND_BODY 0個以上、中身が空のBACKEND_BODY(レスポンスの終わり)
+ *
+ * REQUESTとRESPONSEの中身は "名前\0値\0" の並び。
+ * REQUESTは":method"と":path"から始まり、残りはリクエストのヘッダ(名前は小文字)。
+ * RESPONSEは":status"("200 OK"のようにコードと説明)から始まり、残りはレスポンスに付けるヘッダ。
+ * バックエンドはFastCGIと同じく、待ち受け用のソケットを標準入力(fd 0)として受け取る。
+ **/
+
+#define BACKEND_REQUEST 1
+#define BACKEND_RESPONSE 2
+#define BACKEND_BODY 3
+#define BACKEND_ABORT 4 // 中身はない。以後そのidのフレームは送らず、届いても捨てる
+#define BACKEND_FRAME_MAX (64 * 1024) // フレームの中身の最大の長さ
+
+struct BackendFrame
+{
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t id;
+    uint32_t len; // 続く中身の長さ
+};
+
+#endif
@@ -0,0 +1,62 @@
+#!/bin/sh
+# ループバック上でサーバに負荷をかけ、スループットとレイテンシを表示する
+# Usage: ./bench.sh [./httpd2|./httpd]
+#   PORT         待ち受けるポート(既定はプロセスIDから決める。直前の実行のTIME_WAITとぶつからないように)
+#   DURATION     各シナリオの秒数(既定 5)
+#   CONNECTIONS  同時接続数(既定 64)
+#   RATE         開ループのシナリオで発行する毎秒のリクエスト数(既定 5000)
+#   SERVER_OPTS  httpd2に渡すオプション(既定 --engine=epoll --workers=2)
+set -e
+
+SERVER=${1:-./httpd2}
+PORT=${PORT:-$((20000 + $$ % 20000))}
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-64}
+RATE=${RATE:-5000}
+SERVER_OPTS=${SERVER_OPTS:---engine=epoll --workers=2}
+MIX="/small.html:80,/medium.bin:15,/large.bin:5"
+
+DOCROOT=$(mktemp -d)
+PID=
+cleanup() {
+    if [ -n "$PID" ]; then
+        kill "$PID" 2>/dev/null
+        wait "$PID" 2>/dev/null
+    fi
+    rm -rf "$DOCROOT"
+}
+trap cleanup EXIT INT TERM
+
+# 小さなHTMLが大半で、時々大きなファイルが混ざる構成にする
+head -c 1024 /dev/urandom | od -An -tx1 | head -c 1024 > "$DOCROOT/small.html"
+head -c 65536 /dev/urandom > "$DOCROOT/medium.bin"
+head -c 1048576 /dev/urandom > "$DOCROOT/large.bin"
+
+case "$(basename "$SERVER")" in
+httpd)
+    if ! command -v socat >/dev/null; then
+        echo "bench.sh: socat is required to run httpd on a port" >&2
+        exit 1
+    fi
+    socat TCP-LISTEN:"$PORT",reuseaddr,fork EXEC:"$SERVER $DOCROOT" &
+    PID=$!
+    # httpdは1接続で1リクエストしか処理しない
+    SCENARIOS="close"
+    ;;
+*)
+    # shellcheck disable=SC2086
+    "$SERVER" --port="$PORT" $SERVER_OPTS --debug "$DOCROOT" &
+    PID=$!
+    SCENARIOS="keepalive close open"
+    ;;
+esac
+sleep 1
+
+for s in $SCENARIOS; do
+    echo "== $s"
+    case $s in
+    keepalive) ./loadgen --connections="$CONNECTIONS" --duration="$DURATION" --mix="$MIX" 127.0.0.1 "$PORT" ;;
+    close)     ./loadgen --connections="$CONNECTIONS" --duration="$DURATION" --mix="$MIX" --close 127.0.0.1 "$PORT" ;;
+    open)      ./loadgen --connections="$CONNECTIONS" --duration="$DURATION" --mix="$MIX" --rate="$RATE" 127.0.0.1 "$PORT" ;;
+    esac
+done
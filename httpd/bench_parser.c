@@ -0,0 +1,321 @@
+/**
+ * リクエスト解析のマイクロベンチマーク
+ * httpd2.cをそのまま取り込み、サーバと同じconn_parse()とlookup_header_field_value()に
+ * メモリ上のリクエストを流して、1リクエストあたりの時間とメモリ割り当ての回数を測る。
+ * mallocの回数はリンク時に-Wl,--wrap=mallocで__wrap_malloc()に差し替えて数える。
+ **/
+#define main httpd2_main
+#include "httpd2.c"
+#undef main
+
+#define BENCH_ROUNDS 5 // 最も速かった回を採用して、他のプロセスの影響を減らす
+#define DEFAULT_ITERATIONS 200000
+#define BENCH_USAGE "Usage: %s [--iterations=n] [--chunk=bytes] [corpus...]\n"
+
+struct Corpus
+{
+    const char *name;
+    char *buf; // リクエストのバイト列(ボディを含む)
+    size_t len;
+};
+
+static void build_corpora(void);
+static char* make_request(size_t *len, const char *head, size_t body_len);
+static void bench_corpus(struct Corpus *c, long iterations, size_t chunk);
+static double parse_only(struct Corpus *c, long iterations);
+static void feed_request(struct Connection *conn, struct Corpus *c, size_t chunk);
+static size_t arena_usage(struct Arena *arena);
+static int64_t bench_now(void);
+void* __real_malloc(size_t sz);
+void* __real_calloc(size_t n, size_t sz);
+void* __real_realloc(void *p, size_t sz);
+
+static struct option bench_longopts[] = {
+    {"iterations", required_argument, NULL, 'n'},
+    {"chunk", required_argument, NULL, 'c'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}
+};
+
+static struct Corpus corpora[8];
+static int n_corpora = 0;
+static unsigned long n_mallocs = 0;
+static volatile size_t sink; // 結果を使ったことにして、最適化で消されないようにする
+
+int main(int argc, char *argv[])
+{
+    long iterations = DEFAULT_ITERATIONS;
+    size_t chunk = 0; // 0ならリクエスト全体が一度に届いたものとする
+    int opt, i, j;
+
+    while ((opt = getopt_long(argc, argv, "", bench_longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'c':
+            chunk = atol(optarg);
+            break;
+        case 'h':
+            fprintf(stdout, BENCH_USAGE, argv[0]);
+            exit(0);
+        default:
+            fprintf(stderr, BENCH_USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (iterations < 1) {
+        fprintf(stderr, BENCH_USAGE, argv[0]);
+        exit(1);
+    }
+    build_corpora();
+    printf("%-14s %8s %10s %10s %12s %12s\n", "corpus", "bytes", "parse ns", "total ns", "mallocs/req", "arena B/req");
+    for (i = 0; i < n_corpora; i++) {
+        if (optind < argc) {
+            for (j = optind; j < argc; j++) {
+                if (strcmp(argv[j], corpora[i].name) == 0) break;
+            }
+            if (j == argc) continue;
+        }
+        bench_corpus(&corpora[i], iterations, chunk);
+    }
+    exit(0);
+}
+
+/**
+ * 計測に使うリクエストを用意する
+ * ブラウザが送る典型的なものから、大きなCookieやヘッダの多いもの、上限いっぱいのボディまで。
+ **/
+static void build_corpora(void)
+{
+    char cookie[LINE_BUF_SIZE * 2];
+    char many[HEADER_BUF_SIZE - 1024];
+    size_t len;
+    int i, n;
+
+    corpora[n_corpora].name = "short-get";
+    corpora[n_corpora].buf = make_request(&corpora[n_corpora].len,
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "User-Agent: curl/8.5.0\r\n"
+        "Accept: */*\r\n", 0);
+    n_corpora++;
+
+    corpora[n_corpora].name = "browser";
+    corpora[n_corpora].buf = make_request(&corpora[n_corpora].len,
+        "GET /static/css/site.css?v=20240101 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Accept: text/css,*/*;q=0.1\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Dest: style\r\n"
+        "Referer: https://www.example.com/\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Accept-Language: ja,en-US;q=0.9,en;q=0.8\r\n"
+        "If-None-Match: \"5f3a-1a2b3c4d\"\r\n"
+        "If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n", 0);
+    n_corpora++;
+
+    // セッションやトラッキング用のCookieが溜まった状態を想定する
+    len = snprintf(cookie, sizeof cookie, "GET /account HTTP/1.1\r\nHost: www.example.com\r\nCookie: ");
+    for (i = 0; len < sizeof cookie - 256; i++) {
+        len += snprintf(cookie + len, sizeof cookie - len, "%s_ga_%d=GA1.1.%d.%d; ", i ? "" : "sid=0123456789abcdef; ", i, 1700000000 + i * 7919, i * 104729);
+    }
+    snprintf(cookie + len, sizeof cookie - len, "theme=dark\r\nAccept: text/html\r\n");
+    corpora[n_corpora].name = "big-cookie";
+    corpora[n_corpora].buf = make_request(&corpora[n_corpora].len, cookie, 0);
+    n_corpora++;
+
+    // HTTP_MAX_HEADERSに近い数のヘッダ。既知のヘッダの重複(値の連結)も含める
+    len = snprintf(many, sizeof many, "GET /api/items HTTP/1.1\r\nHost: api.example.com\r\n");
+    n = HTTP_MAX_HEADERS - 2;
+    for (i = 0; i < n; i++) {
+        if (i % 10 == 0)
+            len += snprintf(many + len, sizeof many - len, "Accept-Encoding: gzip;q=0.%d\r\n", i / 10);
+        else
+            len += snprintf(many + len, sizeof many - len, "X-Custom-Header-%d: value-%d-abcdefghijklmnopqrstuvwxyz\r\n", i, i * 31);
+    }
+    corpora[n_corpora].name = "many-headers";
+    corpora[n_corpora].buf = make_request(&corpora[n_corpora].len, many, 0);
+    n_corpora++;
+
+    corpora[n_corpora].name = "post-1k";
+    corpora[n_corpora].buf = make_request(&corpora[n_corpora].len,
+        "POST /form HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n", 1024);
+    n_corpora++;
+
+    corpora[n_corpora].name = "post-max";
+    corpora[n_corpora].buf = make_request(&corpora[n_corpora].len,
+        "POST /upload HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Content-Type: application/octet-stream\r\n", MAX_REQUEST_BODY_LENGTH);
+    n_corpora++;
+}
+
+/**
+ * ヘッダの先頭部分headにContent-Lengthと空行、body_lenバイトのボディを付けたリクエストを作る
+ *
+ **/
+static char* make_request(size_t *len, const char *head, size_t body_len)
+{
+    char *buf;
+    size_t hlen = strlen(head);
+
+    buf = xmalloc(hlen + 64 + body_len);
+    memcpy(buf, head, hlen);
+    if (body_len > 0)
+        hlen += sprintf(buf + hlen, "Content-Length: %zu\r\n", body_len);
+    memcpy(buf + hlen, "\r\n", 2);
+    hlen += 2;
+    memset(buf + hlen, 'x', body_len);
+    *len = hlen + body_len;
+    return buf;
+}
+
+/**
+ * 1つのリクエストを繰り返し解析して結果を表示する
+ * 受信バッファへのコピー・解析・ヘッダの参照・接続のリセットまでを1リクエストとして数える。
+ **/
+static void bench_corpus(struct Corpus *c, long iterations, size_t chunk)
+{
+    struct Connection conn;
+    unsigned long mallocs;
+    double best = 0, ns, parse_ns;
+    size_t arena_bytes = 0;
+    int64_t t0;
+    long i;
+    int round;
+
+    init_connection(&conn, -1, NULL);
+    // 大きなボディは1回が重いので回数を減らす
+    if (c->len > HEADER_BUF_SIZE) iterations = iterations / 100 + 1;
+    parse_ns = parse_only(c, iterations);
+    // 1回目でアリーナのブロックを確保させてから数える
+    feed_request(&conn, c, chunk);
+    conn_reset(&conn);
+    mallocs = n_mallocs;
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        t0 = bench_now();
+        for (i = 0; i < iterations; i++) {
+            feed_request(&conn, c, chunk);
+            sink += (size_t)lookup_header_field_value(conn.req, HTTP_HEADER_HOST);
+            sink += (size_t)lookup_header_field_value(conn.req, HTTP_HEADER_CONNECTION);
+            sink += (size_t)lookup_header_field_value(conn.req, HTTP_HEADER_ACCEPT_ENCODING);
+            sink += (size_t)lookup_header_field_value(conn.req, HTTP_HEADER_IF_NONE_MATCH);
+            sink += (size_t)lookup_header_field_value(conn.req, HTTP_HEADER_RANGE);
+            sink += keep_alive_p(conn.req, 1);
+            if (round == 0 && i == 0) arena_bytes = arena_usage(&conn.arena);
+            conn_reset(&conn);
+        }
+        ns = (double)(bench_now() - t0) / iterations;
+        if (round == 0 || ns < best) best = ns;
+    }
+    mallocs = n_mallocs - mallocs;
+    printf("%-14s %8zu %10.1f %10.1f %12.2f %12zu\n", c->name, c->len, parse_ns, best,
+           (double)mallocs / (iterations * BENCH_ROUNDS), arena_bytes);
+    conn.fd = open("/dev/null", O_RDONLY);
+    release_connection(&conn);
+}
+
+/**
+ * http_parse_request()だけにかかる時間を測る
+ * パーサは入力を書き換えないので、同じバッファを繰り返し解析できる。
+ **/
+static double parse_only(struct Corpus *c, long iterations)
+{
+    struct HTTPParser parser;
+    double best = 0, ns;
+    int64_t t0;
+    long i;
+    int round;
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        t0 = bench_now();
+        for (i = 0; i < iterations; i++) {
+            http_parser_init(&parser);
+            if (http_parse_request(&parser, c->buf, c->len) != HTTP_PARSE_DONE)
+                log_exit("%s: parse error (%d)", c->name, parser.error);
+            sink += parser.nheaders;
+        }
+        ns = (double)(bench_now() - t0) / iterations;
+        if (round == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+/**
+ * リクエストをchunkバイトずつ受信したものとして接続に渡し、揃うまで解析する
+ * サーバがソケットから読むのと同じく、conn_read_buffer()の示す場所に書き込む。
+ **/
+static void feed_request(struct Connection *conn, struct Corpus *c, size_t chunk)
+{
+    size_t pos = 0, room, n;
+    char *buf;
+    int ret;
+
+    for (;;) {
+        buf = conn_read_buffer(conn, &room);
+        n = c->len - pos;
+        if (n > room) n = room;
+        if (chunk && n > chunk) n = chunk;
+        if (n == 0) log_exit("%s: request did not complete", c->name);
+        memcpy(buf, c->buf + pos, n);
+        pos += n;
+        conn_received(conn, n);
+        ret = conn_parse(conn, ".");
+        if (ret < 0) log_exit("%s: parse error (%d)", c->name, conn->error);
+        if (ret > 0) break;
+    }
+    // 次の周回で同じリクエストを読み直すので、余った分は残さない
+    conn->inpos = conn->inlen;
+}
+
+/**
+ * アリーナから割り当てたバイト数を数える
+ *
+ **/
+static size_t arena_usage(struct Arena *arena)
+{
+    struct ArenaBlock *b;
+    size_t n = 0;
+
+    for (b = arena->first; b && b != arena->current; b = b->next)
+        n += b->size;
+    if (arena->current) n += arena->used;
+    for (b = arena->large; b; b = b->next)
+        n += b->size;
+    return n;
+}
+
+static int64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void* __wrap_malloc(size_t sz)
+{
+    n_mallocs++;
+    return __real_malloc(sz);
+}
+
+void* __wrap_calloc(size_t n, size_t sz)
+{
+    n_mallocs++;
+    return __real_calloc(n, sz);
+}
+
+void* __wrap_realloc(void *p, size_t sz)
+{
+    n_mallocs++;
+    return __real_realloc(p, sz);
+}
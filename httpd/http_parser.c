@@ -0,0 +1,557 @@
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include "http_parser.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_X86
+#endif
+
+/**
+ * 区切り文字の走査
+ * 許されない文字(区切り文字や制御文字)を範囲の組で表し、そのどれかに当たる最初の位置を
+ * SSE4.2のpcmpestriやAVX2の比較命令で16～32バイトずつ探す。
+ * 高速版は候補の位置で止まるだけなので、そこから先と端数はchar_classを引いて1バイトずつ判定する。
+ * 比較に使うベクトルはselect_scanner()で一度だけ作っておく。
+ **/
+struct ByteRanges
+{
+    unsigned char r[16]; // [下限, 上限]の組を最大8つ
+    int len; // 使っているバイト数
+    unsigned char ok; // 通してよい文字のchar_classのビット
+#ifdef HTTP_PARSER_X86
+    __m128i ranges; // skip_sse42用
+    __m256i lo[8], span[8]; // skip_avx2用
+#endif
+};
+
+// char_classのビット
+#define CHAR_TOKEN 0x01 // tchar
+#define CHAR_VCHAR 0x02 // VCHARとobs-text
+#define CHAR_FIELD 0x04 // ヘッダの値に使える文字(VCHAR、obs-text、空白、タブ)
+
+// トークンに使えない文字。'|'と'~'も含んでしまうが、そこで止まった場合は1バイトずつの判定で拾い直す
+static struct ByteRanges token_delims = {
+    { 0x00, 0x20, '"', '"', '(', ')', ',', ',', '/', '/', ':', '@', '[', ']', '{', 0xff }, 16, CHAR_TOKEN
+};
+// パスに使えない文字
+static struct ByteRanges path_delims = { { 0x00, 0x20, 0x7f, 0x7f }, 4, CHAR_VCHAR };
+// ヘッダの値に使えない文字(空白とタブは使える)
+static struct ByteRanges value_delims = { { 0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f }, 6, CHAR_FIELD };
+
+// 文字ごとのCHAR_*のビット。select_scanner()で埋める
+static unsigned char char_class[256];
+
+static size_t skip_scalar(const char *buf, size_t i, size_t end, const struct ByteRanges *delims);
+static void fold_scalar(char *s, size_t len, char first);
+#ifdef HTTP_PARSER_X86
+static size_t skip_sse42(const char *buf, size_t i, size_t end, const struct ByteRanges *delims);
+static size_t skip_avx2(const char *buf, size_t i, size_t end, const struct ByteRanges *delims);
+static void prepare_sse42(struct ByteRanges *delims);
+static void prepare_avx2(struct ByteRanges *delims);
+static void fold_sse2(char *s, size_t len, char first);
+static void fold_avx2(char *s, size_t len, char first);
+#endif
+static void select_scanner(void);
+
+// CPUの機能に応じてselect_scanner()で選ぶ
+static size_t (*skip_fast)(const char *buf, size_t i, size_t end, const struct ByteRanges *delims);
+static void (*fold_fast)(char *s, size_t len, char first);
+
+/**
+ * 既知のヘッダ名の完全ハッシュ表
+ * 長さと先頭・末尾の文字(小文字化したもの)から作ったキーにKNOWN_HEADER_MULTIPLIERを掛け、
+ * 上位5ビットを添字にする。乗数は下の名前が互いに衝突しないものを探して決めてある。
+ * ヘッダを追加したときは衝突しない乗数を選び直し、添字も付け直すこと。
+ **/
+#define KNOWN_HEADER_MULTIPLIER 0xb1fee08fU
+#define KNOWN_HEADER_BITS 5
+
+struct KnownHeader
+{
+    const char *name;
+    enum HTTPHeaderId id;
+};
+
+static const struct KnownHeader known_headers[1 << KNOWN_HEADER_BITS] = {
+    [0] = { "transfer-encoding", HTTP_HEADER_TRANSFER_ENCODING },
+    [1] = { "cookie", HTTP_HEADER_COOKIE },
+    [3] = { "range", HTTP_HEADER_RANGE },
+    [5] = { "content-length", HTTP_HEADER_CONTENT_LENGTH },
+    [8] = { "if-none-match", HTTP_HEADER_IF_NONE_MATCH },
+    [10] = { "content-type", HTTP_HEADER_CONTENT_TYPE },
+    [11] = { "accept-encoding", HTTP_HEADER_ACCEPT_ENCODING },
+    [13] = { "if-unmodified-since", HTTP_HEADER_IF_UNMODIFIED_SINCE },
+    [14] = { "authorization", HTTP_HEADER_AUTHORIZATION },
+    [15] = { "expect", HTTP_HEADER_EXPECT },
+    [21] = { "if-modified-since", HTTP_HEADER_IF_MODIFIED_SINCE },
+    [22] = { "host", HTTP_HEADER_HOST },
+    [25] = { "if-range", HTTP_HEADER_IF_RANGE },
+    [26] = { "connection", HTTP_HEADER_CONNECTION },
+    [27] = { "if-match", HTTP_HEADER_IF_MATCH },
+    [28] = { "referer", HTTP_HEADER_REFERER },
+    [29] = { "user-agent", HTTP_HEADER_USER_AGENT },
+};
+
+static size_t skip_token(const char *buf, size_t i, size_t end);
+static size_t skip_chars(const char *buf, size_t i, size_t end, const struct ByteRanges *delims);
+static int parse_message(struct HTTPParser *p, const char *buf, size_t len,
+                         int (*start_line)(struct HTTPParser *p, const char *buf, size_t off, size_t len));
+static int parse_request_line(struct HTTPParser *p, const char *buf, size_t off, size_t len);
+static int parse_status_line(struct HTTPParser *p, const char *buf, size_t off, size_t len);
+static int parse_header_field(struct HTTPParser *p, const char *buf, size_t off, size_t len);
+static int parse_content_length(struct HTTPParser *p, const char *buf, const struct HTTPSlice *value);
+static int is_tchar(unsigned char c);
+static int fail(struct HTTPParser *p, enum HTTPParseError error);
+
+/**
+ * パーサを初期状態にする
+ * 
+ **/
+void http_parser_init(struct HTTPParser *p)
+{
+    if (!skip_fast) select_scanner();
+    p->state = HTTP_STATE_REQUEST_LINE;
+    p->error = HTTP_ERROR_NONE;
+    p->pos = 0;
+    p->scan = 0;
+    p->method.off = p->method.len = 0;
+    p->path.off = p->path.len = 0;
+    p->minor_version = 0;
+    p->status = 0;
+    p->reason.off = p->reason.len = 0;
+    p->nheaders = 0;
+    p->content_length = -1;
+}
+
+/**
+ * buf[0..len)をリクエストの先頭から解析する
+ * 前回の呼び出しで解析し終えた行は読み直さないので、データが届くたびに同じバッファで呼べばよい。
+ * 行末はCRLFを基本とし、LFだけのものも受け付ける。
+ **/
+int http_parse_request(struct HTTPParser *p, const char *buf, size_t len)
+{
+    return parse_message(p, buf, len, parse_request_line);
+}
+
+/**
+ * buf[0..len)をレスポンスの先頭から解析する
+ * 呼び方はhttp_parse_request()と同じ。ステータスコードはp->statusに入る。
+ **/
+int http_parse_response(struct HTTPParser *p, const char *buf, size_t len)
+{
+    return parse_message(p, buf, len, parse_status_line);
+}
+
+/**
+ * スライスが指す文字列がstrと等しいかを大文字小文字を区別せずに比べる
+ * 
+ **/
+int http_slice_equal(const char *buf, const struct HTTPSlice *s, const char *str)
+{
+    return strlen(str) == s->len && strncasecmp(buf + s->off, str, s->len) == 0;
+}
+
+/**
+ * ヘッダ名を既知のヘッダの番号に変換する
+ * 大文字小文字は区別しない。既知のヘッダでなければHTTP_HEADER_UNKNOWNを返す。
+ **/
+enum HTTPHeaderId http_header_id(const char *name, size_t len)
+{
+    const struct KnownHeader *k;
+    unsigned int key;
+
+    if (len == 0) return HTTP_HEADER_UNKNOWN;
+    key = ((unsigned int)len << 16)
+        | (((unsigned char)name[0] | 0x20) << 8)
+        | ((unsigned char)name[len - 1] | 0x20);
+    k = &known_headers[(key * KNOWN_HEADER_MULTIPLIER) >> (32 - KNOWN_HEADER_BITS)];
+    // 表にない名前も同じ添字に来るので、最後に名前を比べて確かめる
+    if (k->name && strlen(k->name) == len && strncasecmp(name, k->name, len) == 0) return k->id;
+    return HTTP_HEADER_UNKNOWN;
+}
+
+/**
+ * 既知のヘッダの番号から名前(小文字)を返す
+ * リクエストを組み立て直してバックエンドに渡すときなどに使う。
+ **/
+const char* http_header_name(enum HTTPHeaderId id)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof known_headers / sizeof known_headers[0]; i++) {
+        if (known_headers[i].name && known_headers[i].id == id) return known_headers[i].name;
+    }
+    return NULL;
+}
+
+/**
+ * ASCIIの英小文字を大文字にする
+ * メソッド名の正規化に使う。
+ **/
+void http_upcase(char *s, size_t len)
+{
+    if (!fold_fast) select_scanner();
+    fold_fast(s, len, 'a');
+}
+
+/**
+ * ASCIIの英大文字を小文字にする
+ * ヘッダ名の正規化に使う。
+ **/
+void http_downcase(char *s, size_t len)
+{
+    if (!fold_fast) select_scanner();
+    fold_fast(s, len, 'A');
+}
+
+/**
+ * 開始行とヘッダを1行ずつ解析する
+ * 開始行はstart_lineで解析し、ヘッダの解析はリクエストとレスポンスで共通にする。
+ **/
+static int parse_message(struct HTTPParser *p, const char *buf, size_t len,
+                         int (*start_line)(struct HTTPParser *p, const char *buf, size_t off, size_t len))
+{
+    const char *nl;
+    size_t eol, linelen;
+
+    for (;;) {
+        if (p->state == HTTP_STATE_DONE) return HTTP_PARSE_DONE;
+        if (p->state == HTTP_STATE_ERROR) return HTTP_PARSE_ERROR;
+        nl = memchr(buf + p->scan, '\n', len - p->scan);
+        if (!nl) {
+            p->scan = len;
+            return HTTP_PARSE_AGAIN;
+        }
+        eol = nl - buf;
+        linelen = eol - p->pos;
+        if (linelen > 0 && buf[eol - 1] == '\r') linelen--;
+        if (p->state == HTTP_STATE_REQUEST_LINE) {
+            // 開始行の前の空行は読み飛ばしてよいことになっている
+            if (linelen > 0) {
+                if (start_line(p, buf, p->pos, linelen) < 0) return HTTP_PARSE_ERROR;
+                p->state = HTTP_STATE_HEADER;
+            }
+        }
+        else if (linelen == 0) {
+            // 空行でヘッダが終わる
+            p->state = HTTP_STATE_DONE;
+        }
+        else {
+            if (parse_header_field(p, buf, p->pos, linelen) < 0) return HTTP_PARSE_ERROR;
+        }
+        p->pos = p->scan = eol + 1;
+    }
+}
+
+/**
+ * リクエストライン "METHOD SP request-target SP HTTP/1.x" を解析する
+ * 
+ **/
+static int parse_request_line(struct HTTPParser *p, const char *buf, size_t off, size_t len)
+{
+    size_t i = off, end = off + len;
+
+    // メソッドはトークン文字だけからなる
+    p->method.off = i;
+    i = skip_token(buf, i, end);
+    p->method.len = i - p->method.off;
+    if (p->method.len == 0 || i == end || buf[i] != ' ') return fail(p, HTTP_ERROR_BAD_REQUEST_LINE);
+    i++;
+
+    // パスは空白や制御文字を含まない
+    p->path.off = i;
+    i = skip_chars(buf, i, end, &path_delims);
+    p->path.len = i - p->path.off;
+    if (p->path.len == 0 || i == end || buf[i] != ' ') return fail(p, HTTP_ERROR_BAD_REQUEST_LINE);
+    i++;
+
+    // 残りはちょうど"HTTP/1.x"の8文字でなければならない
+    if (end - i != 8 || strncmp(buf + i, "HTTP/1.", 7) != 0) return fail(p, HTTP_ERROR_BAD_VERSION);
+    if (buf[i + 7] < '0' || buf[i + 7] > '9') return fail(p, HTTP_ERROR_BAD_VERSION);
+    p->minor_version = buf[i + 7] - '0';
+    return 0;
+}
+
+/**
+ * ステータスライン "HTTP/1.x SP 3DIGIT SP reason-phrase" を解析する
+ * 理由句は空でもよく、その前の空白がないものも受け付ける。
+ **/
+static int parse_status_line(struct HTTPParser *p, const char *buf, size_t off, size_t len)
+{
+    size_t i = off, end = off + len;
+
+    if (len < 12 || strncmp(buf + i, "HTTP/1.", 7) != 0 || buf[i + 7] < '0' || buf[i + 7] > '9' || buf[i + 8] != ' ')
+        return fail(p, HTTP_ERROR_BAD_STATUS_LINE);
+    p->minor_version = buf[i + 7] - '0';
+    i += 9;
+    if (buf[i] < '1' || buf[i] > '5' || buf[i + 1] < '0' || buf[i + 1] > '9' || buf[i + 2] < '0' || buf[i + 2] > '9')
+        return fail(p, HTTP_ERROR_BAD_STATUS_LINE);
+    p->status = (buf[i] - '0') * 100 + (buf[i + 1] - '0') * 10 + (buf[i + 2] - '0');
+    i += 3;
+    if (i < end && buf[i++] != ' ') return fail(p, HTTP_ERROR_BAD_STATUS_LINE);
+    p->reason.off = i;
+    p->reason.len = end - i;
+    if (skip_chars(buf, i, end, &value_delims) != end) return fail(p, HTTP_ERROR_BAD_STATUS_LINE);
+    return 0;
+}
+
+/**
+ * ヘッダ行 "name: value" を解析してheaders[]に加える
+ * 名前と":"の間の空白や、行頭の空白による継続行(obs-fold)は受け付けない。
+ **/
+static int parse_header_field(struct HTTPParser *p, const char *buf, size_t off, size_t len)
+{
+    struct HTTPParsedHeader *h;
+    size_t i = off, end = off + len, vend;
+
+    if (p->nheaders == HTTP_MAX_HEADERS) return fail(p, HTTP_ERROR_TOO_MANY_HEADERS);
+    h = &p->headers[p->nheaders];
+
+    h->name.off = i;
+    i = skip_token(buf, i, end);
+    h->name.len = i - off;
+    if (h->name.len == 0 || i == end || buf[i] != ':') return fail(p, HTTP_ERROR_BAD_HEADER);
+    i++;
+
+    // 値の前後の空白(OWS)は値に含めない
+    while (i < end && (buf[i] == ' ' || buf[i] == '\t')) i++;
+    vend = end;
+    while (vend > i && (buf[vend - 1] == ' ' || buf[vend - 1] == '\t')) vend--;
+    h->value.off = i;
+    h->value.len = vend - i;
+    if (skip_chars(buf, i, vend, &value_delims) != vend) return fail(p, HTTP_ERROR_BAD_HEADER);
+
+    h->id = http_header_id(buf + h->name.off, h->name.len);
+    if (h->id == HTTP_HEADER_CONTENT_LENGTH) {
+        if (parse_content_length(p, buf, &h->value) < 0) return -1;
+    }
+    p->nheaders++;
+    return 0;
+}
+
+/**
+ * Content-Lengthの値を数字だけからなる0以上の整数として読む
+ * 複数のContent-Lengthが異なる値を持つ場合は不正とする。
+ **/
+static int parse_content_length(struct HTTPParser *p, const char *buf, const struct HTTPSlice *value)
+{
+    long n = 0;
+    size_t i;
+
+    if (value->len == 0) return fail(p, HTTP_ERROR_BAD_CONTENT_LENGTH);
+    for (i = 0; i < value->len; i++) {
+        char c = buf[value->off + i];
+
+        if (c < '0' || c > '9') return fail(p, HTTP_ERROR_BAD_CONTENT_LENGTH);
+        if (n > (LONG_MAX - (c - '0')) / 10) return fail(p, HTTP_ERROR_BAD_CONTENT_LENGTH);
+        n = n * 10 + (c - '0');
+    }
+    if (p->content_length >= 0 && p->content_length != n) return fail(p, HTTP_ERROR_BAD_CONTENT_LENGTH);
+    p->content_length = n;
+    return 0;
+}
+
+/**
+ * トークン文字が続く間を読み飛ばし、最初のトークン以外の文字の位置を返す
+ * 
+ **/
+static size_t skip_token(const char *buf, size_t i, size_t end)
+{
+    return skip_chars(buf, i, end, &token_delims);
+}
+
+/**
+ * delims->okの文字が続く間を読み飛ばし、それ以外の最初の文字の位置を返す
+ * 高速版は最初の候補までしか進めないので、残りは表を引いて1バイトずつ進める。
+ * delimsはokでない文字を全て含んでいなければならない。
+ **/
+static size_t skip_chars(const char *buf, size_t i, size_t end, const struct ByteRanges *delims)
+{
+    i = skip_fast(buf, i, end, delims);
+    while (i < end && (char_class[(unsigned char)buf[i]] & delims->ok)) i++;
+    return i;
+}
+
+/**
+ * CPUIDで使える命令を調べ、走査と大文字小文字変換の実装を選ぶ
+ * 文字の分類表と、選んだ走査で使う区切り文字のベクトルもここで作る。
+ **/
+static void select_scanner(void)
+{
+    int c;
+
+    for (c = 0; c < 256; c++) {
+        if ((c > 0x20 && c < 0x7f) || c >= 0x80) char_class[c] |= CHAR_VCHAR | CHAR_FIELD;
+        if (c == ' ' || c == '\t') char_class[c] |= CHAR_FIELD;
+        if (is_tchar(c)) char_class[c] |= CHAR_TOKEN;
+    }
+    skip_fast = skip_scalar;
+    fold_fast = fold_scalar;
+#ifdef HTTP_PARSER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        prepare_avx2(&token_delims);
+        prepare_avx2(&path_delims);
+        prepare_avx2(&value_delims);
+        skip_fast = skip_avx2;
+        fold_fast = fold_avx2;
+    }
+    else {
+        if (__builtin_cpu_supports("sse4.2")) {
+            prepare_sse42(&token_delims);
+            prepare_sse42(&path_delims);
+            prepare_sse42(&value_delims);
+            skip_fast = skip_sse42;
+        }
+        if (__builtin_cpu_supports("sse2")) fold_fast = fold_sse2;
+    }
+#endif
+}
+
+/**
+ * 高速版が使えない場合は何もしない。判定は呼び出し側の1バイトずつのループに任せる
+ * 
+ **/
+static size_t skip_scalar(const char *buf, size_t i, size_t end, const struct ByteRanges *delims)
+{
+    return i;
+}
+
+static void fold_scalar(char *s, size_t len, char first)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if ((unsigned char)(s[i] - first) < 26) s[i] ^= 0x20;
+    }
+}
+
+#ifdef HTTP_PARSER_X86
+/**
+ * pcmpestriに渡す範囲の組をベクトルにしておく
+ * 
+ **/
+__attribute__((target("sse4.2")))
+static void prepare_sse42(struct ByteRanges *delims)
+{
+    delims->ranges = _mm_loadu_si128((const __m128i *)delims->r);
+}
+
+/**
+ * delimsのどれかに当たる最初の位置まで16バイトずつ進める
+ * 16バイトに満たない端数は読まずに返す(バッファの外を読まないため)。
+ **/
+__attribute__((target("sse4.2")))
+static size_t skip_sse42(const char *buf, size_t i, size_t end, const struct ByteRanges *delims)
+{
+    int idx;
+
+    while (end - i >= 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i));
+
+        idx = _mm_cmpestri(delims->ranges, delims->len, b, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) return i + idx;
+        i += 16;
+    }
+    return i;
+}
+
+/**
+ * 範囲ごとの下限と幅を32バイトに広げておく
+ * 
+ **/
+__attribute__((target("avx2")))
+static void prepare_avx2(struct ByteRanges *delims)
+{
+    int k;
+
+    for (k = 0; k < delims->len / 2; k++) {
+        delims->lo[k] = _mm256_set1_epi8((char)delims->r[k * 2]);
+        delims->span[k] = _mm256_set1_epi8((char)(delims->r[k * 2 + 1] - delims->r[k * 2]));
+    }
+}
+
+/**
+ * AVX2にはpcmpestriに当たる命令がないので、範囲ごとに (c - 下限) <= (上限 - 下限) を符号なしで比べる
+ * 32バイトずつ進め、端数は読まずに返す。
+ **/
+__attribute__((target("avx2")))
+static size_t skip_avx2(const char *buf, size_t i, size_t end, const struct ByteRanges *delims)
+{
+    int n = delims->len / 2, k;
+    unsigned mask;
+
+    while (end - i >= 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i hit = _mm256_setzero_si256();
+
+        for (k = 0; k < n; k++) {
+            __m256i d = _mm256_sub_epi8(b, delims->lo[k]);
+
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_min_epu8(d, delims->span[k]), d));
+        }
+        mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    return i;
+}
+
+/**
+ * firstから26文字の範囲にある文字の0x20のビットを反転し、大文字と小文字を入れ替える
+ * 
+ **/
+__attribute__((target("sse2")))
+static void fold_sse2(char *s, size_t len, char first)
+{
+    __m128i base = _mm_set1_epi8(first), span = _mm_set1_epi8(25), flip = _mm_set1_epi8(0x20);
+    size_t i = 0;
+
+    for (; len - i >= 16; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i d = _mm_sub_epi8(b, base);
+        __m128i in = _mm_cmpeq_epi8(_mm_min_epu8(d, span), d);
+
+        _mm_storeu_si128((__m128i *)(s + i), _mm_xor_si128(b, _mm_and_si128(in, flip)));
+    }
+    fold_scalar(s + i, len - i, first);
+}
+
+__attribute__((target("avx2")))
+static void fold_avx2(char *s, size_t len, char first)
+{
+    __m256i base = _mm256_set1_epi8(first), span = _mm256_set1_epi8(25), flip = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+
+    for (; len - i >= 32; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i d = _mm256_sub_epi8(b, base);
+        __m256i in = _mm256_cmpeq_epi8(_mm256_min_epu8(d, span), d);
+
+        _mm256_storeu_si256((__m256i *)(s + i), _mm256_xor_si256(b, _mm256_and_si256(in, flip)));
+    }
+    fold_sse2(s + i, len - i, first);
+}
+#endif
+
+/**
+ * RFC 9110のtchar(トークンに使える文字)かどうか
+ * char_classを作るときにだけ使う。解析中は表を引く。
+ **/
+static int is_tchar(unsigned char c)
+{
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return 1;
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/**
+ * エラーを記録して-1を返す
+ * 
+ **/
+static int fail(struct HTTPParser *p, enum HTTPParseError error)
+{
+    p->state = HTTP_STATE_ERROR;
+    p->error = error;
+    return -1;
+}
@@ -0,0 +1,104 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+/**
+ * HTTPリクエストの逐次パーサ
+ * 受信バッファ上のバイト列を直接解析し、メソッドやヘッダを位置と長さで返す。文字列のコピーはしない。
+ * 上流のサーバから受け取るレスポンスのヘッダも同じ仕組みで解析する。
+ * データが足りなければHTTP_PARSE_AGAINを返すので、続きを受信してから同じバッファでもう一度呼べばよい。
+ **/
+
+#define HTTP_MAX_HEADERS 100
+
+// バッファ上の範囲。バッファの先頭からの位置で表すので、バッファを移動しても有効なまま
+struct HTTPSlice
+{
+    size_t off;
+    size_t len;
+};
+
+// サーバが参照するヘッダ。解析時に名前からこの番号に変換しておく
+enum HTTPHeaderId
+{
+    HTTP_HEADER_UNKNOWN = -1,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_COOKIE,
+    HTTP_HEADER_EXPECT,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_IF_MATCH,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_IF_UNMODIFIED_SINCE,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_REFERER,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_COUNT
+};
+
+struct HTTPParsedHeader
+{
+    struct HTTPSlice name;
+    struct HTTPSlice value; // 前後の空白は含まない
+    enum HTTPHeaderId id; // 既知のヘッダでなければHTTP_HEADER_UNKNOWN
+};
+
+enum HTTPParseResult
+{
+    HTTP_PARSE_ERROR = -1, // 不正なリクエスト
+    HTTP_PARSE_AGAIN = 0, // データが足りない
+    HTTP_PARSE_DONE = 1 // ヘッダの終わりまで解析した
+};
+
+enum HTTPParseState
+{
+    HTTP_STATE_REQUEST_LINE, // レスポンスではステータスライン
+    HTTP_STATE_HEADER,
+    HTTP_STATE_DONE,
+    HTTP_STATE_ERROR
+};
+
+enum HTTPParseError
+{
+    HTTP_ERROR_NONE,
+    HTTP_ERROR_BAD_REQUEST_LINE,
+    HTTP_ERROR_BAD_VERSION,
+    HTTP_ERROR_BAD_HEADER,
+    HTTP_ERROR_TOO_MANY_HEADERS,
+    HTTP_ERROR_BAD_CONTENT_LENGTH,
+    HTTP_ERROR_BAD_STATUS_LINE
+};
+
+struct HTTPParser
+{
+    enum HTTPParseState state;
+    enum HTTPParseError error;
+    size_t pos; // 解析を終えた位置。HTTP_PARSE_DONEの後はボディの先頭を指す
+    size_t scan; // 改行を探し終えた位置。続きを受信したらここから探す
+    struct HTTPSlice method;
+    struct HTTPSlice path;
+    int minor_version;
+    int status; // レスポンスのステータスコード
+    struct HTTPSlice reason; // レスポンスの理由句
+    struct HTTPParsedHeader headers[HTTP_MAX_HEADERS]; // 届いた順に並ぶ
+    int nheaders;
+    long content_length; // Content-Lengthがなければ-1
+};
+
+void http_parser_init(struct HTTPParser *p);
+int http_parse_request(struct HTTPParser *p, const char *buf, size_t len);
+int http_parse_response(struct HTTPParser *p, const char *buf, size_t len);
+int http_slice_equal(const char *buf, const struct HTTPSlice *s, const char *str);
+enum HTTPHeaderId http_header_id(const char *name, size_t len);
+const char* http_header_name(enum HTTPHeaderId id);
+void http_upcase(char *s, size_t len);
+void http_downcase(char *s, size_t len);
+
+#endif
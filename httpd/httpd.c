@@ -11,12 +11,14 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <signal.h>
+#include "http_parser.h"
 
 #define SERVER_NAME "LittleHTTP"
 #define SERVER_VERSION "1.0"
 #define HTTP_MINOR_VERSION 0
 #define BLOCK_BUF_SIZE 1024
 #define LINE_BUF_SIZE 4096
+#define HEADER_BUF_SIZE (LINE_BUF_SIZE * 4)
 #define MAX_REQUEST_BODY_LENGTH (1024 * 1024)
 
 /****** Data Type Definitions ********************************************/
@@ -36,6 +38,7 @@ struct HTTPRequest
     struct HTTPHeaderField *header; // HTTPヘッダ これは既に定義されている
     char *body; // エンティティボディ
     long length; // エンティティボディのサイズ
+    char *buf; // 受信バッファ。method・path・ヘッダはこの中を指している
 };
 
 struct FileInfo
@@ -54,12 +57,8 @@ static void trap_signal(int sig, sighandler_t handler);
 static void signal_exit(int sig);
 static void service(FILE *in, FILE *out, char *docroot);
 static struct HTTPRequest* read_request(FILE *in);
-static void read_request_line(struct HTTPRequest *req, FILE *in);
-static struct HTTPHeaderField* read_header_field(FILE *in);
-static void upcase(char *str);
+static char* slice_string(char *buf, struct HTTPSlice *s);
 static void free_request(struct HTTPRequest *req);
-static long content_length(struct HTTPRequest *req);
-static char* lookup_header_field_value(struct HTTPRequest *req, char *name);
 static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
 static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot);
 static void method_not_allowed(struct HTTPRequest *req, FILE *out);
@@ -84,15 +83,6 @@ int main(int argc, char *argv[])
     exit(0);
 }
 
-static void upcase(char *str)
-{
-    char *p;
-
-    for (p = str; *p; p++) {
-        *p = (char)toupper((int)*p);
-    }
-}
-
 /**
  * 構造体requestに割り当てられているメモリを解放する
  * 
@@ -110,165 +100,88 @@ static void free_request(struct HTTPRequest *req)
         // 次のheadを格納する。
         // headを先に解放してしまうとnextも参照できなくなってしまうのでこの時点で取っておく必要がある。
         head = head->next;
-        free(h->name);
-        free(h->value);
         free(h);
     }
     // memberが持っている値と構造体自体はあくまで別の実体（メモリ）を持っているのでそれぞれ個別に解放する必要がある。
-    free(req->method);
-    free(req->path);
+    // method・path・ヘッダの名前と値は受信バッファの中を指しているのでbufだけ解放すればよい。
+    free(req->buf);
     free(req->body);
     free(req);
 }
 
 /**
  * ファイルディスクリプタを受け取りストリームを解析してリクエスト構造体に格納する
- * 
+ * ヘッダの終わりまでを1つのバッファに読み込み、http_parserで解析する。
  **/
 static struct HTTPRequest* read_request(FILE *in)
 {
     struct HTTPRequest *req;
     struct HTTPHeaderField *h;
+    struct HTTPParser parser;
+    size_t len = 0, rest;
+    ssize_t n;
+    int fd = fileno(in);
+    int i;
 
     req = xmalloc(sizeof(struct HTTPRequest));
-    // 確保されているメモリへのポインタとストリームを受け取ってメモリにラインを書き込む。
-    read_request_line(req, in);
+    req->buf = xmalloc(HEADER_BUF_SIZE);
     req->header = NULL;
-    // ファイルディスクリプタを受け取ってヘッダを取得する。ポインタを進める。
-    // 一度に一つづつヘッダを読み込む。ヘッダがなくなったらNULLを返す。
-    while (h = read_header_field(in)) {
+    req->body = NULL;
+    http_parser_init(&parser);
+    // 届いた分を解析し、足りなければ続きを読む。stdioのバッファは使わない
+    for (;;) {
+        int ret = http_parse_request(&parser, req->buf, len);
+
+        if (ret == HTTP_PARSE_DONE) break;
+        if (ret == HTTP_PARSE_ERROR) log_exit("parse error on request (%d)", parser.error);
+        if (len == HEADER_BUF_SIZE) log_exit("request header too long");
+        n = read(fd, req->buf + len, HEADER_BUF_SIZE - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) log_exit("failed to read request: %s", n < 0 ? strerror(errno) : "unexpected EOF");
+        len += n;
+    }
+    // 解析結果はバッファ上の位置なので、区切り文字を終端に置き換えてそのまま文字列として使う
+    req->method = slice_string(req->buf, &parser.method);
+    http_upcase(req->method, parser.method.len);
+    req->path = slice_string(req->buf, &parser.path);
+    req->protocol_minor_version = parser.minor_version;
+    for (i = 0; i < parser.nheaders; i++) {
+        h = xmalloc(sizeof(struct HTTPHeaderField));
+        h->name = slice_string(req->buf, &parser.headers[i].name);
+        h->value = slice_string(req->buf, &parser.headers[i].value);
         // 現在のヘッダのnextに前回のヘッダを入れる。
-        // 初回はNULL
-        // スタックされている
         h->next = req->header;
         req->header = h;
     }
-    req->length = content_length(req);
+    req->length = parser.content_length > 0 ? parser.content_length : 0;
     if (req->length != 0){
         if (req->length > MAX_REQUEST_BODY_LENGTH){
             log_exit("request body too long");
         }
         req->body = xmalloc(req->length);
-        if (fread(req->body,req->length,1,in)<1){
-            log_exit("failed to read request body");
+        // ヘッダと一緒に読み込んでしまった分を移してから残りを読む
+        rest = len - parser.pos;
+        if (rest > (size_t)req->length) rest = req->length;
+        memcpy(req->body, req->buf + parser.pos, rest);
+        while (rest < (size_t)req->length) {
+            n = read(fd, req->body + rest, req->length - rest);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) log_exit("failed to read request body");
+            rest += n;
         }
-    }else{
-        req->body = NULL;
     }
 
     return req;
 }
 
 /**
- * ファイルディスクリプタinからリクエストラインを読み込んで構造体リクエストに書き込む
- * 
- **/
-static void read_request_line(struct HTTPRequest *req, FILE *in)
-{
-    // バッファのメモリを確保する
-    char buf[LINE_BUF_SIZE];
-    // 文字列が格納されているポインタ型のpathとpを宣言する。
-    char *path, *p;
-
-    // buf に一行づつ読み込む
-    if (!fgets(buf,LINE_BUF_SIZE,in)){
-        log_exit("no request line");
-    }
-    // strchrは第一引数の文字列ないで最初に第二引数のパターンが現れた位置へのポインターを返す
-    p = strchr(buf, ' ');
-    if (!p){
-        log_exit("parse error on request line (1): %s", buf);
-    }
-    *p++ = '\0';
-    // bufは配列の識別子である。bufの先頭のアドレスのポインタである。そしてpは同じ配列内のmethodの終端のポインタである。
-    // なのでp - bufは配列のアドレスの差分を取っているためそれがつまりmethodのサイズになる。
-    req->method = xmalloc(p - buf);
-    strcpy(req->method, buf);
-    upcase(req->method);
-
-    // pはmethodの終端のアドレスなのでpathの先頭ということになる。
-    path = p;
-    p = strchr(path, ' ');
-    if (!p){
-        log_exit("parse error on request line (2): %s", buf);
-    }
-    *p++ = '\0';
-    req->path = xmalloc(p - path);
-    strcpy(req->path, path);
-
-    if(strncasecmp(p,"HTTP/1.", strlen("HTTP/1."))!=0){
-        log_exit("parse error on request line (3): %s", buf);
-    }
-    p += strlen("HTTP/1.");
-    req->protocol_minor_version = atoi(p);
-}
-
-/**
- * ファイルディスクリプタを受け取ってHTTPHeaderField構造体を作成し、そのポインタを返す
- * 
- **/
-static struct HTTPHeaderField* read_header_field(FILE *in)
-{
-    struct HTTPHeaderField *h;
-    char buf[LINE_BUF_SIZE];
-    char *p;
-
-    if(!fgets(buf, LINE_BUF_SIZE, in)){
-        log_exit("faild to read request header field: %s", strerror(errno));
-    }
-    if((buf[0]=='\n')||(strcmp(buf, "\r\n")==0)){
-        return NULL;
-    }
-    // ヘッダのkeyとvalは:で区切られている
-    p = strchr(buf, ':');
-    if(!p){
-        log_exit("parse error on request header field: %s", buf);
-    }
-    *p++ = '\0';
-    // 構造体は入れ物だがサイズを持っている
-    // それぞれの部屋は別途領域を用意する必要がある。
-    h = xmalloc(sizeof(struct HTTPHeaderField));
-    h->name = xmalloc(p - buf);
-    strcpy(h->name, buf);
-
-
-    p += strspn(p, " \t");
-    h->value = xmalloc(strlen(p) + 1);
-    strcpy(h->value, p);
-
-    return h;
-}
-
-/**
- * リクエストのエンティティボディのサイズを取得する
+ * スライスの直後(空白や":"、改行などの区切り文字)を終端に置き換えて文字列にする
  * 
  **/
-static long content_length(struct HTTPRequest *req)
+static char* slice_string(char *buf, struct HTTPSlice *s)
 {
-    char *val;
-    long len;
-    
-    val = lookup_header_field_value(req, "Content-Length");
-    if (!val) return 0;
-    // 型の変換を行う
-    len = atol(val);
-    if (len < 0) log_exit("negative Content-Length value");
-    return len;
-}
-
-/**
- * 指定のヘッダフィールドの値を取得する
- * 
- **/
-static char* lookup_header_field_value(struct HTTPRequest *req, char *name)
-{
-    struct HTTPHeaderField *h;
-
-    for (h = req->header; h; h = h->next) {
-        if (strcasecmp(h->name, name) == 0)
-            return h->value;
-    }
-    return NULL;
+    buf[s->off + s->len] = '\0';
+    return buf + s->off;
 }
 
 /**
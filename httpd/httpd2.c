@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,21 +12,139 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <signal.h>
+#include <getopt.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "http_parser.h"
+#include "backend_protocol.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
 
 #define SERVER_NAME "LittleHTTP"
 #define SERVER_VERSION "1.0"
-#define HTTP_MINOR_VERSION 0
-#define BLOCK_BUF_SIZE 1024
+#define HTTP_MINOR_VERSION 1
 #define LINE_BUF_SIZE 4096
+#define HEADER_BUF_SIZE (LINE_BUF_SIZE * 4)
+#define ARENA_BLOCK_SIZE 8192
 #define MAX_REQUEST_BODY_LENGTH (1024 * 1024)
+#define DEFAULT_BACKLOG SOMAXCONN
+#define MAX_WORKERS 256
+#define MAX_EVENTS 64
+#define URING_ENTRIES 256
+#define URING_CQ_MAX 65536 // カーネルが受け付けるCQの大きさの上限
+#define URING_BUFS 128 // 受信に使うバッファのリングの大きさ。2のべき乗
+#define URING_BUF_GROUP 0
+#define LOG_RING_SIZE (256 * 1024) // 2のべき乗
+#define LOG_LINE_MAX 2048
+#define LOG_FLUSH_INTERVAL_MS 100
+#define HIST_SUB_BITS 3 // 2のべき乗の区間をさらに2^HIST_SUB_BITSに分ける(誤差は12.5%以内)
+#define HIST_BUCKETS 304 // 2^40ナノ秒(約18分)まで
+#define STATS_BUF_SIZE (256 * 1024)
+#define DEFAULT_LOG_FORMAT "%a - - [%t] \"%m %U\" %s %b %D"
+#define URING_ACCEPT 1 // 接続ではない完了のuser_data
+#define URING_TIMER 2
+#define FILE_CHUNK_SIZE (64 * 1024)
+#define SPLICE_CHUNK_SIZE (64 * 1024) // パイプの既定の容量に合わせる
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define HEADER_TIMEOUT 10 // リクエストの最初のバイトからヘッダを受け取り終えるまでの秒数。少しずつ送ってきても延ばさない
+#define BODY_TIMEOUT 10 // ボディの受信が進まないまま待つ秒数
+#define SEND_TIMEOUT 10 // レスポンスの送信が進まないまま待つ秒数
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 1ティック1秒で64^4秒(約194日)先まで仕掛けられる
+#define DEFAULT_MAX_REQUESTS 100
+#define ERROR_PAGE_MAX_SIZE (64 * 1024)
+#define DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+#define CACHE_MAX_ENTRY_SIZE (256 * 1024)
+#define CACHE_HEADER_SIZE 512
+#define CACHE_PATH_MAX 256
+#define CACHE_AVG_ENTRY_SIZE 8192
+#define CACHE_PROBES 8
+#define CACHE_PIN_SHIFT 24 // ピンの下位ビットに長さ、上位ビットに位置を入れる
+#define RESPONSE_IOV_MAX 64
+#define MAX_RANGES 16
+#define ETAG_SIZE 64
+#define TIME_BUF_SIZE 64
+#define COMPRESS_MIN_SIZE 256
+#define MMAP_MAX_FILE_SIZE (4 * 1024 * 1024)
+#define MMAP_MAX_ENTRIES 256
+#define MMAP_TABLE_SIZE 512 // 2のべき乗
+#define DEFAULT_STAT_CACHE_TTL 2 // lstat()の結果を使い回す秒数。0なら毎回問い合わせる
+#define STAT_CACHE_ENTRIES 1024 // 存在しないパスも含めて覚えておくパスの数
+#define STAT_CACHE_FDS 256 // 開いたままにしておくfdの数。送信中のものは数を超えても閉じない
+#define STAT_TABLE_SIZE 2048 // 2のべき乗
+#define MIME_TABLE_SIZE 4096 // 2のべき乗。/etc/mime.typesの全ての拡張子が入る大きさにする
+#define MIME_EXT_MAX 16
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+#define DEFAULT_BACKEND_PROCS 2
+#define MAX_BACKEND_PROCS 64
+#define BACKEND_CONNS 2 // ワーカーごとのバックエンドへの接続の数
+#define BACKEND_MAX_CALLS 64 // 1つの接続に多重化するリクエストの数。全ての接続で埋まっていれば503を返す
+#define BACKEND_OUTBUF_MAX (2 * MAX_REQUEST_BODY_LENGTH) // 送りきれていないフレームがこれを超えた接続には新しいリクエストを渡さず、ボディの受信も止める
+#define BACKEND_RESPONSE_MAX (16 * 1024 * 1024) // バックエンドから受け取るボディの最大の長さ
+#define BACKEND_TIMEOUT 30 // バックエンドの応答を待つ秒数
+#define MAX_PROXY_ROUTES 16
+#define MAX_UPSTREAMS 16 // 1つの経路に並べられる上流の数
+#define PROXY_BUF_SIZE HEADER_BUF_SIZE // 上流からの受信バッファ。レスポンスのヘッダはここに収まらなければならない
+#define PROXY_TIMEOUT 30 // 上流の応答を待つ秒数
+#define PROXY_MAX_FAILS 3 // 続けてこの回数失敗した上流は切り離す
+#define PROXY_FAIL_TIMEOUT 10 // 切り離した上流を選ばない秒数
+#define UPSTREAM_IDLE_MAX 32 // 上流ごとにkeep-aliveで残しておく接続の数
+#define UPSTREAM_IDLE_TIMEOUT 4 // 空いた接続を残しておく秒数。上流のkeep-aliveのタイムアウトより短くする
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+#define TIMER_CONN(t) ((struct Connection*)((char*)(t) - offsetof(struct Connection, timer)))
+#define TIMER_UPSTREAM(t) ((struct UpstreamConn*)((char*)(t) - offsetof(struct UpstreamConn, timer)))
+// ステータスラインの雛形。文字列の連結でコンパイル時に組み立てる
+#define STATUS_LINE(status) "HTTP/1." TO_STRING(HTTP_MINOR_VERSION) " " status "\r\n"
+#define SERVER_HEADER "Server: " SERVER_NAME "/" SERVER_VERSION "\r\n"
 
 /****** Data Type Definitions ********************************************/
 
+// アリーナを構成するメモリブロック
+struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t size;
+    char data[];
+};
+
+// 1つのリクエストの解析に使うメモリをまとめて確保するアリーナ
+// 個々の領域は解放せず、リクエストを処理し終えたらarena_reset()でまとめて捨てる。
+struct Arena
+{
+    struct ArenaBlock *first; // 最初のブロック。リセット後はここから使い直す
+    struct ArenaBlock *current; // 割り当て中のブロック
+    size_t used; // currentの使用済みバイト数
+    struct ArenaBlock *large; // ブロックに収まらない大きな領域。リセット時に解放する
+};
+
 struct HTTPHeaderField
 {
     char *name; // header名
     char *value; // 値
-    struct HTTPHeaderField *next; // リンクリスト。次のHTTPHeaderFieldのポインタ
 };
 
 struct HTTPRequest
@@ -33,9 +152,25 @@ struct HTTPRequest
     int protocol_minor_version; // プロトコルのマイナーバージョン
     char *method; // リクエストメソッド
     char *path; // リクエストのパス
-    struct HTTPHeaderField *header; // HTTPヘッダ これは既に定義されている
-    char *body; // エンティティボディ
-    long length; // エンティティボディのサイズ
+    char *known_header[HTTP_HEADER_COUNT]; // 既知のヘッダの値。enum HTTPHeaderIdで引く
+    struct HTTPHeaderField *other_header; // それ以外のヘッダ。届いた順に並べた配列
+    int n_other_header; // other_headerの数
+    long length; // Content-Lengthの値。なければ0、チャンク形式なら-1
+    struct Upload *upload; // アップロードを受け付けた場合の書き込み先
+    struct BackendCall *backend; // バックエンドに渡した場合の応答の受け取り先
+    struct ProxyCall *proxy; // 上流に転送した場合の状態
+    int keep_alive; // レスポンス後も接続を維持するか
+};
+
+// PUT/POSTで受け取り中のファイル
+// 同じディレクトリの一時ファイルに書き込み、受け取り終えたらrename()で置き換える。
+struct Upload
+{
+    int fd;
+    char *path;
+    char *tmp_path;
+    int created; // 新しく作るファイルか。既存のファイルの置き換えならば0
+    int failed; // 書き込みに失敗した
 };
 
 struct FileInfo
@@ -43,6 +178,452 @@ struct FileInfo
     char *path;
     long size;
     int ok;
+    struct stat st; // lstat()の結果。キャッシュが古くなっていないかの判定に使う
+    char etag[ETAG_SIZE]; // file_etag()が作る。空ならまだ作っていない
+    const char *type; // Content-Type。圧縮済みのファイルに切り替えても元のファイルのものを使う
+    int compressible; // typeが圧縮して効果のある種類か
+    const char *encoding; // Content-Encoding。符号化していなければNULL
+    int compress; // その場でgzip圧縮してキャッシュに入れるか
+    int vary; // 符号化を選べるのでVary: Accept-Encodingを付けるか
+    char *cache_key; // キャッシュを引くときの名前。通常はpathと同じ
+    struct StatEntry *stat; // pathのlstat()の結果と開いたfd。参照を持つ
+};
+
+// 拡張子とContent-Typeの対応。起動時にハッシュ表に入れ、fork()後は書き換えない
+struct MimeType
+{
+    const char *ext; // 小文字。NULLなら空き
+    const char *type;
+    int compressible; // 圧縮して効果のある種類か
+};
+
+// 対応しているContent-Encoding。配列の順に優先する
+struct ContentCoding
+{
+    const char *name;
+    const char *ext; // 圧縮済みのファイルの拡張子
+};
+
+// Rangeヘッダで指定された範囲。両端を含む
+struct ByteRange
+{
+    off_t first;
+    off_t last;
+};
+
+// 共有キャッシュの1エントリ
+// seqが奇数の間は書き換え中。読む側はseqが読む前後で変わっていないことを確かめる(seqlock)。
+struct CacheEntry
+{
+    unsigned seq;
+    uint32_t hash; // 0なら空き
+    char path[CACHE_PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    size_t offset; // arena内のデータの位置
+    size_t header_len; // 事前に組み立てたヘッダ(Content-Length以降)の長さ
+    size_t body_len;
+    int32_t older, newer; // データを書いた順(arenaでの並び)のリストの前後。-1なら端
+};
+
+// ワーカー間で共有するファイルキャッシュ。fork()前にMAP_SHAREDで確保する。
+// 後ろにentries、さらにその後ろにデータを置くarenaが続く。
+// ワーカーはarenaを直接指して送り、送っている間はpinsでその範囲を上書きしないよう書く側に伝える。
+struct FileCache
+{
+    pthread_mutex_t lock; // 書き込む側だけが取る
+    size_t nentries; // 2のべき乗
+    size_t arena_size;
+    size_t arena_pos; // 次にデータを書き込む位置。末尾まで来たら先頭に戻って古いものを上書きする
+    int32_t oldest, newest; // データを書いた順のリストの両端。古い方から上書きされる
+    char *arena;
+    uint64_t pins[MAX_WORKERS]; // ワーカーごとの送信中の範囲((位置 << CACHE_PIN_SHIFT) | 長さ)。0なら何も指していない
+    struct CacheEntry entries[];
+};
+
+// --mmapでmmap()したファイル。プロセスごとにLRUで管理し、リクエストをまたいで使い回す
+struct Mapping
+{
+    char *path;
+    uint32_t hash;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    void *addr;
+    int refs; // 送信中のレスポンスの数
+    int stale; // 表から外した。参照がなくなればmunmap()する
+    struct Mapping *hnext; // ハッシュ表の同じバケットの次
+    struct Mapping *prev, *next; // LRUのリスト。先頭ほど最近使った
+};
+
+// パスのlstat()の結果と読み込み用に開いたfd。プロセスごとにLRUで管理し、TTLの間は問い合わせずに使い回す
+// 存在しないパスも覚えておき、404が続いてもそのたびにlstat()しないようにする。
+struct StatEntry
+{
+    char *path;
+    uint32_t hash;
+    uint64_t expires; // 問い合わせ直す時刻(timer_clock()の秒)
+    int ok; // 通常のファイルか。0なら存在しないか送れないものとして覚えている
+    struct stat st;
+    int fd; // まだ開いていなければ-1。リクエストや接続をまたいで共有する
+    int refs; // 使っているリクエストとレスポンスの数
+    int stale; // 表から外した。参照がなくなればfdを閉じて解放する
+    struct StatEntry *hnext; // ハッシュ表の同じバケットの次
+    struct StatEntry *prev, *next; // LRUのリスト。先頭ほど最近使った
+    int idle; // fdを開いたまま誰にも使われておらず、fdのLRUに入っている
+    struct StatEntry *fd_prev, *fd_next; // 使われていないfdのLRUのリスト。先頭ほど最近使った
+};
+
+// レスポンスボディのファイルを呼び出し元に送ってもらうための情報
+struct FileBody
+{
+    int fd; // 送信するファイル。送信するものがなければ-1
+    off_t offset; // 次に送信するファイル上の位置
+    off_t remain; // 残りの送信バイト数
+};
+
+// 送信するレスポンス。ヘッダの各部分とボディをiovecに並べ、まとめて1回で書き出す
+// 雛形や静的な文字列は直接指し、リクエストごとに作った部分はarenaに置く。
+// iov_baseがNULLのものはファイルfdの区間を表し、sendfile(2)で送る。
+struct Response
+{
+    struct iovec iov[RESPONSE_IOV_MAX];
+    off_t file_offset[RESPONSE_IOV_MAX]; // ファイルの区間の開始位置
+    int iovcnt;
+    int iovpos; // 次に送信するiov
+    int owned; // 送り残しのメモリ上のデータを全てarenaにコピー済みか
+    struct Arena *arena;
+    int fd; // ボディとして送るファイル。なければ-1
+    struct Mapping *map; // ボディを直接送っているマッピング。送り終えるまで参照を持つ
+    struct StatEntry *file; // fdを持っているエントリ。送り終えるまで参照を持つ
+    int pinned; // 共有キャッシュを直接指している。コピーを取るか送り終えるまでピンを持つ
+    char *buf; // バックエンドから受け取ったボディなど、レスポンスが持っているメモリ。送り終えるまで残す
+    size_t buf_len;
+    struct ProxyCall *proxy; // 上流から中継している途中のボディ。iovを送り終えてから続きを送る
+    int status; // アクセスログに記録するステータスコード。まだ組み立てていなければ0
+    size_t sent; // 送信したバイト数
+};
+
+// ワーカーごとのアクセスログのリングバッファ。fork()前にMAP_SHAREDで確保する。
+// 書き込むのはワーカー、読み出すのはロガープロセスだけなので、位置を原子的に読み書きするだけでよい
+struct LogRing
+{
+    uint64_t tail __attribute__((aligned(64))); // ワーカーが書き込み終えた位置
+    uint64_t head __attribute__((aligned(64))); // ロガーが読み出し終えた位置
+    uint64_t dropped; // 空きがなくて捨てた行の数
+    int lock; // 接続ごとにfork()する場合だけ、書き込む側同士で取る
+    char buf[LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+// 所要時間を計測する処理の段階
+enum Stage
+{
+    STAGE_ACCEPT, // 接続を受け付けて準備するまで。accept()で待っている時間は含まない
+    STAGE_READ, // リクエストの最初のバイトからボディの終わりまで
+    STAGE_FILEINFO, // get_fileinfo()
+    STAGE_SEND, // レスポンスを組み立て終えてから送り終えるまで
+    STAGE_TOTAL, // リクエストの最初のバイトから送り終えるまで
+    N_STAGES
+};
+
+// ナノ秒単位の値の分布。HDR Histogramと同じく、2のべき乗ごとの区間を等分したバケットに数える
+struct Histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// ワーカーごとの計測値。fork()前にMAP_SHAREDで確保し、/__statsなどへのリクエストで全員の分を合計する
+struct Metrics
+{
+    uint64_t connections;
+    int64_t active; // 開いている接続の数
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t status[600]; // ステータスコードごとのレスポンスの数
+    struct Histogram stages[N_STAGES];
+} __attribute__((aligned(64)));
+
+// 組み立て済みのエラーレスポンス
+enum ErrorPageId
+{
+    ERROR_400,
+    ERROR_404,
+    ERROR_405,
+    ERROR_408,
+    ERROR_413,
+    ERROR_414,
+    ERROR_500,
+    ERROR_501,
+    ERROR_502,
+    ERROR_503,
+    ERROR_504,
+    N_ERROR_PAGES
+};
+
+// 起動時にヘッダとHTMLを1つのバッファに組み立てておき、送るときはDateだけを書き換える
+struct ErrorPage
+{
+    int code;
+    const char *status_line;
+    const char *message; // 既定のページに表示する説明
+    const char *extra_header; // ステータスに応じて付けるヘッダ
+    char *buf[2]; // [0]は接続を閉じる場合、[1]は維持する場合のレスポンス
+    size_t header_len[2];
+    size_t len[2];
+    time_t date_time; // bufに入っているDateの時刻
+};
+
+// 接続の状態
+// io_uringに出した操作の種類
+enum UringOp
+{
+    URING_OP_NONE,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_POLL, // 送りきれなかったので書き込み可能になるのを待つ
+    URING_OP_POLL_IN, // splice()でボディを受け取るので読み込み可能になるのを待つ
+    URING_OP_PROXY, // 上流のソケットで読み書きできるようになるのを待つ
+    URING_OP_SPLICE, // ファイルの区間をパイプ経由でソケットにsplice()している
+    URING_OP_LOOKUP // レスポンスを組み立てる前に、覚えていないパスをstatx()とopenat()で調べている
+};
+
+// io_uringのリング。liburingは使わず、システムコールとmmap()した領域を直接扱う
+struct Uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    int multishot_accept; // 使えなければ1回ごとに出し直す
+    struct io_uring_buf_ring *buf_ring; // 次のリクエストを待つ接続の受信に使うバッファのリング。登録できなければNULL
+    unsigned short buf_tail;
+    char *bufs[URING_BUFS]; // バッファIDごとのバッファ。受信して接続に渡したものはNULL
+    unsigned short free_bids[URING_BUFS]; // 空いているバッファID
+    int n_free_bids;
+};
+
+// io_uringで調べているパス。接続のarenaに置く
+struct UringLookup
+{
+    char *path;
+    struct statx stx;
+    int result; // statx()の結果。0か-errno
+};
+
+// エンティティボディの受信の状態
+enum BodyState
+{
+    BODY_IDENTITY, // Content-Lengthの分だけ受け取る
+    BODY_CHUNK_SIZE, // チャンクの大きさを表す16進数
+    BODY_CHUNK_EXT, // チャンク拡張。行末まで読み飛ばす
+    BODY_CHUNK_DATA,
+    BODY_CHUNK_END, // チャンクの中身の後のCRLF
+    BODY_TRAILER, // 最後のチャンクの後のトレーラの行頭
+    BODY_TRAILER_LINE, // トレーラの行の途中。行末まで読み飛ばす
+    BODY_DONE
+};
+
+// 受信したバイト列からボディの中身を取り出すデコーダ。Transfer-Encoding: chunkedも扱う
+struct BodyDecoder
+{
+    enum BodyState state;
+    long remain; // BODY_IDENTITYとBODY_CHUNK_DATAで残っているバイト数。BODY_CHUNK_SIZEでは読んだ値
+    int ndigits; // BODY_CHUNK_SIZEで読んだ桁数
+    int cr; // BODY_CHUNK_ENDでCRを読んだ
+};
+
+// バックエンドに渡したリクエスト。arenaに置き、HTTPRequestから指す
+struct BackendCall
+{
+    struct Backend *backend; // 応答を待っている接続。受け取り終えたか失敗したらNULL
+    struct Connection *conn;
+    uint32_t id; // フレームのid。下位はbackend->callsでの位置
+    int done; // 応答を受け取り終えたか、失敗した
+    int failed; // 失敗したのでerrorを返す
+    enum ErrorPageId error;
+    char *status_line; // RESPONSEフレームから組み立てたもの。まだ届いていなければNULL
+    char *header; // 中継するヘッダ
+    size_t header_len;
+    char *body; // 受け取ったボディ。レスポンスに渡すまで持つ
+    size_t body_len;
+    size_t body_size;
+};
+
+// ワーカーからバックエンドへの1つの接続。複数のリクエストを多重化し、応答を受け取った後も使い回す
+struct Backend
+{
+    int fd; // 繋いでいなければ-1
+    char *outbuf; // 送信待ちのフレーム
+    size_t outpos; // 送信済みの位置
+    size_t outlen;
+    size_t outsize;
+    char *inbuf; // 受信したフレーム。1つのフレームが必ず収まる大きさ
+    size_t inlen;
+    struct BackendCall *calls[BACKEND_MAX_CALLS]; // 応答を待っているリクエスト
+    int ncalls;
+    uint32_t generation; // idの上位。同じ位置を使い回しても、取り消したリクエストの応答と区別できる
+    uint32_t events; // epollに登録している監視イベント。登録していなければ0
+    int poll_in; // io_uringで読み込み可能になるのを待っている
+    int poll_out; // io_uringで書き込み可能になるのを待っている
+};
+
+// タイマーホイールに仕掛けるタイマー。持ち主の構造体に埋め込み、TIMER_CONN()などで持ち主に戻す
+struct Timer
+{
+    struct Timer *next;
+    struct Timer **pprev; // 前の要素のnextかスロット。仕掛けていなければNULL
+    uint64_t expires; // 期限(timer_clock()の秒)
+};
+
+// --proxyで転送する先のHTTPサーバ。起動時に名前を解決し、失敗の記録と空いた接続はワーカーごとに持つ
+struct Upstream
+{
+    char *name; // "host:port"。Hostのないリクエストを転送するときにも使う
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fails; // 続けて失敗した回数
+    time_t down_until; // 切り離している間はこの時刻まで選ばない
+    struct UpstreamConn *idle; // keep-aliveで空いている接続。先頭ほど最近使った
+    int nidle;
+};
+
+// URLの接頭辞と転送先の組。上流は順番に使い、切り離したものは飛ばす
+struct ProxyRoute
+{
+    char *prefix;
+    size_t prefix_len;
+    struct Upstream upstreams[MAX_UPSTREAMS];
+    int n_upstreams;
+    int next; // 次に選ぶ上流
+};
+
+// 上流への1つの接続。1度に1つのリクエストだけを送り、応答を受け取り終えたら使い回す
+struct UpstreamConn
+{
+    int fd;
+    struct Upstream *upstream;
+    time_t idle_since; // 空いた時刻
+    int epfd; // 登録しているepoll
+    uint32_t events; // epollに登録している監視イベント。登録していなければ0
+    struct UpstreamConn *next; // 空いている接続のリスト
+    struct UpstreamConn **pprev; // リストの前の要素のnextか先頭
+    struct Timer timer; // 空いたまま残しておく期限
+};
+
+// 上流からのレスポンスのボディの区切り方
+enum ProxyFraming
+{
+    PROXY_NONE, // ボディがない
+    PROXY_LENGTH, // Content-Lengthの分だけ
+    PROXY_CHUNKED, // チャンク形式
+    PROXY_CLOSE // 上流が接続を閉じるまで
+};
+
+// 上流に転送したリクエスト。arenaに置き、HTTPRequestから指す
+struct ProxyCall
+{
+    struct ProxyRoute *route;
+    struct UpstreamConn *uc; // 使っている上流への接続。手放したらNULL
+    int tries; // 新しく繋いだ回数
+    int reused; // ucはkeep-aliveで使い回したものか
+    int wait; // 上流のソケットで待つイベント(POLLINかPOLLOUT)。0なら相手への送信を待つ
+    int failed; // 上流から応答を得られなかったのでerrorを返す
+    enum ErrorPageId error;
+    int timed_out;
+    char *head; // 上流に送るリクエストラインとヘッダ
+    size_t head_len;
+    char *body; // リクエストのボディ。試し直せるよう、受け取り終えてからまとめて送る
+    size_t body_len;
+    size_t body_size;
+    size_t sent; // 上流に送ったバイト数
+    char *in; // 上流から受信したバイト列。ヘッダの後に届いたボディの先頭も入る
+    size_t inlen;
+    size_t inpos; // 中継し終えた位置
+    struct HTTPParser parser; // 上流のレスポンスのヘッダ
+    enum ProxyFraming framing;
+    long remain; // PROXY_LENGTHで残っているバイト数
+    struct BodyDecoder chunk; // PROXY_CHUNKEDのボディの終わりを探す
+    int dechunk; // HTTP/1.0の相手にはチャンクを外して中身だけを送る
+    int eof; // PROXY_CLOSEで上流が閉じた
+    int broken; // 上流のボディが壊れていた。送れたところまでで接続を閉じる
+    int copy; // パイプが作れなかったので、ユーザー空間を経由して中継する
+    char *out; // inの中で相手に送る途中の部分
+    size_t outlen;
+    size_t piped; // パイプに入っていて相手にまだ送っていないバイト数
+    int keep_alive; // 応答を受け取り終えた後も上流への接続を使い回せるか
+};
+
+// 階層化タイマーホイール。ワーカーごとに1つ持ち、仕掛けるのも取り消すのもO(1)で済ませる
+// 段nのスロットは64^n秒ずつの区間を受け持ち、下の段が一周するたびに上の段の次の区間を下ろしてくる
+struct TimerWheel
+{
+    uint64_t tick; // 次に処理する秒
+    uint64_t now; // イベントループが最後に読んだ時計
+    struct Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+enum ConnState
+{
+    CONN_REQUEST, // リクエストラインとヘッダの受信待ち
+    CONN_BODY, // エンティティボディの受信待ち
+    CONN_BACKEND, // バックエンドの応答待ち
+    CONN_PROXY, // 上流へのリクエストの送信とレスポンスのヘッダの受信
+    CONN_RESPONSE // レスポンスの送信中
+};
+
+// 1つの接続。epollエンジンでは多数を同時に、ブロッキングエンジンでは1つずつ扱う
+struct Connection
+{
+    int fd;
+    enum ConnState state;
+    char *inbuf; // 受信バッファ。リクエストは常に先頭から始まる
+    size_t insize; // 受信バッファの大きさ
+    size_t inlen; // 受信済みのバイト数
+    size_t inpos; // 解析済みのバイト数
+    struct HTTPParser parser;
+    struct Arena arena; // リクエストの解析に使うメモリ
+    struct HTTPRequest *req; // 解析中のリクエスト
+    struct BodyDecoder body; // エンティティボディの受信の状態
+    int (*body_handler)(struct Connection *conn, const char *buf, size_t len); // 受信したボディを少しずつ渡す先。失敗したら-1を返す
+    size_t body_start; // 受信バッファでボディを受け取り始める位置。渡し終えたらここまで戻して使い回す
+    long body_received; // 受信済みのエンティティボディのバイト数
+    int pipe[2]; // splice()でボディを受け取るためのパイプ。使っていなければ-1
+    struct Response res; // 送信中のレスポンス
+    int keep_alive; // 送信中のレスポンスを送り終えた後も接続を維持するか
+    enum ErrorPageId error; // conn_parse()が失敗した場合に返すエラー
+    uint32_t events; // epollに登録している監視イベント
+    enum UringOp op; // io_uringで完了を待っている操作。1つの接続に同時に1つだけ
+    int closing; // io_uringで待っている操作が終わったら閉じる
+    struct msghdr msg; // io_uringで送信中のメッセージ
+    int out_pipe[2]; // io_uringでファイルの区間をsplice()で送るためのパイプ。まだ作っていなければ-1
+    size_t out_piped; // out_pipeに入っていてまだ送っていないバイト数
+    int out_failed; // ファイルからパイプへのsplice()が失敗した
+    struct UringLookup *lookups; // io_uringで調べているパス
+    int nlookups;
+    int lookup_pos; // 完了を受け取ったlookupsの数
+    int lookup_open; // lookupsの最後のパスはopenat()でも開いている
+    char peer[INET6_ADDRSTRLEN]; // アクセスログに記録する接続元のアドレス
+    struct timespec request_start; // リクエストの最初のバイトを受信した時刻
+    struct timespec started; // レスポンスを組み立て始めた時刻
+    struct timespec ready; // レスポンスを組み立て終えて送信を始めた時刻
+    int nrequests; // この接続で処理したリクエストの数
+    struct Timer timer; // 今の状態で待つ期限
+    uint64_t header_deadline; // 受信中のリクエストのヘッダを受け取り終えるべき時刻
+    int queued; // バックエンドの応答が揃ってbackend_readyに並んでいる
+    int paused; // バックエンドに送りきれていないボディが多いので、受信を止めている
+    struct Connection *ready_next;
 };
 
 
@@ -56,34 +637,365 @@ static void detach_children(void);
 static void signal_exit(int sig);
 static void noop_handler(int sig);
 static void become_daemon(void);
-static int listen_socket(char *port);
+static int listen_socket(char *port, int reuse_port);
 static void server_main(int server, char *docroot);
-static void service(FILE *in, FILE *out, char *docroot);
-static struct HTTPRequest* read_request(FILE *in);
-static void read_request_line(struct HTTPRequest *req, FILE *in);
-static struct HTTPHeaderField* read_header_field(FILE *in);
-static void upcase(char *str);
-static void free_request(struct HTTPRequest *req);
-static long content_length(struct HTTPRequest *req);
-static char* lookup_header_field_value(struct HTTPRequest *req, char *name);
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot);
-static void method_not_allowed(struct HTTPRequest *req, FILE *out);
-static void not_implemented(struct HTTPRequest *req, FILE *out);
-static void not_found(struct HTTPRequest *req, FILE *out);
-static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status);
+static void worker_pool_main(int *server_fds, char *docroot);
+static pid_t spawn_worker(int server_fd, int slot, char *docroot);
+static void worker_main(int server_fd, char *docroot);
+static void event_loop_main(int server_fd, char *docroot);
+static void set_nonblocking(int fd);
+static void accept_connections(int epfd, int server_fd);
+static void handle_connection(int epfd, struct Connection *conn, uint32_t events, char *docroot);
+static void conn_watch(int epfd, struct Connection *conn, uint32_t events);
+static void uring_loop_main(int server_fd, char *docroot);
+static int uring_setup(struct Uring *ring, unsigned entries);
+static void uring_setup_buffers(struct Uring *ring);
+static char* uring_take_buffer(struct Uring *ring, unsigned bid);
+static void uring_put_buffer(struct Uring *ring, char *buf);
+static void uring_reserve(struct Uring *ring, unsigned n);
+static struct io_uring_sqe* uring_get_sqe(struct Uring *ring);
+static int uring_enter(struct Uring *ring, unsigned wait);
+static void uring_accept(struct Uring *ring, int server_fd);
+static void uring_recv(struct Uring *ring, struct Connection *conn);
+static void uring_recv_into(struct Uring *ring, struct Connection *conn);
+static int uring_write(struct Uring *ring, struct Connection *conn);
+static int uring_splice(struct Uring *ring, struct Connection *conn);
+static void uring_poll_out(struct Uring *ring, struct Connection *conn);
+static int uring_lookup(struct Uring *ring, struct Connection *conn, char *docroot);
+static void uring_lookup_done(struct Connection *conn, int result);
+static void statx_to_stat(const struct statx *stx, struct stat *st);
+static void uring_link_complete(struct Connection *conn, int result);
+static void uring_complete(struct Uring *ring, struct Connection *conn, int result, char *docroot);
+static void uring_conn_timeout(struct Timer *t);
+static char* conn_read_buffer(struct Connection *conn, size_t *room);
+static void conn_received(struct Connection *conn, size_t n);
+static void init_connection(struct Connection *conn, int sock, struct sockaddr *addr);
+static ssize_t conn_read(struct Connection *conn);
+static ssize_t conn_splice_body(struct Connection *conn);
+static int conn_parse(struct Connection *conn, char *docroot);
+static int start_body(struct Connection *conn, char *docroot);
+static void end_body(struct Connection *conn);
+static ssize_t body_decode(struct BodyDecoder *d, const char *in, size_t inlen, const char **data, size_t *len);
+static int discard_body(struct Connection *conn, const char *buf, size_t len);
+static void send_continue(struct Connection *conn);
+static void conn_respond(struct Connection *conn, char *docroot);
+static void conn_output(struct Connection *conn, char *docroot);
+static int conn_write(struct Connection *conn);
+static void conn_reset(struct Connection *conn);
+static void conn_error(struct Connection *conn, enum ErrorPageId id);
+static int conn_pending(struct Connection *conn);
+static void conn_timeout(struct Timer *t);
+static void conn_set_timer(struct Connection *conn);
+static void release_connection(struct Connection *conn);
+static void free_connection(struct Connection *conn);
+static uint64_t timer_clock(void);
+static void timer_init(struct TimerWheel *w);
+static void timer_arm(struct TimerWheel *w, struct Timer *t, uint64_t expires);
+static void timer_cancel(struct Timer *t);
+static void timer_insert(struct TimerWheel *w, struct Timer *t);
+static void timer_expire(struct TimerWheel *w, void (*expired)(struct Timer *t));
+static void watch_children(void);
+static void pool_terminate(int sig);
+static void service(int sock, struct sockaddr *addr, char *docroot);
+static struct HTTPRequest* build_request(struct HTTPParser *p, char *buf, struct Arena *arena);
+static char* slice_string(char *buf, struct HTTPSlice *s);
+static struct HTTPRequest* alloc_request(struct Arena *arena);
+static int keep_alive_p(struct HTTPRequest *req, int nrequests);
+static char* lookup_header_field_value(struct HTTPRequest *req, enum HTTPHeaderId id);
+static int header_token_p(const char *val, const char *token);
+static int add_known_header(struct HTTPRequest *req, enum HTTPHeaderId id, char *value, struct Arena *arena);
+static void respond_to(struct HTTPRequest *req, struct Response *res, char *docroot);
+static void do_file_response(struct HTTPRequest *req, struct Response *res, char *docroot);
+static int upload_request_p(struct HTTPRequest *req);
+static int start_upload(struct Connection *conn, char *docroot);
+static int upload_body(struct Connection *conn, const char *buf, size_t len);
+static void finish_upload(struct HTTPRequest *req, struct Response *res);
+static void setup_backends(void);
+static pid_t start_backends(void);
+static void backend_manager_main(pid_t parent);
+static pid_t spawn_backend(void);
+static int backend_request_p(struct HTTPRequest *req);
+static int start_backend_call(struct Connection *conn);
+static char* backend_put_field(char *p, const char *name, const char *value);
+static int hop_by_hop_p(const char *name);
+static int backend_body(struct Connection *conn, const char *buf, size_t len);
+static void finish_backend_call(struct HTTPRequest *req, struct Response *res);
+static void end_backend_call(struct Connection *conn);
+static void backend_timeout(struct Connection *conn);
+static void backend_wait(struct Connection *conn, char *docroot);
+static void backend_drain(struct Connection *conn);
+static int backend_paused_p(struct Connection *conn);
+static void backend_resume(struct Backend *b);
+static void backend_push_ready(struct Connection *conn);
+static struct Connection* backend_next_ready(void);
+static int backend_p(void *p);
+static void backend_watch(int epfd);
+static void backend_uring_watch(struct Uring *ring);
+static int backend_connect(struct Backend *b);
+static void backend_queue(struct Backend *b, int type, uint32_t id, const void *data, size_t len);
+static void backend_flush(struct Backend *b);
+static void backend_input(struct Backend *b);
+static int backend_frame(struct Backend *b, struct BackendFrame *f, char *payload);
+static int backend_response_header(struct BackendCall *call, char *payload, size_t len);
+static void backend_complete(struct BackendCall *call, int failed, enum ErrorPageId error);
+static void backend_abort(struct BackendCall *call, enum ErrorPageId error);
+static void backend_fail(struct Backend *b);
+static void add_proxy_route(char *spec);
+static void resolve_upstream(struct Upstream *u, char *name);
+static struct ProxyRoute* proxy_route(struct HTTPRequest *req);
+static void start_proxy_call(struct Connection *conn, struct ProxyRoute *route);
+static int proxy_body(struct Connection *conn, const char *buf, size_t len);
+static void build_proxy_request(struct Connection *conn);
+static char* proxy_put_header(char *p, const char *name, const char *value);
+static int proxy_pump(struct Connection *conn);
+static void proxy_connect(struct Connection *conn);
+static void proxy_failed(struct Connection *conn, const char *reason);
+static int idempotent_p(const char *method);
+static int proxy_response_header(struct Connection *conn);
+static void finish_proxy_call(struct HTTPRequest *req, struct Response *res);
+static int proxy_relay(struct Connection *conn);
+static void proxy_consume(struct ProxyCall *call);
+static int proxy_body_done_p(struct ProxyCall *call);
+static void proxy_release(struct ProxyCall *call);
+static void end_proxy_call(struct Connection *conn);
+static int proxy_waiting_p(struct Connection *conn);
+static void proxy_timeout(struct Connection *conn);
+static void proxy_watch(int epfd, struct Connection *conn);
+static void proxy_uring_poll(struct Uring *ring, struct Connection *conn);
+static void proxy_wait(struct Connection *conn);
+static void upstream_failed(struct Upstream *u);
+static void upstream_close(struct UpstreamConn *uc);
+static void upstream_idle_timeout(struct Timer *t);
+static void method_not_allowed(struct HTTPRequest *req, struct Response *res);
+static void not_implemented(struct HTTPRequest *req, struct Response *res);
+static void not_found(struct HTTPRequest *req, struct Response *res);
+static void output_error_response(struct HTTPRequest *req, struct Response *res, enum ErrorPageId id);
+static void output_error_page(struct Response *res, enum ErrorPageId id, int keep_alive, int head);
+static void setup_error_pages(char *docroot, char *dir);
+static char* load_error_page(char *docroot, char *dir, int code, size_t *len);
+static void output_common_header_fields(struct HTTPRequest *req, struct Response *res, const char *status_line);
+static void response_add(struct Response *res, const void *data, size_t len);
+static void response_add_copy(struct Response *res, const void *data, size_t len);
+static void response_add_file(struct Response *res, off_t offset, size_t len);
+static void response_consume(struct Response *res, size_t n);
+static void response_save(struct Response *res);
+static void response_reset(struct Response *res);
+static void update_date_header(void);
+static int not_modified_p(struct HTTPRequest *req, struct FileInfo *info);
+static int if_range_match_p(struct HTTPRequest *req, struct FileInfo *info);
+static int etag_match_p(const char *list, const char *etag);
+static int parse_ranges(const char *val, off_t size, struct ByteRange *ranges);
+static void output_not_modified(struct HTTPRequest *req, struct Response *res, struct FileInfo *info);
+static void output_range_not_satisfiable(struct HTTPRequest *req, struct Response *res, struct FileInfo *info);
+static void output_partial_content(struct HTTPRequest *req, struct Response *res, struct FileInfo *info,
+                                   struct ByteRange *ranges, int nranges, char *data);
+static int render_file_header(struct FileInfo *info, char *buf, size_t size);
+static int render_validators(struct FileInfo *info, char *buf, size_t size);
+static char* file_etag(struct FileInfo *info);
+static void format_http_date(time_t t, char *buf, size_t size);
+static int parse_http_date(const char *str, time_t *t);
+static const char* multipart_boundary(void);
+static void negotiate_encoding(struct HTTPRequest *req, struct FileInfo *info);
+static int accepted_encodings(const char *val);
+static int use_precompressed(struct FileInfo *info, const struct ContentCoding *coding);
+static void cancel_compression(struct FileInfo *info);
+static int compressible_type_p(const char *type);
+static void setup_mime_types(const char *file);
+static void load_mime_types(const char *file);
+static void add_mime_type(const char *ext, size_t len, const char *type);
+static const struct MimeType* lookup_mime_type(const char *ext, size_t len);
+static uint32_t hash_extension(const char *ext, size_t len);
+static size_t gzip_compress(const char *in, size_t inlen, char *out, size_t outsize);
 static struct FileInfo* get_fileinfo(char *docroot, char *path);
 static char* build_fspath(char *docroot, char *path);
 static void free_fileinfo(struct FileInfo *info);
-static char* guess_content_type(struct FileInfo *info);
-static void* xmalloc(size_t sz);
-static void log_exit(const char *fmt, ...);
+static ssize_t send_file_body(int sock, struct FileBody *body);
+static void setup_file_cache(size_t size);
+static char* cache_lookup(struct FileInfo *info, struct Response *res, size_t *header_len, size_t *body_len);
+static void cache_unpin(struct Response *res);
+static int cache_fill(struct FileInfo *info, int fd, size_t *header_len, size_t *body_len);
+static void cache_evict(struct CacheEntry *e);
+static void cache_lock(void);
+static struct Mapping* mapping_get(struct FileInfo *info);
+static void mapping_release(struct Mapping *m);
+static void mapping_unlink(struct Mapping *m);
+static struct StatEntry* stat_cache_get(const char *path);
+static struct StatEntry* stat_cache_find(const char *path, uint32_t hash);
+static int stat_cache_fresh_p(const char *path);
+static struct StatEntry* stat_cache_store(struct StatEntry *e, const char *path, uint32_t hash,
+                                          const struct stat *st, int ok);
+static int stat_cache_adopt(struct StatEntry *e, int fd);
+static void stat_cache_fill(const char *path, const struct stat *st, int fd);
+static int stat_cache_open(struct StatEntry *e);
+static void stat_cache_release(struct StatEntry *e);
+static void stat_cache_unlink(struct StatEntry *e);
+static void stat_cache_forget(const char *path);
+static void stat_fd_push(struct StatEntry *e);
+static void stat_fd_remove(struct StatEntry *e);
+static int same_file_p(const struct stat *a, const struct stat *b);
+static int retained_p(struct Response *res, const void *p);
+static uint32_t hash_string(const char *str);
+static size_t parse_size(const char *str);
+static const struct MimeType* guess_content_type(struct FileInfo *info);
+static void* xmalloc(size_t sz) __attribute__((returns_nonnull));
+static void* arena_alloc(struct Arena *arena, size_t sz);
+static void arena_reset(struct Arena *arena);
+static void arena_destroy(struct Arena *arena);
+static void log_exit(const char *fmt, ...) __attribute__((noreturn));
+static void log_warn(const char *fmt, ...);
+static void setup_access_log(const char *path);
+static int open_access_log(void);
+static pid_t start_logger(void);
+static void logger_main(pid_t parent);
+static size_t flush_access_log(void);
+static void logger_hup(int sig);
+static void logger_term(int sig);
+static void forward_hup(int sig);
+static void log_access(struct Connection *conn, struct timespec *now);
+static void conn_accepted(struct timespec *t0);
+static void conn_finish(struct Connection *conn);
+static void setup_metrics(void);
+static void metric_add(uint64_t *counter, uint64_t n);
+static void record_stage(enum Stage stage, struct timespec *from, struct timespec *to);
+static int histogram_index(uint64_t ns);
+static uint64_t histogram_upper(int idx);
+static void output_stats(struct HTTPRequest *req, struct Response *res);
+static char* log_escape(char *p, char *end, const char *str);
+static void log_ring_put(struct LogRing *ring, const char *data, size_t len);
 
 /****** Functions ********************************************************/
 
-#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] [--debug] <docroot>\n"
+#define USAGE "Usage: %s [--port=n] [--engine=blocking|epoll|io_uring] [--workers=n [--reuseport]] [--backlog=n] [--keepalive-timeout=sec] [--max-requests=n] [--cache-size=bytes] [--compress] [--mmap] [--stat-cache-ttl=sec] [--mime-types=file] [--error-pages=path] [--access-log=file [--log-format=fmt]] [--stats-path=path] [--upload-path=prefix] [--backend-path=prefix --backend-command=cmd [--backend-procs=n]] [--proxy=prefix=host:port[,host:port...]]... [--chroot --user=u --group=g] [--debug] <docroot>\n"
+
+enum Engine
+{
+    ENGINE_BLOCKING, // 1接続を1プロセスがブロッキングI/Oで処理する
+    ENGINE_EPOLL, // 1プロセスがepollで多数の接続を処理する
+    ENGINE_URING // epollの代わりにio_uringで受け付け・受信・送信をまとめて発行する
+};
 
 static int debug_mode = 0;
+static enum Engine engine = ENGINE_BLOCKING;
+static int n_workers = 0;
+static int reuse_port = 0;
+static int backlog = DEFAULT_BACKLOG;
+static int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+static int max_requests = DEFAULT_MAX_REQUESTS;
+static struct TimerWheel timers; // 接続のタイムアウト。ワーカーごとに持つ
+static struct TimerWheel idle_timers; // 空いている上流への接続を閉じる期限。期限が来たときの処理が違うのでtimersとは分ける
+static size_t cache_size = DEFAULT_CACHE_SIZE;
+static struct FileCache *file_cache = NULL;
+static char *cache_buf = NULL; // キャッシュに入れるデータを組み立てる場所。プロセスごとに持つ
+static int cache_slot = -1; // pinsのうち自分の位置。接続ごとにforkする場合は使わずにcache_bufへコピーする
+static int compress_responses = 0;
+static int mmap_mode = 0;
+static struct Mapping *mapping_table[MMAP_TABLE_SIZE];
+static struct Mapping *mapping_lru_head = NULL;
+static struct Mapping *mapping_lru_tail = NULL;
+static int n_mappings = 0;
+static int stat_cache_ttl = DEFAULT_STAT_CACHE_TTL;
+static struct StatEntry *stat_table[STAT_TABLE_SIZE];
+static struct StatEntry *stat_lru_head = NULL;
+static struct StatEntry *stat_lru_tail = NULL;
+static int n_stat_entries = 0;
+static int n_stat_fds = 0; // 表から外したものも含め、エントリが開いているfdの数
+static struct StatEntry *stat_fd_head = NULL;
+static struct StatEntry *stat_fd_tail = NULL;
+static char *compress_buf = NULL; // 圧縮する前のファイルの中身を読み込む場所
+static const struct ContentCoding content_codings[] = {
+    { "br", ".br" },
+    { "zstd", ".zst" },
+    { "gzip", ".gz" },
+};
+#define N_CONTENT_CODINGS (int)(sizeof content_codings / sizeof content_codings[0])
+#define CODING_GZIP 2 // content_codingsでのgzipの位置
+static struct MimeType mime_table[MIME_TABLE_SIZE]; // 拡張子をキーにした開番地法のハッシュ表
+static int n_mime_types = 0;
+static const struct MimeType default_mime_type = { "", DEFAULT_CONTENT_TYPE, 0 };
+// 組み込みの対応表。--mime-typesで読み込んだものが優先する
+static const struct { const char *ext; const char *type; } builtin_mime_types[] = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css; charset=utf-8" },
+    { "js", "application/javascript; charset=utf-8" },
+    { "mjs", "application/javascript; charset=utf-8" },
+    { "json", "application/json" },
+    { "map", "application/json" },
+    { "xml", "application/xml" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "csv", "text/csv; charset=utf-8" },
+    { "md", "text/markdown; charset=utf-8" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "avif", "image/avif" },
+    { "ico", "image/x-icon" },
+    { "bmp", "image/bmp" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "otf", "font/otf" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+    { "tar", "application/x-tar" },
+    { "mp3", "audio/mpeg" },
+    { "ogg", "audio/ogg" },
+    { "wav", "audio/wav" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+};
+static volatile sig_atomic_t pool_terminating = 0;
+static char *access_log_path = NULL;
+static const char *log_format = DEFAULT_LOG_FORMAT;
+static int access_log_fd = -1;
+static struct LogRing *log_rings = NULL;
+static int n_log_rings = 0;
+static struct LogRing *log_ring = NULL; // このプロセスが書き込むリング。アクセスログを取らなければNULL
+static int log_ring_shared = 0; // 複数のプロセスが同じリングに書き込むか
+static pid_t logger_pid = 0;
+static char *stats_path = NULL;
+static struct Metrics *all_metrics = NULL;
+static int n_metrics = 0;
+static struct Metrics *metrics = NULL; // このプロセスが書き込む計測値。計測しなければNULL
+static int timing = 0; // アクセスログか計測のために時刻を記録するか
+static char *upload_path = NULL; // PUT/POSTでファイルを受け取るURLの接頭辞。受け取らなければNULL
+static unsigned long n_uploads = 0; // 一時ファイルの名前を重ならないようにする
+static char *backend_path = NULL; // バックエンドに渡すURLの接頭辞。渡さなければNULL
+static char *backend_command = NULL; // バックエンドを起動するコマンド。/bin/shで実行する
+static int backend_procs = DEFAULT_BACKEND_PROCS;
+static int backend_listen_fd = -1; // バックエンドが受け付けるソケット。標準入力として渡す
+static struct sockaddr_un backend_addr; // backend_listen_fdのアドレス。ワーカーはここに繋ぐ
+static socklen_t backend_addrlen;
+static pid_t backend_manager_pid = 0;
+static struct Backend backends[BACKEND_CONNS];
+static struct Connection *backend_ready = NULL; // バックエンドの応答が揃って送信を再開する接続
+static struct ProxyRoute proxy_routes[MAX_PROXY_ROUTES]; // --proxyの経路。指定した順に接頭辞を比べる
+static int n_proxy_routes = 0;
+static const char *stage_names[N_STAGES] = { "accept", "read", "fileinfo", "send", "total" };
+static volatile sig_atomic_t logger_reopen = 0;
+static volatile sig_atomic_t logger_terminating = 0;
+static char date_header[64]; // "Date: ...\r\n"。update_date_header()が1秒に1回だけ作り直す
+static size_t date_header_len = 0;
+static time_t date_header_time = 0;
+
+static struct ErrorPage error_pages[N_ERROR_PAGES] = {
+    [ERROR_400] = { 400, STATUS_LINE("400 Bad Request"), "Your browser sent a request that this server could not understand", "" },
+    [ERROR_404] = { 404, STATUS_LINE("404 Not Found"), "File not found", "" },
+    [ERROR_405] = { 405, STATUS_LINE("405 Method Not Allowed"), "The request method is not allowed", "Allow: GET, HEAD\r\n" },
+    [ERROR_408] = { 408, STATUS_LINE("408 Request Timeout"), "The server timed out waiting for the request", "" },
+    [ERROR_413] = { 413, STATUS_LINE("413 Content Too Large"), "The request body is too large", "" },
+    [ERROR_414] = { 414, STATUS_LINE("414 URI Too Long"), "The request line is too long", "" },
+    [ERROR_500] = { 500, STATUS_LINE("500 Internal Server Error"), "The server could not complete the request", "" },
+    [ERROR_501] = { 501, STATUS_LINE("501 Not Implemented"), "The request method is not implemented", "" },
+    [ERROR_502] = { 502, STATUS_LINE("502 Bad Gateway"), "The backend returned an invalid response", "" },
+    [ERROR_503] = { 503, STATUS_LINE("503 Service Unavailable"), "The server is temporarily unable to handle the request", "" },
+    [ERROR_504] = { 504, STATUS_LINE("504 Gateway Timeout"), "The backend did not respond in time", "" },
+};
 
 static struct option longopts[] = {
     {"debug",  no_argument,       &debug_mode, 1},
@@ -91,18 +1003,42 @@ static struct option longopts[] = {
     {"user",   required_argument, NULL, 'u'},
     {"group",  required_argument, NULL, 'g'},
     {"port",   required_argument, NULL, 'p'},
+    {"workers", required_argument, NULL, 'w'},
+    {"engine", required_argument, NULL, 'e'},
+    {"keepalive-timeout", required_argument, NULL, 't'},
+    {"max-requests", required_argument, NULL, 'm'},
+    {"cache-size", required_argument, NULL, 'C'},
+    {"compress", no_argument,     &compress_responses, 1},
+    {"mmap",   no_argument,       &mmap_mode, 1},
+    {"stat-cache-ttl", required_argument, NULL, 'T'},
+    {"mime-types", required_argument, NULL, 'M'},
+    {"access-log", required_argument, NULL, 'L'},
+    {"log-format", required_argument, NULL, 'F'},
+    {"stats-path", required_argument, NULL, 'S'},
+    {"upload-path", required_argument, NULL, 'U'},
+    {"backend-path", required_argument, NULL, 'B'},
+    {"backend-command", required_argument, NULL, 'X'},
+    {"backend-procs", required_argument, NULL, 'P'},
+    {"proxy",  required_argument, NULL, 'R'},
+    {"error-pages", required_argument, NULL, 'E'},
+    {"reuseport", no_argument,    &reuse_port, 1},
+    {"backlog", required_argument, NULL, 'b'},
     {"help",   no_argument,       NULL, 'h'},
     {0, 0, 0, 0}
 };
 
 int main(int argc, char *argv[])
 {
-    int server_fd;
+    int server_fds[MAX_WORKERS];
+    int n_listeners;
+    int i;
     char *port = NULL;
     char *docroot;
     int do_chroot = 0;
     char *user = NULL;
     char *group = NULL;
+    char *error_dir = NULL;
+    char *mime_file = NULL;
     int opt;
 
     while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
@@ -121,6 +1057,90 @@ int main(int argc, char *argv[])
         case 'p':
             port = optarg;
             break;
+        case 'e':
+            if (strcmp(optarg, "blocking") == 0)
+                engine = ENGINE_BLOCKING;
+            else if (strcmp(optarg, "epoll") == 0)
+                engine = ENGINE_EPOLL;
+            else if (strcmp(optarg, "io_uring") == 0)
+                engine = ENGINE_URING;
+            else {
+                fprintf(stderr, "unknown engine: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            keepalive_timeout = atoi(optarg);
+            if (keepalive_timeout < 1) {
+                fprintf(stderr, "--keepalive-timeout must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'm':
+            max_requests = atoi(optarg);
+            if (max_requests < 1) {
+                fprintf(stderr, "--max-requests must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'C':
+            cache_size = parse_size(optarg);
+            break;
+        case 'T':
+            stat_cache_ttl = atoi(optarg);
+            if (stat_cache_ttl < 0) {
+                fprintf(stderr, "--stat-cache-ttl must not be negative\n");
+                exit(1);
+            }
+            break;
+        case 'E':
+            error_dir = optarg;
+            break;
+        case 'M':
+            mime_file = optarg;
+            break;
+        case 'L':
+            access_log_path = optarg;
+            break;
+        case 'F':
+            log_format = optarg;
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'U':
+            upload_path = optarg;
+            break;
+        case 'B':
+            backend_path = optarg;
+            break;
+        case 'X':
+            backend_command = optarg;
+            break;
+        case 'P':
+            backend_procs = atoi(optarg);
+            if (backend_procs < 1 || backend_procs > MAX_BACKEND_PROCS) {
+                fprintf(stderr, "--backend-procs must be between 1 and %d\n", MAX_BACKEND_PROCS);
+                exit(1);
+            }
+            break;
+        case 'R':
+            add_proxy_route(optarg);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1) {
+                fprintf(stderr, "--backlog must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'w':
+            n_workers = atoi(optarg);
+            if (n_workers < 1 || n_workers > MAX_WORKERS) {
+                fprintf(stderr, "--workers must be between 1 and %d\n", MAX_WORKERS);
+                exit(1);
+            }
+            break;
         case 'h':
             fprintf(stdout, USAGE, argv[0]);
             exit(0);
@@ -134,22 +1154,63 @@ int main(int argc, char *argv[])
         exit(1);
     }
     docroot = argv[optind];
+    if (!backend_path != !backend_command) {
+        fprintf(stderr, "use both of --backend-path and --backend-command\n");
+        exit(1);
+    }
 
+    // /etc/mime.typesなどdocrootの外にあるファイルを読めるようにchroot()より前に作る
+    setup_mime_types(mime_file);
+    // ログファイルもchroot()より前に開いておく
+    if (access_log_path)
+        setup_access_log(access_log_path);
+    if (stats_path)
+        setup_metrics();
+    // ワーカーが繋ぐアドレスはfork()前に決めておく
+    if (backend_path)
+        setup_backends();
+    timing = (log_ring || metrics);
     if (do_chroot) {
         setup_environment(docroot, user, group);
         docroot = "";
     }
     // シグナルハンドラを設定する
     install_signal_handlers();
+    // エラーページはchroot後のdocrootから読み込み、fork()前に組み立てておく
+    setup_error_pages(docroot, error_dir);
+    // ファイルキャッシュはfork()より前に作り、全てのワーカーで同じものを見る
+    if (cache_size > 0)
+        setup_file_cache(cache_size);
     // 接続待機用のソケットを作成する
-    server_fd = listen_socket(port);
+    // --reuseportの場合はワーカーごとにSO_REUSEPORT付きのソケットを用意し、カーネルに接続を振り分けてもらう
+    n_listeners = (n_workers > 0 && reuse_port) ? n_workers : 1;
+    for (i = 0; i < n_listeners; i++) {
+        server_fds[i] = listen_socket(port, reuse_port);
+    }
     if (!debug_mode) {
         // ログ出力時のパラメータを設定する
         openlog(SERVER_NAME, LOG_PID|LOG_NDELAY, LOG_DAEMON);
         // プロセスをデーモン化する
         become_daemon();
     }
-    server_main(server_fd, docroot);
+    // ロガーはデーモン化した後のプロセスの子にする。親が終了したら後を追わせるため
+    if (log_rings) {
+        logger_pid = start_logger();
+        trap_signal(SIGHUP, forward_hup);
+    }
+    // バックエンドもデーモン化した後のプロセスの子にする。chroot()した後なのでコマンドはdocroot以下から探す
+    if (backend_path)
+        backend_manager_pid = start_backends();
+    // ワーカーを作らずに1つのプロセスで全ての接続を扱う場合は、最初のピンを使う
+    if (file_cache && n_workers == 0 && engine != ENGINE_BLOCKING) cache_slot = 0;
+    if (n_workers > 0)
+        worker_pool_main(server_fds, docroot);
+    else if (engine == ENGINE_EPOLL)
+        event_loop_main(server_fds[0], docroot);
+    else if (engine == ENGINE_URING)
+        uring_loop_main(server_fds[0], docroot);
+    else
+        server_main(server_fds[0], docroot);
     exit(0);
 }
 
@@ -224,10 +1285,11 @@ static void become_daemon(void)
  * 接続待機用のソケットを作成する
  * 
  **/
-static int listen_socket(char *port)
+static int listen_socket(char *port, int reuse_port)
 {
     struct addrinfo hints, *res, *ai;
     int err;
+    int on = 1;
 
     // mallocで確保した領域の値は不定だが、memsetでは第二引数で埋めてくれる
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -247,6 +1309,11 @@ static int listen_socket(char *port)
         // sock自体はただのファイルディスクリプタである。ただしsocket()の返り値のfdはストリームに繋がっているわけではない。
         sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
         if (sock < 0) continue;
+        // 同じポートに複数のソケットをbindできるようにする。接続はカーネルがソケット間で分散してくれる。
+        if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+            close(sock);
+            continue;
+        }
         // ソケットをアドレスに結びつける
         if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
             close(sock);
@@ -255,9 +1322,8 @@ static int listen_socket(char *port)
         // カーネルに接続を待っているソケットが第一引数のものであることを伝えている。
         // デバイスドライバから接続情報を受け取るのはカーネルだが、そのままだとどのプロセスに渡すべきなのかわからないため。
         // bindしたアドレスへの接続のリクエストがあったらこのソケットにデータを渡してくださいとソケットに伝える
-        // 第二引数は同時に扱うことのできるリクエストの数。この数だけプロセスをforkして処理をこなす。
-        // ソケットに目印をつけて同時接続の数を書いておくような感じ
-        if (listen(sock, MAX_BACKLOG) < 0) {
+        // 第二引数はaccept()されるのを待っていられる接続の数。ワーカーが全員処理中でも溢れてSYNの再送にならないよう大きめにする
+        if (listen(sock, backlog) < 0) {
             close(sock);
             continue;
         }
@@ -294,12 +1360,8 @@ static void server_main(int server_fd, char *docroot)
         if (pid == 0) { // 子プロセスのfork()の戻り値は0
             /* 子プロセス内でのみこの中の処理を行う（サービスを提供する） */
 
-            // ストリームを開く
-            FILE *inf = fdopen(sock, "r");
-            FILE *outf = fdopen(sock, "w");
-
             // サービスを提供する（HTTPの世界に入る）
-            service(inf, outf, docroot);
+            service(sock, (struct sockaddr*)&addr, docroot);
             // プロセスを終了する
             exit(0);
         }
@@ -310,500 +1372,6204 @@ static void server_main(int server_fd, char *docroot)
     }
 }
 
-static void upcase(char *str)
+/**
+ * 事前にforkしておいたワーカープロセス群で接続を処理する
+ * 接続ごとのfork()をやめ、ワーカーはそれぞれaccept()を繰り返す。
+ * 親プロセスはワーカーを監視し、終了したワーカーを作り直すことだけを行う。
+ **/
+static void worker_pool_main(int *server_fds, char *docroot)
 {
-    char *p;
+    pid_t pids[MAX_WORKERS];
+    time_t spawned_at[MAX_WORKERS];
+    time_t respawn_at[MAX_WORKERS]; // 作り直す時刻。pidsが0のスロットだけが使う
+    struct sigaction act;
+    int i;
+
+    // 親プロセスはwait()でワーカーの終了を知る必要があるのでSA_NOCLDWAITは外す。
+    // 代わりに終了したワーカーは必ずここでwait()するのでゾンビは残らない。
+    watch_children();
+    // 終了要求を受けたらワーカーも道連れにする。waitpid()を中断させたいのでSA_RESTARTは付けない。
+    act.sa_handler = pool_terminate;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGTERM, &act, NULL) < 0 || sigaction(SIGINT, &act, NULL) < 0)
+        log_exit("sigaction() failed: %s", strerror(errno));
+    // 作り直しを待っているワーカーの時刻になったらwaitpid()を中断させる
+    act.sa_handler = noop_handler;
+    if (sigaction(SIGALRM, &act, NULL) < 0)
+        log_exit("sigaction() failed: %s", strerror(errno));
+
+    for (i = 0; i < n_workers; i++) {
+        pids[i] = 0;
+        respawn_at[i] = 0;
+    }
+    while (!pool_terminating) {
+        time_t now = time(NULL), wake = 0;
+        int status;
+        pid_t pid;
 
-    for (p = str; *p; p++) {
-        *p = (char)toupper((int)*p);
+        for (i = 0; i < n_workers; i++) {
+            if (pids[i] > 0) continue;
+            if (respawn_at[i] <= now) {
+                pids[i] = spawn_worker(server_fds[reuse_port ? i : 0], i, docroot);
+                spawned_at[i] = now;
+            }
+            else if (!wake || respawn_at[i] < wake)
+                wake = respawn_at[i];
+        }
+        alarm(wake ? wake - now : 0);
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            // 全員が作り直しを待っていて子プロセスがいなければ、見張るものもないので時刻まで眠る
+            if (errno == ECHILD && wake) {
+                sleep(wake - now);
+                continue;
+            }
+            log_exit("waitpid(2) failed: %s", strerror(errno));
+        }
+        // ロガーが落ちてもリングは共有メモリに残っているので、作り直せば続きから書き出す
+        if (pid == logger_pid) {
+            logger_pid = start_logger();
+            continue;
+        }
+        // バックエンドを見ているプロセスが落ちたら、バックエンドごと作り直す
+        if (pid == backend_manager_pid) {
+            backend_manager_pid = start_backends();
+            continue;
+        }
+        for (i = 0; i < n_workers; i++) {
+            if (pids[i] != pid) continue;
+            // 起動直後に死ぬワーカーを作り直し続けてCPUを使い切らないよう、そのスロットだけ1秒置く。
+            // 親は眠らずに他のワーカーやロガーの終了を見続ける
+            pids[i] = 0;
+            respawn_at[i] = (time(NULL) - spawned_at[i] < 1) ? spawned_at[i] + 1 : 0;
+            break;
+        }
     }
+    alarm(0);
+    for (i = 0; i < n_workers; i++) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    // ロガーは残りを書き出してから終わる
+    if (logger_pid > 0) kill(logger_pid, SIGTERM);
+    if (backend_manager_pid > 0) kill(backend_manager_pid, SIGTERM);
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
 }
 
 /**
- * 構造体requestに割り当てられているメモリを解放する
+ * ワーカープロセスを1つ作成する
  * 
  **/
-static void free_request(struct HTTPRequest *req)
+static pid_t spawn_worker(int server_fd, int slot, char *docroot)
 {
-    struct HTTPHeaderField *h, *head;
+    pid_t pid;
 
-    // アロー演算子は構造体のメンバにアクセスするために使用する
-    // headerには次のheaderのポインタが入っている
-    head = req->header;
-    while (head){
-        // 今回使用するheaderをhに格納する
-        h = head;
-        // 次のheadを格納する。
-        // headを先に解放してしまうとnextも参照できなくなってしまうのでこの時点で取っておく必要がある。
-        head = head->next;
-        free(h->name);
-        free(h->value);
-        free(h);
+    pid = fork();
+    if (pid < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (pid == 0) {
+        // 親が設定した終了処理はワーカーには不要なので元に戻す
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        detach_children();
+        // アクセスログと計測値はワーカーごとの領域に書き込む
+        if (log_rings) log_ring = &log_rings[slot];
+        // 前のワーカーが送信中に死んでいればピンが残っているので外す
+        if (file_cache) {
+            cache_slot = slot;
+            file_cache->pins[slot] = 0;
+        }
+        if (all_metrics) {
+            metrics = &all_metrics[slot];
+            // 前のワーカーが異常終了していれば開いていた接続の数は当てにならない
+            metrics->active = 0;
+        }
+        if (engine == ENGINE_EPOLL)
+            event_loop_main(server_fd, docroot);
+        else if (engine == ENGINE_URING)
+            uring_loop_main(server_fd, docroot);
+        else
+            worker_main(server_fd, docroot);
+        exit(0);
     }
-    // memberが持っている値と構造体自体はあくまで別の実体（メモリ）を持っているのでそれぞれ個別に解放する必要がある。
-    free(req->method);
-    free(req->path);
-    free(req->body);
-    free(req);
+    return pid;
 }
 
 /**
- * ファイルディスクリプタを受け取りストリームを解析してリクエスト構造体に格納する
- * 
+ * ワーカープロセスの本体
+ * 共有しているserver_fdでaccept()し、接続を自分自身で処理する。
  **/
-static struct HTTPRequest* read_request(FILE *in)
+static void worker_main(int server_fd, char *docroot)
 {
-    struct HTTPRequest *req;
-    struct HTTPHeaderField *h;
+    // 相手に切断されてもワーカーごと落ちて作り直しにならないよう、書き込みのエラーとして扱う。
+    // 接続ごとにforkする場合と違い、ワーカーは次の接続も受け持つ
+    signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof addr;
+        int sock;
 
-    req = xmalloc(sizeof(struct HTTPRequest));
-    // 確保されているメモリへのポインタとストリームを受け取ってメモリにラインを書き込む。
-    read_request_line(req, in);
-    req->header = NULL;
-    // ファイルディスクリプタを受け取ってヘッダを取得する。ポインタを進める。
-    // 一度に一つづつヘッダを読み込む。ヘッダがなくなったらNULLを返す。
-    while (h = read_header_field(in)) {
-        // 現在のヘッダのnextに前回のヘッダを入れる。
-        // 初回はNULL
-        // スタックされている
-        h->next = req->header;
-        req->header = h;
-    }
-    req->length = content_length(req);
-    if (req->length != 0){
-        if (req->length > MAX_REQUEST_BODY_LENGTH){
-            log_exit("request body too long");
-        }
-        req->body = xmalloc(req->length);
-        if (fread(req->body,req->length,1,in)<1){
-            log_exit("failed to read request body");
+        sock = accept(server_fd, (struct sockaddr*)&addr, &addrlen);
+        if (sock < 0) {
+            // 他のワーカーとの取り合いやシグナルによる中断は異常ではない
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+            log_exit("accept(2) failed: %s", strerror(errno));
         }
-    }else{
-        req->body = NULL;
+        // service()は接続を閉じて戻ってくる
+        service(sock, (struct sockaddr*)&addr, docroot);
     }
-
-    return req;
 }
 
 /**
- * ファイルディスクリプタinからリクエストラインを読み込んで構造体リクエストに書き込む
- * 
+ * epollによるイベントループ
+ * ノンブロッキングのソケットを使い、1つのプロセスで多数の接続を同時に扱う。
+ * 接続ごとに受信したバイト列を少しずつ解析し、送信できるようになった分だけレスポンスを書き出す。
  **/
-static void read_request_line(struct HTTPRequest *req, FILE *in)
+static void event_loop_main(int server_fd, char *docroot)
 {
-    // バッファのメモリを確保する
-    char buf[LINE_BUF_SIZE];
-    // 文字列が格納されているポインタ型のpathとpを宣言する。
-    char *path, *p;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct Connection *conn;
+    int epfd;
+    int i, n;
 
-    // buf に一行づつ読み込む
-    if (!fgets(buf,LINE_BUF_SIZE,in)){
-        log_exit("no request line");
-    }
-    // strchrは第一引数の文字列ないで最初に第二引数のパターンが現れた位置へのポインターを返す
-    p = strchr(buf, ' ');
-    if (!p){
-        log_exit("parse error on request line (1): %s", buf);
-    }
-    *p++ = '\0';
-    // bufは配列の識別子である。bufの先頭のアドレスのポインタである。そしてpは同じ配列内のmethodの終端のポインタである。
-    // なのでp - bufは配列のアドレスの差分を取っているためそれがつまりmethodのサイズになる。
-    req->method = xmalloc(p - buf);
-    strcpy(req->method, buf);
-    upcase(req->method);
-
-    // pはmethodの終端のアドレスなのでpathの先頭ということになる。
-    path = p;
-    p = strchr(path, ' ');
-    if (!p){
-        log_exit("parse error on request line (2): %s", buf);
-    }
-    *p++ = '\0';
-    req->path = xmalloc(p - path);
-    strcpy(req->path, path);
+    // 書き込み先が切断していてもプロセスごと落ちないようにし、write()のエラーで個別に処理する
+    signal(SIGPIPE, SIG_IGN);
+    set_nonblocking(server_fd);
+    epfd = epoll_create1(0);
+    if (epfd < 0) log_exit("epoll_create1(2) failed: %s", strerror(errno));
+    ev.events = EPOLLIN;
+    // 複数のワーカーが同じソケットを監視する場合は全員が一斉に起こされないようにする
+    if (n_workers > 0 && !reuse_port) ev.events |= EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    timer_init(&timers);
+    timer_init(&idle_timers);
 
-    if(strncasecmp(p,"HTTP/1.", strlen("HTTP/1."))!=0){
-        log_exit("parse error on request line (3): %s", buf);
+    for (;;) {
+        // タイマーホイールを進めるために少なくとも1秒に1回は起きる
+        n = epoll_wait(epfd, events, MAX_EVENTS, backend_ready ? 0 : 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_exit("epoll_wait(2) failed: %s", strerror(errno));
+        }
+        // 起きるたびに1回だけ時計を読み、この回に仕掛けるタイマーは全てこの時刻から数える
+        timers.now = timer_clock();
+        for (i = 0; i < n; i++) {
+            // data.ptrがNULLのものは待ち受け用のソケット
+            if (!events[i].data.ptr)
+                accept_connections(epfd, server_fd);
+            else if (backend_p(events[i].data.ptr)) {
+                if (events[i].events & EPOLLOUT) backend_flush(events[i].data.ptr);
+                if (events[i].events & ~EPOLLOUT) backend_input(events[i].data.ptr);
+            }
+            else
+                handle_connection(epfd, events[i].data.ptr, events[i].events, docroot);
+        }
+        // バックエンドの応答が揃った接続の送信を再開し、溜まったフレームを送る
+        while ((conn = backend_next_ready()))
+            handle_connection(epfd, conn, 0, docroot);
+        if (backend_path) backend_watch(epfd);
+        // events[]に残っている接続を解放しないよう、イベントを処理し終えてから期限の来たものを処理する
+        timer_expire(&timers, conn_timeout);
+        idle_timers.now = timers.now;
+        timer_expire(&idle_timers, upstream_idle_timeout);
     }
-    p += strlen("HTTP/1.");
-    req->protocol_minor_version = atoi(p);
 }
 
 /**
- * ファイルディスクリプタを受け取ってHTTPHeaderField構造体を作成し、そのポインタを返す
+ * ファイルディスクリプタをノンブロッキングにする
  * 
  **/
-static struct HTTPHeaderField* read_header_field(FILE *in)
+static void set_nonblocking(int fd)
 {
-    struct HTTPHeaderField *h;
-    char buf[LINE_BUF_SIZE];
-    char *p;
-
-    if(!fgets(buf, LINE_BUF_SIZE, in)){
-        log_exit("faild to read request header field: %s", strerror(errno));
-    }
-    if((buf[0]=='\n')||(strcmp(buf, "\r\n")==0)){
-        return NULL;
-    }
-    // ヘッダのkeyとvalは:で区切られている
-    p = strchr(buf, ':');
-    if(!p){
-        log_exit("parse error on request header field: %s", buf);
-    }
-    *p++ = '\0';
-    // 構造体は入れ物だがサイズを持っている
-    // それぞれの部屋は別途領域を用意する必要がある。
-    h = xmalloc(sizeof(struct HTTPHeaderField));
-    h->name = xmalloc(p - buf);
-    strcpy(h->name, buf);
-
-
-    p += strspn(p, " \t");
-    h->value = xmalloc(strlen(p) + 1);
-    strcpy(h->value, p);
+    int flags;
 
-    return h;
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        log_exit("fcntl(2) failed: %s", strerror(errno));
 }
 
 /**
- * リクエストのエンティティボディのサイズを取得する
+ * 待機中の接続を受け付けられるだけ受け付けてepollに登録する
  * 
  **/
-static long content_length(struct HTTPRequest *req)
+static void accept_connections(int epfd, int server_fd)
 {
-    char *val;
-    long len;
-    
-    val = lookup_header_field_value(req, "Content-Length");
-    if (!val) return 0;
-    // 型の変換を行う
-    len = atol(val);
-    if (len < 0) log_exit("negative Content-Length value");
-    return len;
+    for (;;) {
+        struct Connection *conn;
+        struct epoll_event ev;
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof addr;
+        struct timespec t0;
+        int sock;
+
+        if (metrics) clock_gettime(CLOCK_MONOTONIC, &t0);
+        sock = accept4(server_fd, (struct sockaddr*)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // EAGAINは受け付ける接続がなくなったということ。他のワーカーが先に受け付けた場合も含む
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            // fdを使い切った場合などは今いる接続の処理を優先する
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) return;
+            log_exit("accept4(2) failed: %s", strerror(errno));
+        }
+        conn = xmalloc(sizeof(struct Connection));
+        init_connection(conn, sock, (struct sockaddr*)&addr);
+        if (metrics) conn_accepted(&t0);
+        conn->events = EPOLLIN;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        conn_set_timer(conn);
+    }
 }
 
 /**
- * 指定のヘッダフィールドの値を取得する
+ * 接続に起きたイベントを処理し、状態を先に進める
  * 
  **/
-static char* lookup_header_field_value(struct HTTPRequest *req, char *name)
+static void handle_connection(int epfd, struct Connection *conn, uint32_t events, char *docroot)
 {
-    struct HTTPHeaderField *h;
+    ssize_t n;
+    int eof = 0;
+    int ret;
 
-    for (h = req->header; h; h = h->next) {
-        if (strcasecmp(h->name, name) == 0)
-            return h->value;
+    if (conn->paused) {
+        // ボディの受信を止めている間は切断だけを監視する。送れるようになればbackend_next_ready()から戻ってくる
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) goto close;
+        return;
     }
-    return NULL;
+    if (conn->state == CONN_BACKEND) {
+        // 応答を待っている間に相手が切断した。end_backend_call()がバックエンドにも取り消しを伝える
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) goto close;
+        if (!conn->req->backend->done) return;
+        conn_output(conn, docroot);
+    }
+    else if (conn->state == CONN_PROXY) {
+        // 上流のソケットのイベント。エラーもproxy_pump()が読み書きして確かめる
+        if (!proxy_pump(conn)) {
+            proxy_watch(epfd, conn);
+            goto wait;
+        }
+        conn_output(conn, docroot);
+    }
+    else if (conn->state != CONN_RESPONSE) {
+        n = conn_read(conn);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) goto close;
+        eof = (n == 0);
+    }
+    else if (events & EPOLLERR) {
+        goto close;
+    }
+    // パイプライン化されたリクエストはバッファに残っているので、順番に1つずつ処理する
+    for (;;) {
+        if (conn->state != CONN_RESPONSE) {
+            ret = conn_parse(conn, docroot);
+            if (ret == 0) {
+                // まだリクエストが揃っていない。相手が送信を終えていればもう揃うことはない
+                if (eof) goto close;
+                // バックエンドに送りきれていないボディが多ければ、送れるまで読まない
+                if (backend_paused_p(conn)) {
+                    conn->paused = 1;
+                    conn_watch(epfd, conn, EPOLLRDHUP);
+                    goto wait;
+                }
+                conn_watch(epfd, conn, EPOLLIN);
+                goto wait;
+            }
+            // 不正なリクエストにはエラーを返してから閉じる
+            if (ret < 0)
+                conn_error(conn, conn->error);
+            else
+                conn_respond(conn, docroot);
+            // バックエンドの応答を待つ間は切断だけを監視する。揃ったらbackend_next_ready()から戻ってくる
+            if (conn->state == CONN_BACKEND) {
+                conn_watch(epfd, conn, EPOLLRDHUP);
+                goto wait;
+            }
+            if (conn->state == CONN_PROXY) {
+                proxy_watch(epfd, conn);
+                goto wait;
+            }
+        }
+        // 送信はすぐに試みる。送りきれなかった分は書き込み可能になるのを待つ
+        // 上流から中継しているボディは、上流から続きが届くのを待つこともある
+        ret = conn_write(conn);
+        if (ret < 0) goto close;
+        if (ret == 0) {
+            if (conn->res.proxy)
+                proxy_watch(epfd, conn);
+            else
+                conn_watch(epfd, conn, EPOLLOUT);
+            goto wait;
+        }
+        if (!conn->keep_alive) goto close;
+        conn_reset(conn);
+    }
+wait:
+    // 読み書きが進んだので、次に待つものに合わせて期限を掛け直す
+    conn_set_timer(conn);
+    return;
+close:
+    free_connection(conn);
 }
 
 /**
- * メソッドに応じたレスポンスを出力する
- * 
+ * 監視するイベントを切り替える
+ * 変わらない場合はepoll_ctl(2)を呼ばない。0にすると登録を外し、次に監視するときに登録し直す。
  **/
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot)
+static void conn_watch(int epfd, struct Connection *conn, uint32_t events)
 {
-    if (strcmp(req->method, "GET") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "HEAD") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "POST") == 0)
-        method_not_allowed(req, out);
-    else
-        not_implemented(req, out);
+    struct epoll_event ev;
+    int op;
+
+    if (conn->events == events) return;
+    op = !events ? EPOLL_CTL_DEL : conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    conn->events = events;
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, op, conn->fd, &ev) < 0)
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
 }
 
 /**
- * 構造体requestからリクエスト情報を受け取ってリクエストされたパスのファイルの内容を出力先に書き込む
- * 
+ * 接続の状態を初期化する
+ * addrはaccept()で得た接続元のアドレス。NULLならアクセスログを取る場合だけgetpeername()で調べる。
  **/
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot)
+static void init_connection(struct Connection *conn, int sock, struct sockaddr *addr)
 {
-    struct FileInfo *info;
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof ss;
 
-    info = get_fileinfo(docroot, req->path);
-    if (!info->ok) {
-        free_fileinfo(info);
-        not_found(req, out);
-        return;
-    }
-    output_common_header_fields(req, out, "200 OK");
-    fprintf(out, "Content-Length: %ld\r\n", info->size);
-    fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
-    fprintf(out, "\r\n");
-    if (strcmp(req->method, "HEAD") != 0) {
-        int fd;
-        char buf[BLOCK_BUF_SIZE];
-        ssize_t n;
-
-        fd = open(info->path, O_RDONLY);
-        if (fd < 0)
-            log_exit("failed to open %s: %s", info->path, strerror(errno));
-        for (;;) {
-            n = read(fd, buf, BLOCK_BUF_SIZE);
-            if (n < 0)
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
-            if (n == 0)
-                break;
-            if (fwrite(buf, 1, n, out) < n)
-                log_exit("failed to write to socket");
-        }
-        close(fd);
+    memset(conn, 0, sizeof(struct Connection));
+    conn->fd = sock;
+    if (log_ring) {
+        if (!addr && getpeername(sock, (struct sockaddr*)&ss, &len) == 0)
+            addr = (struct sockaddr*)&ss;
+        if (addr && addr->sa_family == AF_INET)
+            inet_ntop(AF_INET, &((struct sockaddr_in*)addr)->sin_addr, conn->peer, sizeof conn->peer);
+        else if (addr && addr->sa_family == AF_INET6)
+            inet_ntop(AF_INET6, &((struct sockaddr_in6*)addr)->sin6_addr, conn->peer, sizeof conn->peer);
+        else
+            strcpy(conn->peer, "-");
     }
-    fflush(out);
-    free_fileinfo(info);
+    conn->state = CONN_REQUEST;
+    conn->insize = HEADER_BUF_SIZE;
+    conn->inbuf = xmalloc(conn->insize);
+    http_parser_init(&conn->parser);
+    conn->res.arena = &conn->arena;
+    conn->res.fd = -1;
+    conn->pipe[0] = conn->pipe[1] = -1;
+    conn->out_pipe[0] = conn->out_pipe[1] = -1;
 }
 
-static void method_not_allowed(struct HTTPRequest *req, FILE *out)
+/**
+ * ソケットから1回だけ読み込む
+ * 読み込んだバイト数を、相手が送信を終えていれば0を、エラーなら-1を返す。
+ * ノンブロッキングのソケットで読めるものがなければ-1を返しerrnoはEAGAINになる。
+ **/
+static ssize_t conn_read(struct Connection *conn)
 {
-    output_common_header_fields(req, out, "405 Method Not Allowed");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>405 Method Not Allowed</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not allowed</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
-}
+    char *buf;
+    size_t room;
+    ssize_t n;
 
-static void not_implemented(struct HTTPRequest *req, FILE *out)
-{
-    output_common_header_fields(req, out, "501 Not Implemented");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>501 Not Implemented</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not implemented</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
+    // アップロードのボディはユーザー空間を経由せずにファイルへ移す
+    if (conn->state == CONN_BODY && conn->pipe[0] >= 0) return conn_splice_body(conn);
+    buf = conn_read_buffer(conn, &room);
+    // 受信バッファは広げない。解析済みの文字列がバッファを直接指しているため
+    if (room == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    do {
+        n = read(conn->fd, buf, room);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) conn_received(conn, n);
+    return n;
 }
 
-static void not_found(struct HTTPRequest *req, FILE *out)
+/**
+ * ソケットから受信したボディをパイプ経由でアップロード先のファイルに直接移す
+ * conn_read()と同じく受信したバイト数を、相手が送信を終えていれば0を、エラーなら-1を返す。
+ * ファイルに書けなかった場合は受信した分を捨て、conn_parse()にエラーを返させる。
+ **/
+static ssize_t conn_splice_body(struct Connection *conn)
 {
-    output_common_header_fields(req, out, "404 Not Found");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    if (strcmp(req->method, "HEAD") != 0) {
-        fprintf(out, "<html>\r\n");
-        fprintf(out, "<header><title>Not Found</title><header>\r\n");
-        fprintf(out, "<body><p>File not found</p></body>\r\n");
-        fprintf(out, "</html>\r\n");
+    struct Upload *up = conn->req->upload;
+    size_t len = conn->body.remain < SPLICE_CHUNK_SIZE ? conn->body.remain : SPLICE_CHUNK_SIZE;
+    ssize_t n, m, moved;
+
+    do {
+        n = splice(conn->fd, NULL, conn->pipe[1], NULL, len, SPLICE_F_MOVE);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return n;
+    conn->body.remain -= n;
+    conn->body_received += n;
+    if (conn->body.remain == 0) conn->body.state = BODY_DONE;
+    // 次の受信に備えて、パイプに入った分は全てファイルに移して空にしておく
+    for (moved = 0; moved < n; moved += m) {
+        m = splice(conn->pipe[0], NULL, up->fd, NULL, n - moved, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR) {
+            m = 0;
+            continue;
+        }
+        if (m <= 0) {
+            log_warn("failed to write %s: %s", up->tmp_path, m < 0 ? strerror(errno) : "unexpected EOF");
+            up->failed = 1;
+            break;
+        }
     }
-    fflush(out);
+    return n;
 }
 
-#define TIME_BUF_SIZE 64
-
 /**
- * 全リクエストに共通のレスポンスヘッダを出力する
- * 
+ * 次に受信したデータを置く場所を返し、roomにその大きさを入れる
+ * ボディも受信バッファに受け取り、渡し終えた分の領域は使い回す。
  **/
-static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status)
+static char* conn_read_buffer(struct Connection *conn, size_t *room)
 {
-    time_t t;
-    struct tm *tm;
-    char buf[TIME_BUF_SIZE];
-
-    t = time(NULL);
-    tm = gmtime(&t);
-    if (!tm) log_exit("gmtime() failed: %s", strerror(errno));
-    strftime(buf, TIME_BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    fprintf(out, "HTTP/1.%d %s\r\n", HTTP_MINOR_VERSION, status);
-    fprintf(out, "Date: %s\r\n", buf);
-    fprintf(out, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
-    fprintf(out, "Connection: close\r\n");
+    *room = conn->insize - conn->inlen;
+    return conn->inbuf + conn->inlen;
 }
 
 /**
- * 構造体FileInfoのポインタを取得する
- * 
+ * conn_read_buffer()の場所にnバイト受信したことを記録する
+ * リクエストの最初のバイトなら、ヘッダを受け取り終えるべき時刻を決める。
  **/
-static struct FileInfo* get_fileinfo(char *docroot, char *urlpath)
+static void conn_received(struct Connection *conn, size_t n)
 {
-    struct FileInfo *info;
-    struct stat st;
-
+    if (conn->state == CONN_REQUEST && conn->inlen == 0) {
+        conn->header_deadline = timer_clock() + HEADER_TIMEOUT;
+        if (timing) clock_gettime(CLOCK_MONOTONIC, &conn->request_start);
+    }
+    conn->inlen += n;
+}
+
+/**
+ * 受信バッファにある分だけリクエストを解析する
+ * リクエストが揃ったら1を、まだ足りなければ0を、不正なリクエストなら-1を返す。
+ * メソッドやヘッダの文字列は受信バッファ上でそのまま区切り、コピーしない。
+ * ボディは溜めずに、届いた分をその都度conn->body_handlerに渡す。
+ **/
+static int conn_parse(struct Connection *conn, char *docroot)
+{
+    const char *data;
+    size_t len;
+    ssize_t n;
+
+    if (conn->state == CONN_REQUEST) {
+        switch (http_parse_request(&conn->parser, conn->inbuf, conn->inlen)) {
+        case HTTP_PARSE_ERROR:
+            conn->error = ERROR_400;
+            return -1;
+        case HTTP_PARSE_AGAIN:
+            // ヘッダ全体がバッファに収まらないものは受け付けない
+            if (conn->inlen == conn->insize) {
+                conn->error = conn->parser.state == HTTP_STATE_REQUEST_LINE ? ERROR_414 : ERROR_400;
+                return -1;
+            }
+            return 0;
+        }
+        conn->req = build_request(&conn->parser, conn->inbuf, &conn->arena);
+        if (!conn->req) {
+            conn->error = ERROR_400;
+            return -1;
+        }
+        conn->inpos = conn->body_start = conn->parser.pos;
+        conn->state = CONN_BODY;
+        if (start_body(conn, docroot) < 0) return -1;
+    }
+    // 受信バッファに届いている分を復号して渡す
+    while (conn->body.state != BODY_DONE && conn->inpos < conn->inlen) {
+        n = body_decode(&conn->body, conn->inbuf + conn->inpos, conn->inlen - conn->inpos, &data, &len);
+        if (n < 0) {
+            conn->error = ERROR_400;
+            return -1;
+        }
+        conn->inpos += n;
+        if (len > 0) {
+            conn->body_received += len;
+            if (conn->body_handler(conn, data, len) < 0) return -1;
+        }
+    }
+    if (conn->req->upload && conn->req->upload->failed) {
+        conn->error = ERROR_500;
+        return -1;
+    }
+    if (conn->body.state != BODY_DONE) {
+        // 全て渡し終えたので、ボディの続きは同じ場所に受け取る
+        conn->inlen = conn->inpos = conn->body_start;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * ヘッダを受け取り終えたリクエストのボディの受け取り方を決める
+ * Transfer-Encodingがchunkedならチャンク形式として復号し、それ以外はContent-Lengthの分だけ受け取る。
+ * --upload-path以下へのPUT/POSTはファイルに書き込み、--backend-path以下へのリクエストはバックエンドに渡す。
+ * どちらも届いた分から渡していくので、長さはMAX_REQUEST_BODY_LENGTHで制限しない。
+ * --proxyの接頭辞に当たるリクエストは上流に転送するので、ボディを溜めておく。
+ * それ以外のボディは読み捨てる。
+ **/
+static int start_body(struct Connection *conn, char *docroot)
+{
+    struct HTTPRequest *req = conn->req;
+    struct ProxyRoute *route;
+    char *te = lookup_header_field_value(req, HTTP_HEADER_TRANSFER_ENCODING);
+
+    memset(&conn->body, 0, sizeof conn->body);
+    conn->body_handler = discard_body;
+    if (te) {
+        // chunked以外の転送符号化には対応しない。Content-Lengthもあるものは長さが曖昧なので受け付けない
+        if (strcasecmp(te, "chunked") != 0) {
+            conn->error = ERROR_501;
+            return -1;
+        }
+        if (conn->parser.content_length >= 0) {
+            conn->error = ERROR_400;
+            return -1;
+        }
+        req->length = -1;
+        conn->body.state = BODY_CHUNK_SIZE;
+    }
+    else {
+        conn->body.state = req->length > 0 ? BODY_IDENTITY : BODY_DONE;
+        conn->body.remain = req->length;
+    }
+    if (upload_path && upload_request_p(req)) {
+        if (start_upload(conn, docroot) < 0) return -1;
+    }
+    else if (backend_path && backend_request_p(req)) {
+        if (start_backend_call(conn) < 0) return -1;
+    }
+    else if (req->length > MAX_REQUEST_BODY_LENGTH) {
+        conn->error = ERROR_413;
+        return -1;
+    }
+    else if (n_proxy_routes > 0 && (route = proxy_route(req))) {
+        start_proxy_call(conn, route);
+    }
+    if (conn->body.state == BODY_DONE) return 0;
+    // ヘッダで受信バッファが埋まっていると、ボディを受け取る場所がない
+    if (conn->body_start == conn->insize) {
+        conn->error = ERROR_413;
+        return -1;
+    }
+    send_continue(conn);
+    return 0;
+}
+
+/**
+ * リクエストのボディの受け取りを終える
+ * 受け取りの途中で接続を閉じる場合は、書きかけのアップロードを捨てる。
+ **/
+static void end_body(struct Connection *conn)
+{
+    struct Upload *up = conn->req ? conn->req->upload : NULL;
+
+    if (conn->pipe[0] >= 0) {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+        conn->pipe[0] = conn->pipe[1] = -1;
+    }
+    if (up && up->fd >= 0) {
+        close(up->fd);
+        unlink(up->tmp_path);
+        up->fd = -1;
+    }
+}
+
+/**
+ * 受信したボディのバイト列inを復号する
+ * 消費したバイト数を返し、その中に含まれていたボディの中身を*dataと*lenに入れる。
+ * 中身は受信したバイト列の一部を指すだけでコピーはしない。不正な形式なら-1を返す。
+ **/
+static ssize_t body_decode(struct BodyDecoder *d, const char *in, size_t inlen, const char **data, size_t *len)
+{
+    size_t i = 0;
+    int c;
+
+    *data = NULL;
+    *len = 0;
+    while (i < inlen && d->state != BODY_DONE) {
+        // 中身は1回の呼び出しで1か所だけ返す
+        if (d->state == BODY_IDENTITY || d->state == BODY_CHUNK_DATA) {
+            *data = in + i;
+            *len = inlen - i < (size_t)d->remain ? inlen - i : (size_t)d->remain;
+            d->remain -= *len;
+            if (d->remain == 0) d->state = (d->state == BODY_IDENTITY) ? BODY_DONE : BODY_CHUNK_END;
+            return i + *len;
+        }
+        c = (unsigned char)in[i++];
+        switch (d->state) {
+        case BODY_CHUNK_SIZE:
+            if (isxdigit(c)) {
+                // longに収まらない大きさは受け付けない
+                if (++d->ndigits > 15) return -1;
+                d->remain = d->remain * 16 + (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+                break;
+            }
+            if (d->ndigits == 0 || !strchr("; \t\r\n", c)) return -1;
+            d->state = BODY_CHUNK_EXT;
+            if (c != '\n') break;
+            // fall through
+        case BODY_CHUNK_EXT:
+            if (c == '\n') d->state = d->remain > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+            break;
+        case BODY_CHUNK_END:
+            if (c == '\r' && !d->cr) {
+                d->cr = 1;
+                break;
+            }
+            if (c != '\n') return -1;
+            d->state = BODY_CHUNK_SIZE;
+            d->remain = d->ndigits = d->cr = 0;
+            break;
+        case BODY_TRAILER:
+            // トレーラは使わないので読み飛ばし、空行で終わる
+            if (c == '\n') d->state = BODY_DONE;
+            else if (c != '\r') d->state = BODY_TRAILER_LINE;
+            break;
+        case BODY_TRAILER_LINE:
+            if (c == '\n') d->state = BODY_TRAILER;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return i;
+}
+
+/**
+ * 使わないボディを読み捨てる
+ * 長さの分からないチャンク形式のものも、MAX_REQUEST_BODY_LENGTHを超えたら受け取らない。
+ **/
+static int discard_body(struct Connection *conn, const char *buf, size_t len)
+{
+    if (conn->body_received > MAX_REQUEST_BODY_LENGTH) {
+        conn->error = ERROR_413;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Expect: 100-continueを付けたクライアントに、ボディを送ってよいことを伝える
+ * 送信バッファに必ず収まる大きさなので、書けるかどうかを待たずに送る。
+ **/
+static void send_continue(struct Connection *conn)
+{
+    static const char line[] = STATUS_LINE("100 Continue") "\r\n";
+    char *val = lookup_header_field_value(conn->req, HTTP_HEADER_EXPECT);
+
+    if (!val || strcasecmp(val, "100-continue") != 0 || conn->req->protocol_minor_version < 1) return;
+    // 届かなくても、クライアントはしばらく待てばボディを送ってくる
+    send(conn->fd, line, sizeof line - 1, MSG_NOSIGNAL);
+}
+
+/**
+ * 揃ったリクエストに対するレスポンスを組み立てる
+ * ヘッダなどはiovecに並べるだけで、ファイルの中身は送信時に少しずつ読み出す。
+ **/
+static void conn_respond(struct Connection *conn, char *docroot)
+{
+    struct BackendCall *call = conn->req->backend;
+
+    conn->nrequests++;
+    conn->req->keep_alive = keep_alive_p(conn->req, conn->nrequests);
+    conn->keep_alive = conn->req->keep_alive;
+    if (timing) clock_gettime(CLOCK_MONOTONIC, &conn->started);
+    if (call) {
+        // ボディを渡し終えたことを伝え、応答が揃うまではCONN_BACKENDで待つ
+        if (call->backend) backend_queue(call->backend, BACKEND_BODY, call->id, NULL, 0);
+        if (!call->done) {
+            conn->state = CONN_BACKEND;
+            return;
+        }
+    }
+    else if (conn->req->proxy) {
+        // 上流に送ってレスポンスのヘッダが揃うまではCONN_PROXYで待つ
+        conn->state = CONN_PROXY;
+        if (!proxy_pump(conn)) return;
+    }
+    conn_output(conn, docroot);
+}
+
+/**
+ * レスポンスを組み立てて送信を始められる状態にする
+ * 
+ **/
+static void conn_output(struct Connection *conn, char *docroot)
+{
+    respond_to(conn->req, &conn->res, docroot);
+    // 上流のボディの長さが分からなければ、閉じて終わりを伝えることになる
+    conn->keep_alive = conn->req->keep_alive;
+    if (timing) clock_gettime(CLOCK_MONOTONIC, &conn->ready);
+    conn->state = CONN_RESPONSE;
+}
+
+/**
+ * リクエストを処理できなかったことを伝えるエラーレスポンスを用意する
+ * 送り終えたら接続を閉じる。
+ **/
+static void conn_error(struct Connection *conn, enum ErrorPageId id)
+{
+    response_reset(&conn->res);
+    if (timing) {
+        clock_gettime(CLOCK_MONOTONIC, &conn->started);
+        conn->ready = conn->started;
+    }
+    output_error_page(&conn->res, id, 0, 0);
+    conn->keep_alive = 0;
+    conn->state = CONN_RESPONSE;
+}
+
+/**
+ * 受信途中のリクエストがあるか
+ * 
+ **/
+static int conn_pending(struct Connection *conn)
+{
+    return conn->state == CONN_BODY || (conn->state == CONN_REQUEST && conn->inlen > 0);
+}
+
+/**
+ * 送信待ちのデータを書けるだけ書き出す
+ * 全て送り終えたら1を、続きがあれば0を、エラーなら-1を返す。
+ * レスポンスはconn_respond()の直後に呼んで送り始めること。共有キャッシュやエラーページを指したままのことがある。
+ **/
+static int conn_write(struct Connection *conn)
+{
+    struct Response *res = &conn->res;
+    struct msghdr msg;
+    struct FileBody b;
+    ssize_t n;
+    int end;
+
+    memset(&msg, 0, sizeof msg);
+    while (res->iovpos < res->iovcnt) {
+        if (res->iov[res->iovpos].iov_base == NULL) {
+            // ファイルの区間はユーザー空間を経由せずカーネル内で直接送る
+            b.fd = res->fd;
+            b.offset = res->file_offset[res->iovpos];
+            b.remain = res->iov[res->iovpos].iov_len;
+            n = send_file_body(conn->fd, &b);
+            if (n == 0) return -1; // 途中でファイルが短くなった
+            if (n > 0) res->file_offset[res->iovpos] = b.offset;
+        }
+        else {
+            // 次のファイルの区間までのメモリ上のデータをまとめて送る
+            for (end = res->iovpos; end < res->iovcnt && res->iov[end].iov_base; end++)
+                ;
+            msg.msg_iov = res->iov + res->iovpos;
+            msg.msg_iovlen = end - res->iovpos;
+            // 後にファイルが続く場合はMSG_MOREでヘッダとボディの先頭を同じパケットにまとめてもらう
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (end < res->iovcnt ? MSG_MORE : 0));
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // 書き込み可能になるまでにcache_bufやエラーページのDateが書き換わるので、残りは自分で持っておく
+                response_save(res);
+                return 0;
+            }
+            return -1;
+        }
+        response_consume(res, n);
+    }
+    if (res->proxy) return proxy_relay(conn);
+    return 1;
+}
+
+/**
+ * 次のリクエストを受け付けられるように接続の状態を戻す
+ * 受信バッファに残っている次のリクエストは先頭に詰めておく。
+ **/
+static void conn_reset(struct Connection *conn)
+{
+    if (timing) conn_finish(conn);
+    end_body(conn);
+    end_backend_call(conn);
+    end_proxy_call(conn);
+    // リクエストの文字列は受信バッファを指しているので、詰める前にアリーナごと捨てる
+    arena_reset(&conn->arena);
+    conn->req = NULL;
+    conn->body_received = 0;
+    response_reset(&conn->res);
+    memmove(conn->inbuf, conn->inbuf + conn->inpos, conn->inlen - conn->inpos);
+    conn->inlen -= conn->inpos;
+    conn->inpos = 0;
+    // パイプライン化された次のリクエストは既に届いている
+    if (conn->inlen > 0) {
+        conn->header_deadline = timer_clock() + HEADER_TIMEOUT;
+        if (timing) clock_gettime(CLOCK_MONOTONIC, &conn->request_start);
+    }
+    http_parser_init(&conn->parser);
+    conn->state = CONN_REQUEST;
+}
+
+/**
+ * 期限までに読み書きが進まなかった接続を閉じる
+ * timer_expire()から呼ばれる。
+ **/
+static void conn_timeout(struct Timer *t)
+{
+    struct Connection *conn = TIMER_CONN(t);
+
+    // バックエンドの応答待ちは閉じずに504を返させる。応答が揃えばbackend_next_ready()から戻ってくる
+    // ボディを送れずに受信を止めている場合も同じく504にし、残りのボディは読み捨てさせる
+    if (conn->state == CONN_BACKEND || conn->paused) {
+        backend_timeout(conn);
+        conn_set_timer(conn);
+        return;
+    }
+    // 上流を待っている接続も同じく、上流への接続を切って504か切断にする
+    if (proxy_waiting_p(conn)) {
+        proxy_timeout(conn);
+        conn_set_timer(conn);
+        return;
+    }
+    // リクエストの途中で止まっていたなら408を送ってみる。送れなくても待たずに閉じる
+    if (conn_pending(conn)) {
+        conn_error(conn, ERROR_408);
+        conn_write(conn);
+    }
+    free_connection(conn);
+}
+
+/**
+ * 接続の今の状態で待つ期限を仕掛け直す
+ * 次のリクエストを待つ間はkeepalive_timeout、ヘッダは最初のバイトからHEADER_TIMEOUTまで。
+ * ボディの受信と送信は進むたびに期限を延ばす。
+ **/
+static void conn_set_timer(struct Connection *conn)
+{
+    uint64_t expires;
+
+    if (conn->state == CONN_BACKEND || conn->paused)
+        expires = timers.now + BACKEND_TIMEOUT;
+    else if (proxy_waiting_p(conn))
+        expires = timers.now + PROXY_TIMEOUT;
+    else if (conn->state == CONN_REQUEST)
+        expires = conn->inlen > 0 ? conn->header_deadline : timers.now + keepalive_timeout;
+    else if (conn->state == CONN_BODY)
+        expires = timers.now + BODY_TIMEOUT;
+    else
+        expires = timers.now + SEND_TIMEOUT;
+    timer_arm(&timers, &conn->timer, expires);
+}
+
+/**
+ * 接続を閉じて関連するメモリを解放する
+ * 構造体自体は解放しない。
+ **/
+static void release_connection(struct Connection *conn)
+{
+    // 送り終えずに閉じるレスポンスもそこまでの分を記録する
+    if (timing) conn_finish(conn);
+    if (metrics) __atomic_fetch_sub(&metrics->active, 1, __ATOMIC_RELAXED);
+    timer_cancel(&conn->timer);
+    // close()すればepollからも自動的に外れる
+    close(conn->fd);
+    end_body(conn);
+    end_backend_call(conn);
+    end_proxy_call(conn);
+    response_reset(&conn->res);
+    arena_destroy(&conn->arena);
+    free(conn->inbuf);
+    if (conn->out_pipe[0] >= 0) {
+        close(conn->out_pipe[0]);
+        close(conn->out_pipe[1]);
+    }
+}
+
+/**
+ * epollエンジンの接続を閉じて解放する
+ * タイマーはrelease_connection()が取り消す。
+ **/
+static void free_connection(struct Connection *conn)
+{
+    release_connection(conn);
+    free(conn);
+}
+
+/**
+ * タイマーの時計を秒で読む
+ * 時刻を合わせても飛ばないようにCLOCK_MONOTONIC_COARSEを使う。vDSOで読めるのでシステムコールにならない。
+ **/
+static uint64_t timer_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * タイマーホイールを空にして今の時刻から始める
+ * 
+ **/
+static void timer_init(struct TimerWheel *w)
+{
+    memset(w, 0, sizeof(struct TimerWheel));
+    w->now = w->tick = timer_clock();
+}
+
+/**
+ * タイマーの期限をexpiresにする
+ * 仕掛けてあれば掛け直す。期限が変わらなければ何もしない。
+ **/
+static void timer_arm(struct TimerWheel *w, struct Timer *t, uint64_t expires)
+{
+    if (t->pprev) {
+        if (t->expires == expires) return;
+        timer_cancel(t);
+    }
+    t->expires = expires;
+    timer_insert(w, t);
+}
+
+/**
+ * タイマーを取り消す
+ * 仕掛けていなければ何もしない。
+ **/
+static void timer_cancel(struct Timer *t)
+{
+    if (!t->pprev) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/**
+ * 期限までの長さで段を選び、期限の位置のスロットにタイマーを入れる
+ * 段nには64^n秒以上64^(n+1)秒未満先のものが入るので、どの段でもスロットは期限に達する前に一周しない。
+ **/
+static void timer_insert(struct TimerWheel *w, struct Timer *t)
+{
+    struct Timer **slot;
+    uint64_t delta;
+    int level;
+
+    // 過ぎた期限は次に処理する秒に入れる
+    if (t->expires < w->tick) t->expires = w->tick;
+    delta = t->expires - w->tick;
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) {
+        t->expires = w->tick + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        delta = t->expires - w->tick;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)); level++)
+        ;
+    slot = &w->slots[level][(t->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+/**
+ * w->nowまでに期限の来たタイマーを取り出してexpiredに渡す
+ * 1秒進めるごとに一番下の段のスロットを1つ処理し、段が一周したら上の段の次の区間を下の段に入れ直す。
+ * 仕掛けたタイマーの数によらず、1秒あたりの手間は期限の来たものと入れ直すものの数だけで済む。
+ **/
+static void timer_expire(struct TimerWheel *w, void (*expired)(struct Timer *t))
+{
+    struct Timer *t, *list;
+    int level, idx;
+
+    while (w->tick <= w->now) {
+        for (level = 1; level < WHEEL_LEVELS && !(w->tick & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)); level++) {
+            idx = (w->tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            list = w->slots[level][idx];
+            w->slots[level][idx] = NULL;
+            while ((t = list)) {
+                list = t->next;
+                timer_insert(w, t);
+            }
+        }
+        // 先にリストごと外しておき、expiredの中で仕掛け直したものが同じスロットに入っても処理しないようにする
+        idx = w->tick & (WHEEL_SLOTS - 1);
+        list = w->slots[0][idx];
+        w->slots[0][idx] = NULL;
+        if (list) list->pprev = &list;
+        w->tick++;
+        // expiredが他のタイマーを取り消してもlistから外れるよう、1つずつ先頭から取り出す
+        while ((t = list)) {
+            timer_cancel(t);
+            expired(t);
+        }
+    }
+}
+
+/**
+ * io_uringによるイベントループ
+ * 接続の受け付け・受信・送信と、ファイルのstatx・openat・spliceをリングに積んでおき、
+ * 1回のio_uring_enter(2)でまとめて発行し完了を受け取る。
+ * 接続ごとに完了待ちの操作は常に1つだけで、その完了を受け取ったときにだけ接続を解放する。
+ * リンクした操作は途中の完了のuser_dataの下位ビットを立てて区別し、最後の完了を接続の操作の完了とする。
+ * io_uringが使えないカーネルではepollのイベントループに切り替える。
+ **/
+static void uring_loop_main(int server_fd, char *docroot)
+{
+    static struct __kernel_timespec tick = { 1, 0 };
+    struct Uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    struct Connection *conn;
+    uint64_t data;
+    int result;
+
+    if (uring_setup(&ring, URING_ENTRIES) < 0) {
+        log_warn("io_uring is not available (%s), falling back to epoll", strerror(errno));
+        event_loop_main(server_fd, docroot);
+        return;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    set_nonblocking(server_fd);
+    uring_accept(&ring, server_fd);
+    timer_init(&timers);
+    timer_init(&idle_timers);
+    // タイマーホイールを進めるために少なくとも1秒に1回は完了させる
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&tick;
+    sqe->len = 1;
+    sqe->user_data = URING_TIMER;
+
+    for (;;) {
+        // EBUSYはCQから溢れた完了が返せずに残っている。先に刈り取って空きを作れば次の呼び出しで返ってくる
+        if (uring_enter(&ring, backend_ready ? 0 : 1) < 0 && errno != EINTR && errno != EBUSY)
+            log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+        timers.now = timer_clock();
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            data = cqe->user_data;
+            result = cqe->res;
+            // 完了の処理で新しい操作を積むので、先にこのCQEを返しておく
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            if (data == URING_ACCEPT) {
+                if (result >= 0) {
+                    struct Connection *conn = xmalloc(sizeof(struct Connection));
+                    struct timespec t0;
+
+                    if (metrics) clock_gettime(CLOCK_MONOTONIC, &t0);
+                    // multishotでは接続元のアドレスを受け取れないので、init_connection()に調べてもらう
+                    init_connection(conn, result, NULL);
+                    if (metrics) conn_accepted(&t0);
+                    uring_recv(&ring, conn);
+                    conn_set_timer(conn);
+                }
+                else if (result == -EINVAL && ring.multishot_accept) {
+                    // multishotに対応していないカーネル
+                    ring.multishot_accept = 0;
+                }
+                // multishotでも続きがなければ出し直す
+                if (!(cqe->flags & IORING_CQE_F_MORE)) uring_accept(&ring, server_fd);
+            }
+            else if (data == URING_TIMER) {
+                sqe = uring_get_sqe(&ring);
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->addr = (uint64_t)(uintptr_t)&tick;
+                sqe->len = 1;
+                sqe->user_data = URING_TIMER;
+            }
+            else if (backend_p((void*)(uintptr_t)(data & ~(uint64_t)1))) {
+                // バックエンドは読み込みと書き込みの待ちを別々に出し、下位ビットで区別する
+                struct Backend *b = (struct Backend*)(uintptr_t)(data & ~(uint64_t)1);
+
+                if (data & 1) {
+                    b->poll_out = 0;
+                    backend_flush(b);
+                }
+                else {
+                    b->poll_in = 0;
+                    backend_input(b);
+                }
+            }
+            else if (data & 1) {
+                // リンクした操作の途中の完了。接続はリンクの最後の完了を受け取るまで解放しない
+                uring_link_complete((struct Connection*)(uintptr_t)(data & ~(uint64_t)1), result);
+            }
+            else {
+                conn = (struct Connection*)(uintptr_t)data;
+                // リングのバッファに受信したなら、それをそのまま受信バッファにする
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                    conn->inbuf = uring_take_buffer(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                uring_complete(&ring, conn, result, docroot);
+            }
+        }
+        // バックエンドの応答が揃った接続の送信を再開し、溜まったフレームを送る
+        while ((conn = backend_next_ready()))
+            uring_complete(&ring, conn, 0, docroot);
+        if (backend_path) backend_uring_watch(&ring);
+        timer_expire(&timers, uring_conn_timeout);
+        idle_timers.now = timers.now;
+        timer_expire(&idle_timers, upstream_idle_timeout);
+    }
+}
+
+/**
+ * リングを作ってmmap()する
+ * 失敗したら-1を返しerrnoを設定する。
+ * 接続ごとに完了待ちの操作が1つ(リンクした操作ならいくつか)あるので、CQは開けるfdの数に合わせて大きくしておく。
+ * それでも溢れた完了を捨てずに取っておけない(IORING_FEAT_NODROPがない)カーネルでは、
+ * 完了が届かない接続がいつまでも解放されなくなるので使わない。
+ **/
+static int uring_setup(struct Uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    struct rlimit rl;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof p);
+    memset(ring, 0, sizeof *ring);
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_MAX;
+    // 受け付けと1秒ごとのタイムアウト、バックエンドの読み書きの分も足しておく
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur * 2 + entries < URING_CQ_MAX)
+        p.cq_entries = rl.rlim_cur * 2 + entries;
+    if (p.cq_entries < entries * 2) p.cq_entries = entries * 2;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // 5.4以降はSQとCQのリングを1回のmmap()で両方得られる
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+        cq_size = sq_size;
+    }
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring->multishot_accept = 1;
+    uring_setup_buffers(ring);
+    return 0;
+
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+/**
+ * 受信に使うバッファのリング(5.19以降)を登録し、バッファを入れておく
+ * 次のリクエストを待つ間の接続は受信バッファを持たず、届いたときにカーネルが選んだバッファを受け取る。
+ * 登録できなければ、接続ごとの受信バッファに受信する。
+ **/
+static void uring_setup_buffers(struct Uring *ring)
+{
+    struct io_uring_buf_reg reg;
+    int i;
+
+    ring->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return;
+    }
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+        ring->buf_ring = NULL;
+        return;
+    }
+    for (i = 0; i < URING_BUFS; i++) {
+        ring->free_bids[i] = URING_BUFS - 1 - i;
+    }
+    ring->n_free_bids = URING_BUFS;
+    for (i = 0; i < URING_BUFS; i++) {
+        uring_put_buffer(ring, xmalloc(HEADER_BUF_SIZE));
+    }
+}
+
+/**
+ * カーネルが受信に使ったバッファを受け取る
+ * バッファIDは空きに戻し、uring_put_buffer()で別のバッファを入れる。
+ **/
+static char* uring_take_buffer(struct Uring *ring, unsigned bid)
+{
+    char *buf = ring->bufs[bid];
+
+    ring->bufs[bid] = NULL;
+    ring->free_bids[ring->n_free_bids++] = bid;
+    return buf;
+}
+
+/**
+ * 使い終えた受信バッファをリングに入れる
+ * 空いているバッファIDがなければ、リングはいっぱいなので解放する。
+ **/
+static void uring_put_buffer(struct Uring *ring, char *buf)
+{
+    struct io_uring_buf *b;
+    unsigned short bid;
+
+    if (ring->n_free_bids == 0) {
+        free(buf);
+        return;
+    }
+    bid = ring->free_bids[--ring->n_free_bids];
+    ring->bufs[bid] = buf;
+    b = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)buf;
+    b->len = HEADER_BUF_SIZE;
+    b->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * SQにn個のSQEを続けて積める空きを作る
+ * リンクした操作を途中で分けて発行しないように、まとめて積む前に呼ぶ。
+ **/
+static void uring_reserve(struct Uring *ring, unsigned n)
+{
+    while (*ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + n > ring->sq_entries) {
+        if (uring_enter(ring, 0) < 0 && errno != EINTR && errno != EBUSY)
+            log_exit("io_uring_enter(2) failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * 空いているSQEを1つ取り出し、提出待ちに加える
+ * SQがいっぱいなら積んである分を先に発行する。
+ **/
+static struct io_uring_sqe* uring_get_sqe(struct Uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+
+    uring_reserve(ring, 1);
+    tail = *ring->sq_tail;
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    // カーネルに見せるのはSQEを書き終えてから。uring_enter()までに書き終えるので問題ない
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * 積んであるSQEを全て発行し、wait個以上の完了を待つ
+ * 
+ **/
+static int uring_enter(struct Uring *ring, unsigned wait)
+{
+    unsigned pending = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return syscall(__NR_io_uring_enter, ring->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/**
+ * 接続の受け付けを発行する
+ * multishotなら1回の発行で接続が来るたびに完了が届く。
+ **/
+static void uring_accept(struct Uring *ring, int server_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (ring->multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+}
+
+/**
+ * 受信を発行する
+ * 次のリクエストを待つ間は受信バッファをリングに返し、届いたときにカーネルが選んだバッファで受け取る。
+ * 待っているだけの接続がバッファを持たずに済む。
+ **/
+static void uring_recv(struct Uring *ring, struct Connection *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    // splice()でボディを受け取る場合は、読み込み可能になるのを待ってからconn_read()する
+    if (conn->state == CONN_BODY && conn->pipe[0] >= 0) {
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = conn->fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = (uint64_t)(uintptr_t)conn;
+        conn->op = URING_OP_POLL_IN;
+        return;
+    }
+    if (ring->buf_ring && conn->state == CONN_REQUEST && conn->inlen == 0) {
+        if (conn->inbuf) uring_put_buffer(ring, conn->inbuf);
+        conn->inbuf = NULL;
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->fd;
+        sqe->len = conn->insize;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+        sqe->user_data = (uint64_t)(uintptr_t)conn;
+        conn->op = URING_OP_RECV;
+        return;
+    }
+    uring_recv_into(ring, conn);
+}
+
+/**
+ * 接続の受信バッファへの受信を発行する
+ * 
+ **/
+static void uring_recv_into(struct Uring *ring, struct Connection *conn)
+{
+    struct io_uring_sqe *sqe;
+    size_t room;
+    char *buf;
+
+    buf = conn_read_buffer(conn, &room);
+    sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = room;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    conn->op = URING_OP_RECV;
+}
+
+/**
+ * レスポンスの続きの送信を発行する
+ * 次のファイルの区間までのメモリ上のデータはsendmsgで、ファイルの区間はuring_splice()で送る。
+ * 上流から中継するボディや、パイプを作れなかった場合のファイルの区間はその場でconn_write()し、
+ * 送りきれなければ書き込み可能になるのを待つ。
+ * 発行したら0を、conn_write()と同じく送り終えたら1を、エラーなら-1を返す。
+ **/
+static int uring_write(struct Uring *ring, struct Connection *conn)
+{
+    struct Response *res = &conn->res;
+    struct io_uring_sqe *sqe;
+    int end, ret;
+
+    if (res->iovpos == res->iovcnt && !res->proxy) return 1;
+    if (res->iovpos < res->iovcnt && res->iov[res->iovpos].iov_base) {
+        // 完了するまでにcache_bufやエラーページのDateが書き換わるので、先にコピーを取っておく
+        response_save(res);
+        for (end = res->iovpos; end < res->iovcnt && res->iov[end].iov_base; end++)
+            ;
+        memset(&conn->msg, 0, sizeof conn->msg);
+        conn->msg.msg_iov = res->iov + res->iovpos;
+        conn->msg.msg_iovlen = end - res->iovpos;
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+        // 後にファイルが続く場合はヘッダとボディの先頭を同じパケットにまとめてもらう
+        sqe->msg_flags = MSG_NOSIGNAL | (end < res->iovcnt ? MSG_MORE : 0);
+        sqe->user_data = (uint64_t)(uintptr_t)conn;
+        conn->op = URING_OP_SEND;
+        return 0;
+    }
+    if (res->iovpos < res->iovcnt && uring_splice(ring, conn) == 0) return 0;
+    ret = conn_write(conn);
+    if (ret != 0) return ret;
+    // 中継するボディの続きが上流から届くのを待つ
+    if (res->proxy && res->proxy->wait) {
+        proxy_uring_poll(ring, conn);
+        return 0;
+    }
+    uring_poll_out(ring, conn);
+    return 0;
+}
+
+/**
+ * res->iovposのファイルの区間の続きを、パイプを経由してソケットにsplice()する
+ * パイプが空なら、ファイルからパイプへのspliceとパイプからソケットへのspliceをリンクして積む。
+ * ファイルから読めた分が足りなければリンクした送信は取り消されるので、パイプに残った分を次に送る。
+ * パイプを作れなければ-1を返す。
+ **/
+static int uring_splice(struct Uring *ring, struct Connection *conn)
+{
+    struct Response *res = &conn->res;
+    struct io_uring_sqe *sqe;
+    off_t offset = res->file_offset[res->iovpos];
+    size_t remain = res->iov[res->iovpos].iov_len;
+    size_t len;
+
+    if (conn->out_pipe[0] < 0 && pipe2(conn->out_pipe, O_CLOEXEC) < 0) {
+        conn->out_pipe[0] = conn->out_pipe[1] = -1;
+        return -1;
+    }
+    uring_reserve(ring, 2);
+    len = conn->out_piped;
+    if (len == 0) {
+        // パイプの容量(既定で16ページ)に収まるよう、SPLICE_CHUNK_SIZEの境界で区切る
+        len = SPLICE_CHUNK_SIZE - (offset & (SPLICE_CHUNK_SIZE - 1));
+        if (len > remain) len = remain;
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = conn->out_pipe[1];
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = res->fd;
+        sqe->splice_off_in = offset;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (uint64_t)(uintptr_t)conn | 1;
+    }
+    sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = conn->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = conn->out_pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE | (len < remain || res->iovpos + 1 < res->iovcnt ? SPLICE_F_MORE : 0);
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    conn->op = URING_OP_SPLICE;
+    return 0;
+}
+
+/**
+ * ソケットが書き込み可能になるのを待つ
+ * 
+ **/
+static void uring_poll_out(struct Uring *ring, struct Connection *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    conn->op = URING_OP_POLL;
+}
+
+/**
+ * 揃ったリクエストが使うファイルのうち、覚えていないパスをstatx()とopenat()で調べる
+ * 元のファイルに加え、negotiate_encoding()が探す圧縮済みのファイルも調べる。元のファイルは開いてもおく。
+ * 途中で存在しないパスがあっても続けるようにハードリンクで繋ぎ、結果はuring_lookup_done()で覚える。
+ * 調べるものがなければ0を返し、積んだら1を返す。
+ **/
+static int uring_lookup(struct Uring *ring, struct Connection *conn, char *docroot)
+{
+    struct HTTPRequest *req = conn->req;
+    struct StatEntry *e;
+    struct FileInfo probe;
+    struct UringLookup *l;
+    struct io_uring_sqe *sqe;
+    char *path, *val;
+    size_t len;
+    int mask, i, n = 0;
+
+    // 結果を使い回さないなら、先に調べても役に立たない
+    if (stat_cache_ttl == 0 || req->upload || req->backend || req->proxy) return 0;
+    if (strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0) return 0;
+    if (stats_path && strcmp(req->path, stats_path) == 0) return 0;
+    len = strlen(docroot) + 1 + strlen(req->path) + 1;
+    path = arena_alloc(&conn->arena, len);
+    snprintf(path, len, "%s/%s", docroot, req->path);
+    conn->lookups = arena_alloc(&conn->arena, (N_CONTENT_CODINGS + 1) * sizeof(struct UringLookup));
+    conn->lookup_open = 0;
+    e = stat_cache_find(path, hash_string(path));
+    // 存在しないことを覚えていれば、圧縮済みのファイルは探されない
+    if (e && timer_clock() < e->expires && !e->ok) return 0;
+    probe.path = path;
+    val = lookup_header_field_value(req, HTTP_HEADER_ACCEPT_ENCODING);
+    if (val && guess_content_type(&probe)->compressible) {
+        mask = accepted_encodings(val);
+        for (i = 0; i < N_CONTENT_CODINGS; i++) {
+            if (!(mask & (1 << i))) continue;
+            l = &conn->lookups[n];
+            l->path = arena_alloc(&conn->arena, len + strlen(content_codings[i].ext));
+            snprintf(l->path, len + strlen(content_codings[i].ext), "%s%s", path, content_codings[i].ext);
+            if (!stat_cache_fresh_p(l->path)) n++;
+        }
+    }
+    if (!e || timer_clock() >= e->expires) {
+        conn->lookups[n++].path = path;
+        conn->lookup_open = 1;
+    }
+    if (n == 0) return 0;
+    uring_reserve(ring, n + conn->lookup_open);
+    for (i = 0; i < n; i++) {
+        l = &conn->lookups[i];
+        l->result = -ECANCELED;
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)l->path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)&l->stx;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = (uint64_t)(uintptr_t)conn;
+        if (i < n - 1 || conn->lookup_open) {
+            sqe->flags = IOSQE_IO_HARDLINK;
+            sqe->user_data |= 1;
+        }
+    }
+    if (conn->lookup_open) {
+        // シンボリックリンクは送らないので辿らない
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NOFOLLOW;
+        sqe->user_data = (uint64_t)(uintptr_t)conn;
+    }
+    conn->nlookups = n;
+    conn->lookup_pos = 0;
+    conn->op = URING_OP_LOOKUP;
+    return 1;
+}
+
+/**
+ * uring_lookup()で調べた結果をstat_cache_fill()で覚える
+ * resultはリンクの最後の操作の結果。存在しないと分かったもの以外の失敗は覚えず、lstat()に任せる。
+ **/
+static void uring_lookup_done(struct Connection *conn, int result)
+{
+    struct UringLookup *l;
+    struct stat st;
+    int fd = -1, i;
+
+    if (conn->lookup_open)
+        fd = result;
+    else if (conn->lookup_pos < conn->nlookups)
+        conn->lookups[conn->lookup_pos++].result = result;
+    for (i = 0; i < conn->nlookups; i++) {
+        l = &conn->lookups[i];
+        if (l->result == 0) {
+            statx_to_stat(&l->stx, &st);
+            stat_cache_fill(l->path, &st, i == conn->nlookups - 1 ? fd : -1);
+            continue;
+        }
+        if (l->result == -ENOENT || l->result == -ENOTDIR) stat_cache_fill(l->path, NULL, -1);
+        if (i == conn->nlookups - 1 && fd >= 0) close(fd);
+    }
+    conn->nlookups = 0;
+}
+
+/**
+ * statx()の結果をlstat()と同じ形に直す
+ * 
+ **/
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+    memset(st, 0, sizeof *st);
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/**
+ * リンクした操作の途中の完了を記録する
+ * 接続の操作はリンクの最後の完了でuring_complete()が進める。
+ **/
+static void uring_link_complete(struct Connection *conn, int result)
+{
+    if (conn->op == URING_OP_SPLICE) {
+        // ファイルからパイプに移せた分だけ読む位置を進める。0ならファイルが短くなっている
+        if (result > 0) {
+            conn->out_piped += result;
+            conn->res.file_offset[conn->res.iovpos] += result;
+        }
+        else {
+            conn->out_failed = 1;
+        }
+    }
+    else if (conn->op == URING_OP_LOOKUP && conn->lookup_pos < conn->nlookups) {
+        conn->lookups[conn->lookup_pos++].result = result;
+    }
+}
+
+/**
+ * 接続の操作の完了を処理し、状態を先に進める
+ * handle_connection()のio_uring版。次の操作を発行するか、接続を閉じて戻る。
+ **/
+static void uring_complete(struct Uring *ring, struct Connection *conn, int result, char *docroot)
+{
+    ssize_t n;
+    int eof = 0;
+    int ret;
+
+    if (conn->closing) {
+        // 開いたfdは覚えるか閉じる
+        if (conn->op == URING_OP_LOOKUP) uring_lookup_done(conn, result);
+        goto close;
+    }
+    switch (conn->op) {
+    case URING_OP_RECV:
+        if (result == -EINTR || result == -EAGAIN) {
+            uring_recv(ring, conn);
+            goto wait;
+        }
+        // リングのバッファが尽きていれば、自分で確保したバッファに受信し直す
+        if (result == -ENOBUFS && !conn->inbuf) {
+            conn->inbuf = xmalloc(conn->insize);
+            uring_recv_into(ring, conn);
+            goto wait;
+        }
+        if (result < 0) goto close;
+        // バッファを受け取らないまま終わったなら、受信途中のリクエストもない
+        if (!conn->inbuf) goto close;
+        if (result == 0)
+            eof = 1;
+        else
+            conn_received(conn, result);
+        break;
+    case URING_OP_POLL_IN:
+        if (result < 0 && result != -EINTR) goto close;
+        n = conn_read(conn);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) goto close;
+        eof = (n == 0);
+        break;
+    case URING_OP_PROXY:
+        // 上流のソケットで待っていた。ヘッダが揃うまではproxy_pump()で進め、ボディの中継中なら送信の続きとして扱う
+        if (conn->state == CONN_PROXY) {
+            if (!proxy_pump(conn)) {
+                proxy_uring_poll(ring, conn);
+                goto wait;
+            }
+            conn_output(conn, docroot);
+            break;
+        }
+        // fall through
+    case URING_OP_SEND:
+    case URING_OP_POLL:
+    case URING_OP_SPLICE:
+        if (conn->op == URING_OP_SEND) {
+            if (result < 0 && result != -EINTR && result != -EAGAIN) goto close;
+            if (result > 0) response_consume(&conn->res, result);
+        }
+        else if (conn->op == URING_OP_SPLICE) {
+            // ファイルから読めなければリンクした送信は取り消されている
+            if (conn->out_failed || result == 0) goto close;
+            if (result == -EAGAIN) {
+                uring_poll_out(ring, conn);
+                goto wait;
+            }
+            if (result < 0 && result != -EINTR && result != -ECANCELED) goto close;
+            if (result > 0) {
+                conn->out_piped -= result;
+                response_consume(&conn->res, result);
+            }
+        }
+        ret = uring_write(ring, conn);
+        if (ret < 0) goto close;
+        if (ret == 0) goto wait;
+        if (!conn->keep_alive) goto close;
+        conn_reset(conn);
+        break;
+    case URING_OP_LOOKUP:
+        uring_lookup_done(conn, result);
+        conn_respond(conn, docroot);
+        break;
+    case URING_OP_NONE:
+        // backend_next_ready()から呼ばれた。止めていたボディの受信を再開するか、バックエンドの応答が揃っている
+        if (conn->state == CONN_BODY) break;
+        if (conn->state != CONN_BACKEND) goto close;
+        conn_output(conn, docroot);
+        break;
+    default:
+        goto close;
+    }
+    // パイプライン化されたリクエストはバッファに残っているので、順番に1つずつ処理する
+    for (;;) {
+        if (conn->state != CONN_RESPONSE) {
+            ret = conn_parse(conn, docroot);
+            if (ret == 0) {
+                if (eof) goto close;
+                // 受信を止める間は操作を発行しない。送れるようになればbackend_next_ready()から戻ってくる
+                if (backend_paused_p(conn)) {
+                    conn->paused = 1;
+                    conn->op = URING_OP_NONE;
+                    goto wait;
+                }
+                uring_recv(ring, conn);
+                goto wait;
+            }
+            if (ret < 0)
+                conn_error(conn, conn->error);
+            else if (uring_lookup(ring, conn, docroot))
+                goto wait;
+            else
+                conn_respond(conn, docroot);
+            if (conn->state == CONN_BACKEND) {
+                conn->op = URING_OP_NONE;
+                goto wait;
+            }
+            if (conn->state == CONN_PROXY) {
+                proxy_uring_poll(ring, conn);
+                goto wait;
+            }
+        }
+        ret = uring_write(ring, conn);
+        if (ret < 0) goto close;
+        if (ret == 0) goto wait;
+        if (!conn->keep_alive) goto close;
+        conn_reset(conn);
+    }
+wait:
+    // 次の操作を発行したので、その完了を待つ期限を掛け直す
+    conn_set_timer(conn);
+    return;
+close:
+    free_connection(conn);
+}
+
+/**
+ * 期限までに読み書きが進まなかった接続を閉じる
+ * conn_timeout()のio_uring版。完了待ちの操作があるうちは解放できないので、
+ * shutdown(2)で操作を終わらせ、その完了でuring_complete()に閉じてもらう。
+ **/
+static void uring_conn_timeout(struct Timer *t)
+{
+    struct Connection *conn = TIMER_CONN(t);
+
+    // 応答待ちや受信を止めている接続には完了待ちの操作がないので、閉じずに504を返させる
+    if (conn->state == CONN_BACKEND || conn->paused) {
+        backend_timeout(conn);
+        conn_set_timer(conn);
+        return;
+    }
+    // 上流のソケットで待っている操作は、上流への接続をshutdown(2)して終わらせる
+    if (proxy_waiting_p(conn)) {
+        proxy_timeout(conn);
+        conn_set_timer(conn);
+        return;
+    }
+    // 408は受信待ちの間にしか送らないので、送信中のレスポンスとは混ざらない
+    if (conn_pending(conn)) {
+        conn_error(conn, ERROR_408);
+        conn_write(conn);
+    }
+    shutdown(conn->fd, SHUT_RDWR);
+    conn->closing = 1;
+}
+
+/**
+ * パーサの結果からリクエスト構造体を組み立てる
+ * 文字列はbuf上の区切り文字を終端に置き換えてそのまま指すので、コピーは行わない。
+ * bufはリクエストを使い終えるまで残しておくこと。重ねられないヘッダが重なっていればNULLを返す。
+ **/
+static struct HTTPRequest* build_request(struct HTTPParser *p, char *buf, struct Arena *arena)
+{
+    struct HTTPRequest *req;
+    struct HTTPParsedHeader *ph;
+    struct HTTPHeaderField *h;
+    int i;
+
+    req = alloc_request(arena);
+    req->method = slice_string(buf, &p->method);
+    http_upcase(req->method, p->method.len);
+    req->path = slice_string(buf, &p->path);
+    req->protocol_minor_version = p->minor_version;
+    for (i = 0; i < p->nheaders; i++) {
+        ph = &p->headers[i];
+        if (ph->id != HTTP_HEADER_UNKNOWN) {
+            if (add_known_header(req, ph->id, slice_string(buf, &ph->value), arena) < 0) return NULL;
+            continue;
+        }
+        // 未知のヘッダは多くないので、必要になったときにまとめて確保する
+        if (!req->other_header) {
+            req->other_header = arena_alloc(arena, sizeof(struct HTTPHeaderField) * (p->nheaders - i));
+        }
+        h = &req->other_header[req->n_other_header++];
+        // ヘッダ名は小文字にそろえておき、検索では大文字小文字を区別せずに済むようにする
+        h->name = slice_string(buf, &ph->name);
+        http_downcase(h->name, ph->name.len);
+        h->value = slice_string(buf, &ph->value);
+    }
+    req->length = p->content_length > 0 ? p->content_length : 0;
+    return req;
+}
+
+/**
+ * 既知のヘッダの値を設定する
+ * 同じヘッダが複数ある場合は", "でつないで1つの値にする(RFC 9110 5.3)。
+ * ただしCookieは"; "でつなぎ(RFC 6265 5.4)、Hostが2つあるリクエストは不正として-1を返す(RFC 9112 3.2)。
+ **/
+static int add_known_header(struct HTTPRequest *req, enum HTTPHeaderId id, char *value, struct Arena *arena)
+{
+    char *prev = req->known_header[id];
+    const char *sep = id == HTTP_HEADER_COOKIE ? "; " : ", ";
+    size_t plen, vlen;
+
+    if (!prev) {
+        req->known_header[id] = value;
+        return 0;
+    }
+    if (id == HTTP_HEADER_HOST) return -1;
+    plen = strlen(prev);
+    vlen = strlen(value);
+    req->known_header[id] = arena_alloc(arena, plen + vlen + 3);
+    memcpy(req->known_header[id], prev, plen);
+    memcpy(req->known_header[id] + plen, sep, 2);
+    memcpy(req->known_header[id] + plen + 2, value, vlen + 1);
+    return 0;
+}
+
+/**
+ * スライスの直後(空白や":"、改行などの区切り文字)を終端に置き換えて文字列にする
+ * 
+ **/
+static char* slice_string(char *buf, struct HTTPSlice *s)
+{
+    buf[s->off + s->len] = '\0';
+    return buf + s->off;
+}
+
+/**
+ * 空のリクエスト構造体をアリーナに作成する
+ * 全てのメンバをNULLにしておく。
+ **/
+static struct HTTPRequest* alloc_request(struct Arena *arena)
+{
+    struct HTTPRequest *req;
+
+    req = arena_alloc(arena, sizeof(struct HTTPRequest));
+    memset(req, 0, sizeof(struct HTTPRequest));
+    return req;
+}
+
+/**
+ * レスポンス後も接続を維持するかを決める
+ * HTTP/1.1は明示的にcloseされない限り維持し、HTTP/1.0はkeep-aliveを要求された場合のみ維持する。
+ * 1つの接続で処理するリクエストの数がmax_requestsに達したら閉じる。
+ **/
+static int keep_alive_p(struct HTTPRequest *req, int nrequests)
+{
+    char *val;
+
+    if (nrequests >= max_requests) return 0;
+    val = lookup_header_field_value(req, HTTP_HEADER_CONNECTION);
+    if (val && header_token_p(val, "close")) return 0;
+    if (val && header_token_p(val, "keep-alive")) return 1;
+    return req->protocol_minor_version >= 1;
+}
+
+/**
+ * カンマ区切りのヘッダの値にtokenが要素として含まれているか
+ * 要素の前後の空白(OWS)は除き、大文字小文字を区別せずに要素全体で比べる。"not-close"はcloseではない。
+ **/
+static int header_token_p(const char *val, const char *token)
+{
+    size_t len = strlen(token);
+    const char *p = val, *end, *q;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0') return 0;
+        for (end = p; *end && *end != ','; end++)
+            ;
+        if ((size_t)(end - p) >= len && strncasecmp(p, token, len) == 0) {
+            for (q = p + len; q < end && (*q == ' ' || *q == '\t'); q++)
+                ;
+            if (q == end) return 1;
+        }
+        p = end;
+    }
+}
+
+/**
+ * 指定のヘッダフィールドの値を取得する
+ * 既知のヘッダは解析時に番号へ変換してあるので、表を引くだけでよい。
+ **/
+static char* lookup_header_field_value(struct HTTPRequest *req, enum HTTPHeaderId id)
+{
+    return req->known_header[id];
+}
+
+/**
+ * メソッドに応じたレスポンスを組み立てる
+ * 
+ **/
+static void respond_to(struct HTTPRequest *req, struct Response *res, char *docroot)
+{
+    if (req->upload)
+        finish_upload(req, res);
+    else if (req->backend)
+        finish_backend_call(req, res);
+    else if (req->proxy)
+        finish_proxy_call(req, res);
+    else if (stats_path && strcmp(req->path, stats_path) == 0
+        && (strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0))
+        output_stats(req, res);
+    else if (strcmp(req->method, "GET") == 0)
+        do_file_response(req, res, docroot);
+    else if (strcmp(req->method, "HEAD") == 0)
+        do_file_response(req, res, docroot);
+    else if (strcmp(req->method, "POST") == 0)
+        method_not_allowed(req, res);
+    else
+        not_implemented(req, res);
+}
+
+/**
+ * 構造体requestからリクエスト情報を受け取ってリクエストされたパスのファイルを返すレスポンスを組み立てる
+ * ファイルの中身はファイルの区間としてresに加え、ヘッダを送った後でconn_write()が送る。
+ * 条件付きリクエストには304を、Rangeには206か416を返す。
+ **/
+static void do_file_response(struct HTTPRequest *req, struct Response *res, char *docroot)
+{
+    struct FileInfo *info;
+    struct ByteRange ranges[MAX_RANGES];
+    int nranges = 0;
+    int fd = -1;
+    int retried = 0;
+    char *header, *data;
+
+    size_t header_len, body_len;
+    int head = (strcmp(req->method, "HEAD") == 0);
+
+again:
+    if (metrics) {
+        struct timespec t0, t1;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        info = get_fileinfo(docroot, req->path);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        record_stage(STAGE_FILEINFO, &t0, &t1);
+    }
+    else {
+        info = get_fileinfo(docroot, req->path);
+    }
+    if (!info->ok) {
+        free_fileinfo(info);
+        not_found(req, res);
+        return;
+    }
+    // 符号化を決めてから検証する。ETagは符号化ごとに異なる
+    negotiate_encoding(req, info);
+    // クライアントが持っているものと同じなら中身は送らない
+    if (not_modified_p(req, info)) {
+        output_not_modified(req, res, info);
+        free_fileinfo(info);
+        return;
+    }
+    // RangeはGETにだけ適用する。If-Rangeが一致しない場合や指定が不正な場合は無視して全体を送る
+    if (!head && lookup_header_field_value(req, HTTP_HEADER_RANGE) && if_range_match_p(req, info)) {
+        nranges = parse_ranges(lookup_header_field_value(req, HTTP_HEADER_RANGE), info->size, ranges);
+        if (nranges == 0) {
+            output_range_not_satisfiable(req, res, info);
+            free_fileinfo(info);
+            return;
+        }
+        if (nranges < 0) nranges = 0;
+    }
+    // キャッシュにあればファイルを開かずにメモリ上のヘッダと中身をそのまま書き出す
+    if (file_cache && (data = cache_lookup(info, res, &header_len, &body_len))) {
+        goto cached;
+    }
+    // --mmapではファイルを読み込まずにマッピングから直接送る
+    if (mmap_mode && !head && !info->compress && (res->map = mapping_get(info))) {
+        data = res->map->addr;
+        goto mapped;
+    }
+    // 圧縮する場合は圧縮後の長さを知るためにHEADでも読み込む
+    if (!head || info->compress) {
+        // ヘッダを組み立てる前に開いておく。開けなければ(stat後に消された場合など)Not Foundにする
+        // fdは同じファイルへの他のリクエストと共有し、閉じずに次のリクエストでも使う
+        fd = stat_cache_open(info->stat);
+        if (fd < 0) {
+            free_fileinfo(info);
+            // 覚えていた結果の後で入れ替わったファイルなら、問い合わせ直して最初からやり直す
+            if (errno == ESTALE && !retried) {
+                retried = 1;
+                goto again;
+            }
+            not_found(req, res);
+            return;
+        }
+        // 小さなファイルは読み込んだついでにキャッシュに入れ、そのまま応答に使う
+        if (file_cache && cache_fill(info, fd, &header_len, &body_len)) {
+            data = cache_buf;
+            goto cached;
+        }
+        // 圧縮しても小さくならなかったものなどはそのまま送る
+        if (info->compress) {
+            cancel_compression(info);
+            if (head) fd = -1;
+        }
+        if (fd >= 0) {
+            res->fd = fd;
+            res->file = info->stat;
+            res->file->refs++;
+        }
+    }
+    if (nranges > 0) {
+        output_partial_content(req, res, info, ranges, nranges, NULL);
+    }
+    else {
+        output_common_header_fields(req, res, STATUS_LINE("200 OK"));
+        header = arena_alloc(res->arena, CACHE_HEADER_SIZE);
+        response_add(res, header, render_file_header(info, header, CACHE_HEADER_SIZE));
+        if (fd >= 0) response_add_file(res, 0, info->size);
+    }
+    free_fileinfo(info);
+    return;
+
+mapped:
+    // マッピングはres->mapが参照を持つ間は外されないので、送り残してもコピーしない
+    if (nranges > 0) {
+        output_partial_content(req, res, info, ranges, nranges, data);
+    }
+    else {
+        output_common_header_fields(req, res, STATUS_LINE("200 OK"));
+        header = arena_alloc(res->arena, CACHE_HEADER_SIZE);
+        response_add(res, header, render_file_header(info, header, CACHE_HEADER_SIZE));
+        response_add(res, data, info->size);
+    }
+    free_fileinfo(info);
+    return;
+
+cached:
+    // 共有キャッシュやcache_bufは後で上書きされるが、送りきれなければconn_write()がコピーを取る
+    if (nranges > 0) {
+        output_partial_content(req, res, info, ranges, nranges, data + header_len);
+    }
+    else {
+        output_common_header_fields(req, res, STATUS_LINE("200 OK"));
+        response_add(res, data, head ? header_len : header_len + body_len);
+    }
+    free_fileinfo(info);
+}
+
+/**
+ * If-None-MatchとIf-Modified-Sinceを評価し、304を返すべきかを判定する
+ * If-None-Matchがある場合はIf-Modified-Sinceを見ない(RFC 9110 13.2.2)。
+ **/
+static int not_modified_p(struct HTTPRequest *req, struct FileInfo *info)
+{
+    char *val;
+    time_t t;
+
+    val = lookup_header_field_value(req, HTTP_HEADER_IF_NONE_MATCH);
+    if (val) return etag_match_p(val, file_etag(info));
+    val = lookup_header_field_value(req, HTTP_HEADER_IF_MODIFIED_SINCE);
+    if (val && parse_http_date(val, &t)) return info->st.st_mtime <= t;
+    return 0;
+}
+
+/**
+ * If-Rangeがない、またはファイルが変わっていなければ真を返す
+ * ETagは強い比較で、日付はLast-Modifiedと完全に一致する場合だけ一致とみなす。
+ **/
+static int if_range_match_p(struct HTTPRequest *req, struct FileInfo *info)
+{
+    char *val;
+    time_t t;
+
+    val = lookup_header_field_value(req, HTTP_HEADER_IF_RANGE);
+    if (!val) return 1;
+    if (val[0] == '"') return strcmp(val, file_etag(info)) == 0;
+    return parse_http_date(val, &t) && t == info->st.st_mtime;
+}
+
+/**
+ * カンマ区切りのETagの一覧にetagが含まれるかを弱い比較(W/を無視する)で調べる
+ * "*"はどのETagにも一致する。
+ **/
+static int etag_match_p(const char *list, const char *etag)
+{
+    const char *p = list, *q;
+    size_t len = strlen(etag);
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0') return 0;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        if (*p != '"') return 0;
+        q = strchr(p + 1, '"');
+        if (!q) return 0;
+        if ((size_t)(q + 1 - p) == len && strncmp(p, etag, len) == 0) return 1;
+        p = q + 1;
+    }
+}
+
+/**
+ * "bytes=0-99,200-,-50"のようなRangeの値を解析し、サイズsizeのファイル上の範囲に直す
+ * 満たせる範囲の数を返す。全て満たせなければ0を、書式が不正か範囲が多すぎる場合は-1を返す。
+ **/
+static int parse_ranges(const char *val, off_t size, struct ByteRange *ranges)
+{
+    const char *p;
+    char *end;
+    long long first, last;
+    int n = 0, nspecs = 0;
+
+    if (strncasecmp(val, "bytes=", 6) != 0) return -1;
+    p = val + 6;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0') break;
+        errno = 0;
+        if (*p == '-') {
+            // 末尾からの長さ
+            if (!isdigit((unsigned char)p[1])) return -1;
+            last = strtoll(p + 1, &end, 10);
+            if (errno) return -1;
+            if (last == 0 || size == 0) goto next;
+            first = last > size ? 0 : size - last;
+            last = size - 1;
+        }
+        else if (isdigit((unsigned char)*p)) {
+            first = strtoll(p, &end, 10);
+            if (errno || *end != '-') return -1;
+            end++;
+            if (isdigit((unsigned char)*end)) {
+                last = strtoll(end, &end, 10);
+                if (errno || last < first) return -1;
+            }
+            else {
+                last = size - 1;
+            }
+            if (first >= size) goto next;
+            if (last >= size) last = size - 1;
+        }
+        else {
+            return -1;
+        }
+        // 細かな範囲を大量に指定して負荷をかけるものは受け付けない
+        if (n == MAX_RANGES) return -1;
+        ranges[n].first = first;
+        ranges[n].last = last;
+        n++;
+    next:
+        nspecs++;
+        p = end;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p != ',' && *p != '\0') return -1;
+    }
+    return nspecs > 0 ? n : -1;
+}
+
+/**
+ * 304 Not Modifiedのレスポンスを組み立てる
+ * 
+ **/
+static void output_not_modified(struct HTTPRequest *req, struct Response *res, struct FileInfo *info)
+{
+    char *header = arena_alloc(res->arena, CACHE_HEADER_SIZE);
+    int len;
+
+    output_common_header_fields(req, res, STATUS_LINE("304 Not Modified"));
+    len = render_validators(info, header, CACHE_HEADER_SIZE);
+    len += snprintf(header + len, CACHE_HEADER_SIZE - len, "\r\n");
+    response_add(res, header, len);
+}
+
+/**
+ * 416 Range Not Satisfiableのレスポンスを組み立てる
+ * 
+ **/
+static void output_range_not_satisfiable(struct HTTPRequest *req, struct Response *res, struct FileInfo *info)
+{
+    char *header = arena_alloc(res->arena, LINE_BUF_SIZE);
+
+    output_common_header_fields(req, res, STATUS_LINE("416 Range Not Satisfiable"));
+    response_add(res, header, snprintf(header, LINE_BUF_SIZE,
+                                       "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n", info->size));
+}
+
+/**
+ * 206 Partial Contentのレスポンスを組み立てる
+ * 範囲が1つならそのまま、複数ならmultipart/byteranges形式で送る。
+ * dataにファイルの中身があればそこから、NULLならres->fdの区間として送る。
+ **/
+static void output_partial_content(struct HTTPRequest *req, struct Response *res, struct FileInfo *info,
+                                   struct ByteRange *ranges, int nranges, char *data)
+{
+    const char *type = info->type;
+    const char *boundary;
+    char *header, *part, *trailer;
+    size_t len, part_len, trailer_len;
+    long total;
+    int i;
+
+    output_common_header_fields(req, res, STATUS_LINE("206 Partial Content"));
+    header = arena_alloc(res->arena, CACHE_HEADER_SIZE);
+    if (nranges == 1) {
+        len = snprintf(header, CACHE_HEADER_SIZE,
+                       "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %ld\r\nContent-Type: %s\r\n",
+                       (long)ranges[0].first, (long)ranges[0].last, info->size,
+                       (long)(ranges[0].last - ranges[0].first + 1), type);
+        if (info->encoding)
+            len += snprintf(header + len, CACHE_HEADER_SIZE - len, "Content-Encoding: %s\r\n", info->encoding);
+        len += render_validators(info, header + len, CACHE_HEADER_SIZE - len);
+        len += snprintf(header + len, CACHE_HEADER_SIZE - len, "\r\n");
+        response_add(res, header, len);
+        if (data)
+            response_add(res, data + ranges[0].first, ranges[0].last - ranges[0].first + 1);
+        else
+            response_add_file(res, ranges[0].first, ranges[0].last - ranges[0].first + 1);
+        return;
+    }
+    // 各部分の前に境界と部分ごとのヘッダを置き、最後に終わりの境界を置く
+    boundary = multipart_boundary();
+    response_add(res, header, 0);
+    total = 0;
+    for (i = 0; i < nranges; i++) {
+        part = arena_alloc(res->arena, LINE_BUF_SIZE);
+        part_len = snprintf(part, LINE_BUF_SIZE,
+                            "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                            boundary, type, (long)ranges[i].first, (long)ranges[i].last, info->size);
+        response_add(res, part, part_len);
+        len = ranges[i].last - ranges[i].first + 1;
+        if (data)
+            response_add(res, data + ranges[i].first, len);
+        else
+            response_add_file(res, ranges[i].first, len);
+        total += part_len + len;
+    }
+    trailer = arena_alloc(res->arena, LINE_BUF_SIZE);
+    trailer_len = snprintf(trailer, LINE_BUF_SIZE, "\r\n--%s--\r\n", boundary);
+    response_add(res, trailer, trailer_len);
+    total += trailer_len;
+    // 全体の長さがわかってから、先に場所を取っておいたヘッダを埋める
+    len = snprintf(header, CACHE_HEADER_SIZE,
+                   "Content-Length: %ld\r\nContent-Type: multipart/byteranges; boundary=%s\r\n",
+                   total, boundary);
+    if (info->encoding)
+        len += snprintf(header + len, CACHE_HEADER_SIZE - len, "Content-Encoding: %s\r\n", info->encoding);
+    len += render_validators(info, header + len, CACHE_HEADER_SIZE - len);
+    len += snprintf(header + len, CACHE_HEADER_SIZE - len, "\r\n");
+    res->iov[res->iovcnt - 2 * nranges - 2].iov_len = len;
+}
+
+/**
+ * 200で返すファイルのヘッダ(Content-Length以降、空行まで)をbufに書き込み、その長さを返す
+ * ファイルの内容だけで決まるので、キャッシュにもこのまま入れる。
+ **/
+static int render_file_header(struct FileInfo *info, char *buf, size_t size)
+{
+    int len;
+
+    len = snprintf(buf, size, "Content-Length: %ld\r\nContent-Type: %s\r\n", info->size, info->type);
+    if (info->encoding)
+        len += snprintf(buf + len, size - len, "Content-Encoding: %s\r\n", info->encoding);
+    len += render_validators(info, buf + len, size - len);
+    len += snprintf(buf + len, size - len, "\r\n");
+    return len;
+}
+
+/**
+ * 再検証とRangeに使うヘッダ(Last-Modified・ETag・Accept-Ranges)をbufに書き込み、その長さを返す
+ * 符号化を選べるファイルにはVaryも付ける。
+ **/
+static int render_validators(struct FileInfo *info, char *buf, size_t size)
+{
+    char date[TIME_BUF_SIZE];
+
+    format_http_date(info->st.st_mtime, date, sizeof date);
+    return snprintf(buf, size, "Last-Modified: %s\r\nETag: %s\r\nAccept-Ranges: bytes\r\n%s",
+                    date, file_etag(info), info->vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+/**
+ * lstat()の結果(inode・サイズ・更新時刻)からETagを作る
+ * ファイルが置き換えられたり書き換えられたりすれば変わる。
+ **/
+static char* file_etag(struct FileInfo *info)
+{
+    if (!info->etag[0]) {
+        // その場で圧縮したものは元のファイルと同じlstat()の結果になるので区別する
+        snprintf(info->etag, ETAG_SIZE, "\"%lx-%lx-%lx.%lx%s\"",
+                 (unsigned long)info->st.st_ino, (unsigned long)info->st.st_size,
+                 (unsigned long)info->st.st_mtim.tv_sec, (unsigned long)info->st.st_mtim.tv_nsec,
+                 info->compress ? "-gzip" : "");
+    }
+    return info->etag;
+}
+
+/**
+ * 時刻をHTTPの日付の形式("Sun, 06 Nov 1994 08:49:37 GMT")にする
+ * 
+ **/
+static void format_http_date(time_t t, char *buf, size_t size)
+{
+    struct tm tm;
+
+    if (!gmtime_r(&t, &tm)) log_exit("gmtime() failed: %s", strerror(errno));
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**
+ * HTTPの日付を解析する
+ * 現在使われているIMF-fixdateの形式だけを受け付け、解析できなければ0を返す。
+ **/
+static int parse_http_date(const char *str, time_t *t)
+{
+    struct tm tm;
+    char *end;
+
+    memset(&tm, 0, sizeof tm);
+    end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') return 0;
+    *t = timegm(&tm);
+    return 1;
+}
+
+/**
+ * multipart/byterangesの境界の文字列を返す
+ * ファイルの中身と偶然一致しないように、プロセスごとに乱数で作る。
+ **/
+static const char* multipart_boundary(void)
+{
+    static char boundary[32];
+    uint64_t r;
+
+    if (!boundary[0]) {
+        if (getrandom(&r, sizeof r, GRND_NONBLOCK) != sizeof r)
+            r = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+        snprintf(boundary, sizeof boundary, "%016llx", (unsigned long long)r);
+    }
+    return boundary;
+}
+
+/**
+ * Accept-Encodingに従ってファイルの符号化を選ぶ
+ * 圧縮済みのファイル(file.brなど)があればそれを使い、なければ--compressの場合にその場でgzip圧縮する。
+ * 圧縮に向かない種類のファイルは何もしない。
+ **/
+static void negotiate_encoding(struct HTTPRequest *req, struct FileInfo *info)
+{
+    char *val;
+    int mask, i;
+
+    if (!info->compressible) return;
+    info->vary = 1;
+    val = lookup_header_field_value(req, HTTP_HEADER_ACCEPT_ENCODING);
+    if (!val) return;
+    mask = accepted_encodings(val);
+    for (i = 0; i < N_CONTENT_CODINGS; i++) {
+        if ((mask & (1 << i)) && use_precompressed(info, &content_codings[i])) return;
+    }
+    // 圧縮した結果はキャッシュに置いて使い回すので、キャッシュに入る大きさのものだけを圧縮する。
+    // 圧縮後の範囲を求めるには全体を圧縮する必要があるので、Rangeの指定があれば圧縮しない
+    if (compress_responses && file_cache && (mask & (1 << CODING_GZIP))
+        && info->size >= COMPRESS_MIN_SIZE && info->size <= CACHE_MAX_ENTRY_SIZE
+        && !lookup_header_field_value(req, HTTP_HEADER_RANGE)) {
+        info->compress = 1;
+        info->encoding = content_codings[CODING_GZIP].name;
+        info->cache_key = xmalloc(strlen(info->path) + 6);
+        sprintf(info->cache_key, "%s\ngzip", info->path);
+    }
+}
+
+/**
+ * Accept-Encodingの値から受け付けられる符号化を調べ、content_codingsの位置のビットを立てて返す
+ * q=0のものは受け付けない。"*"は明示されていない全てに当てはまる。
+ **/
+static int accepted_encodings(const char *val)
+{
+    const char *p = val, *name;
+    size_t len;
+    double q;
+    int mask = 0, denied = 0, star = 0, bit, i;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0') break;
+        name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        len = p - name;
+        // パラメータはqだけを見る
+        q = 1.0;
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (*p == ' ' || *p == '\t') p++;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') q = strtod(p + 2, NULL);
+                continue;
+            }
+            p++;
+        }
+        if (len == 1 && *name == '*') {
+            star = q > 0 ? 1 : -1;
+            continue;
+        }
+        bit = 0;
+        for (i = 0; i < N_CONTENT_CODINGS; i++) {
+            if (strlen(content_codings[i].name) == len && strncasecmp(name, content_codings[i].name, len) == 0)
+                bit = 1 << i;
+        }
+        if (len == 6 && strncasecmp(name, "x-gzip", 6) == 0) bit = 1 << CODING_GZIP;
+        if (q > 0)
+            mask |= bit;
+        else
+            denied |= bit;
+    }
+    if (star > 0) mask |= ((1 << N_CONTENT_CODINGS) - 1) & ~denied;
+    return mask & ~denied;
+}
+
+/**
+ * 圧縮済みのファイル(元のパスに拡張子を付けたもの)があれば、infoをそのファイルに切り替える
+ * 元のファイルより古いものは中身が違う可能性があるので使わない。
+ **/
+static int use_precompressed(struct FileInfo *info, const struct ContentCoding *coding)
+{
+    struct StatEntry *e;
+    size_t len = strlen(info->path);
+    char *path;
+
+    path = xmalloc(len + strlen(coding->ext) + 1);
+    memcpy(path, info->path, len);
+    strcpy(path + len, coding->ext);
+    // 圧縮済みのファイルがないことも覚えておくので、符号化ごとのlstat()を毎回はしない
+    e = stat_cache_get(path);
+    if (!e->ok || e->st.st_mtime < info->st.st_mtime) {
+        stat_cache_release(e);
+        free(path);
+        return 0;
+    }
+    stat_cache_release(info->stat);
+    info->stat = e;
+    free(info->path);
+    info->path = info->cache_key = path;
+    info->st = e->st;
+    info->size = e->st.st_size;
+    info->encoding = coding->name;
+    return 1;
+}
+
+/**
+ * その場での圧縮をやめ、元のファイルをそのまま送るように戻す
+ * 
+ **/
+static void cancel_compression(struct FileInfo *info)
+{
+    if (info->cache_key != info->path) free(info->cache_key);
+    info->cache_key = info->path;
+    info->compress = 0;
+    info->encoding = NULL;
+    info->size = info->st.st_size;
+    info->etag[0] = '\0';
+}
+
+/**
+ * 圧縮して効果のある種類のファイルか
+ * 
+ **/
+static int compressible_type_p(const char *type)
+{
+    static const char *types[] = {
+        "application/javascript", "application/json", "application/xml", "image/svg+xml", NULL
+    };
+    size_t len;
+    int i;
+
+    if (strncmp(type, "text/", 5) == 0) return 1;
+    // "; charset=..."などのパラメータは比べない
+    len = strcspn(type, ";");
+    for (i = 0; types[i]; i++) {
+        if (strlen(types[i]) == len && strncmp(type, types[i], len) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * inをgzip形式で圧縮してoutに書き込み、その長さを返す
+ * outsizeに収まらなければ0を返す。
+ **/
+static size_t gzip_compress(const char *in, size_t inlen, char *out, size_t outsize)
+{
+    z_stream z;
+    size_t len;
+
+    memset(&z, 0, sizeof z);
+    // windowBitsに16を足すとzlib形式ではなくgzip形式になる
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    z.next_in = (Bytef*)in;
+    z.avail_in = inlen;
+    z.next_out = (Bytef*)out;
+    z.avail_out = outsize;
+    len = deflate(&z, Z_FINISH) == Z_STREAM_END ? z.total_out : 0;
+    deflateEnd(&z);
+    return len;
+}
+
+/**
+ * ファイルの内容をユーザー空間を経由せずにソケットへ送る
+ * sendfile(2)に対応していないファイルの場合は大きめのバッファで読み書きする。
+ * 送ったバイト数を返す。書き込めなかった場合は-1を返す(ノンブロッキングならerrnoはEAGAIN)。
+ **/
+static ssize_t send_file_body(int sock, struct FileBody *body)
+{
+    static char buf[FILE_CHUNK_SIZE];
+    ssize_t n, w;
+    size_t len;
+
+    n = sendfile(sock, body->fd, &body->offset, body->remain);
+    if (n >= 0) {
+        body->remain -= n;
+        return n;
+    }
+    if (errno != EINVAL && errno != ENOSYS)
+        return -1;
+    len = body->remain < FILE_CHUNK_SIZE ? body->remain : FILE_CHUNK_SIZE;
+    n = pread(body->fd, buf, len, body->offset);
+    if (n <= 0)
+        return n;
+    // 書ききれなかった分は次回また読み直す
+    w = write(sock, buf, n);
+    if (w < 0)
+        return -1;
+    body->offset += w;
+    body->remain -= w;
+    return w;
+}
+
+/**
+ * ワーカー間で共有するファイルキャッシュを作成する
+ * size バイトの共有メモリをエントリ表とデータ領域に分ける。
+ **/
+static void setup_file_cache(size_t size)
+{
+    pthread_mutexattr_t attr;
+    size_t nentries, table_size;
+    void *p;
+
+    // エントリ数は平均的なファイルの大きさから見積もり、2のべき乗に揃える
+    for (nentries = 64; nentries < size / CACHE_AVG_ENTRY_SIZE; nentries *= 2)
+        ;
+    table_size = sizeof(struct FileCache) + nentries * sizeof(struct CacheEntry);
+    p = mmap(NULL, table_size + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        log_exit("mmap(2) failed: %s", strerror(errno));
+    // MAP_ANONYMOUSの領域は0で埋められているので、全エントリが空になっている
+    file_cache = p;
+    file_cache->nentries = nentries;
+    file_cache->arena_size = size;
+    file_cache->arena_pos = 0;
+    file_cache->oldest = file_cache->newest = -1;
+    file_cache->arena = (char*)p + table_size;
+    // プロセス間で共有し、持ち主が書き込み中に死んでも回復できるようにする
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&file_cache->lock, &attr) != 0)
+        log_exit("pthread_mutex_init() failed");
+    pthread_mutexattr_destroy(&attr);
+    cache_buf = xmalloc(CACHE_HEADER_SIZE + CACHE_MAX_ENTRY_SIZE);
+    if (compress_responses)
+        compress_buf = xmalloc(CACHE_MAX_ENTRY_SIZE);
+}
+
+/**
+ * キャッシュからinfoのファイルを探し、ヘッダと中身が並んだ場所を返す。なければNULLを返す
+ * lstat()の結果(inode・サイズ・更新時刻)が一致しないものは古いので使わない。
+ * ワーカーは共有のarenaを直接指し、resがピンを持つ間はその範囲を上書きさせない。
+ * 接続ごとにforkする場合やピンが使用中の場合はcache_bufにコピーして返す。
+ **/
+static char* cache_lookup(struct FileInfo *info, struct Response *res, size_t *header_len, size_t *body_len)
+{
+    struct CacheEntry *e;
+    uint32_t hash;
+    unsigned seq;
+    size_t i, offset, hlen, blen;
+    char *data;
+
+    hash = hash_string(info->cache_key);
+    for (i = 0; i < CACHE_PROBES; i++) {
+        e = &file_cache->entries[(hash + i) & (file_cache->nentries - 1)];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        // 書き換え中でも終端を越えて読まないようにstrncmp()で比べる
+        if (e->hash != hash || strncmp(e->path, info->cache_key, CACHE_PATH_MAX) != 0) continue;
+        if (e->ino != info->st.st_ino || e->dev != info->st.st_dev || e->size != info->st.st_size
+            || e->mtime.tv_sec != info->st.st_mtim.tv_sec || e->mtime.tv_nsec != info->st.st_mtim.tv_nsec)
+            continue;
+        // 書き換え中に読んだ値は壊れているかもしれないので、arenaに触れる前に範囲に収まっているか確かめる
+        offset = __atomic_load_n(&e->offset, __ATOMIC_RELAXED);
+        hlen = __atomic_load_n(&e->header_len, __ATOMIC_RELAXED);
+        blen = __atomic_load_n(&e->body_len, __ATOMIC_RELAXED);
+        if (hlen > CACHE_HEADER_SIZE || blen > CACHE_MAX_ENTRY_SIZE
+            || offset > file_cache->arena_size || hlen + blen > file_cache->arena_size - offset)
+            continue;
+        data = file_cache->arena + offset;
+        // ピンは1つしかないので、別のレスポンスがまだ持っていればコピーする
+        if (cache_slot >= 0 && !__atomic_load_n(&file_cache->pins[cache_slot], __ATOMIC_RELAXED)) {
+            // ピンを見せてからseqを確かめる。書く側はseqを変えてからピンを見るので、どちらかが必ず気づく
+            __atomic_store_n(&file_cache->pins[cache_slot], ((uint64_t)offset << CACHE_PIN_SHIFT) | (hlen + blen),
+                             __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+                __atomic_store_n(&file_cache->pins[cache_slot], 0, __ATOMIC_RELEASE);
+                continue;
+            }
+            res->pinned = 1;
+        }
+        else {
+            memcpy(cache_buf, data, hlen + blen);
+            // コピー中に書き換えられていたら使わない
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) continue;
+            data = cache_buf;
+        }
+        *header_len = hlen;
+        *body_len = blen;
+        return data;
+    }
+    return NULL;
+}
+
+/**
+ * cache_lookup()で得たピンを外す
+ * 送り終えたか、送り残しをコピーし終えてから呼ぶ。
+ **/
+static void cache_unpin(struct Response *res)
+{
+    if (!res->pinned) return;
+    __atomic_store_n(&file_cache->pins[cache_slot], 0, __ATOMIC_RELEASE);
+    res->pinned = 0;
+}
+
+/**
+ * 開いたファイルfdを読み込んでキャッシュに登録する
+ * 読み込んだ内容はcache_bufにも残るので、呼び出し元はそのまま応答に使える。
+ * キャッシュに入れなかった場合は0を返す。
+ **/
+static int cache_fill(struct FileInfo *info, int fd, size_t *header_len, size_t *body_len)
+{
+    struct CacheEntry *e, *victim = NULL;
+    struct stat st;
+    uint32_t hash;
+    uint64_t pin;
+    size_t i, hlen, len, pos, need;
+    ssize_t n;
+
+    if (info->size > CACHE_MAX_ENTRY_SIZE || info->size > file_cache->arena_size / 4) return 0;
+    if (strlen(info->cache_key) >= CACHE_PATH_MAX) return 0;
+    // lstat()した後で入れ替わったファイルを古い情報で登録しないようにする
+    if (fstat(fd, &st) < 0 || st.st_ino != info->st.st_ino || st.st_size != info->st.st_size
+        || st.st_mtim.tv_sec != info->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != info->st.st_mtim.tv_nsec)
+        return 0;
+    if (info->compress) {
+        // 圧縮後の長さがわかるまでヘッダを作れないので、圧縮結果をヘッダの後ろへ詰め直す
+        for (len = 0; len < (size_t)info->size; len += n) {
+            n = pread(fd, compress_buf + len, info->size - len, len);
+            if (n <= 0) return 0;
+        }
+        len = gzip_compress(compress_buf, info->size, cache_buf + CACHE_HEADER_SIZE, info->size);
+        if (len == 0) return 0;
+        info->size = len;
+        hlen = render_file_header(info, cache_buf, CACHE_HEADER_SIZE);
+        memmove(cache_buf + hlen, cache_buf + CACHE_HEADER_SIZE, len);
+    }
+    else {
+        hlen = render_file_header(info, cache_buf, CACHE_HEADER_SIZE);
+        for (len = 0; len < (size_t)info->size; len += n) {
+            n = pread(fd, cache_buf + hlen + len, info->size - len, len);
+            if (n <= 0) return 0;
+        }
+    }
+
+    hash = hash_string(info->cache_key);
+    need = hlen + len;
+    cache_lock();
+    // 同じパスの古いエントリがあればそれを、なければ空きを、どちらもなければ先頭を上書きする
+    for (i = 0; i < CACHE_PROBES; i++) {
+        e = &file_cache->entries[(hash + i) & (file_cache->nentries - 1)];
+        if (e->hash == hash && strcmp(e->path, info->cache_key) == 0) {
+            victim = e;
+            break;
+        }
+        if (!victim && e->hash == 0) victim = e;
+    }
+    if (!victim) victim = &file_cache->entries[hash & (file_cache->nentries - 1)];
+    // 上書きするエントリの古いデータはどこからも指されなくなり、arenaを一周したときに上書きされる
+    if (victim->hash != 0) cache_evict(victim);
+
+    // データ領域はリングとして使い、足りなければ先頭に戻る。
+    // arenaには書いた順にデータが並ぶので、上書きする範囲にデータを持つのはリストの古い方のものだけ
+    pos = file_cache->arena_pos;
+    if (pos + need > file_cache->arena_size) {
+        // 末尾の使わない部分にあるものは、先頭にあるものより古い
+        while (file_cache->oldest >= 0 && file_cache->entries[file_cache->oldest].offset >= pos)
+            cache_evict(&file_cache->entries[file_cache->oldest]);
+        pos = 0;
+    }
+    while (file_cache->oldest >= 0) {
+        e = &file_cache->entries[file_cache->oldest];
+        if (e->offset < pos || e->offset >= pos + need) break;
+        cache_evict(e);
+    }
+    // 送信中のワーカーが指している範囲は上書きせず、今回は登録を諦める
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < MAX_WORKERS; i++) {
+        pin = __atomic_load_n(&file_cache->pins[i], __ATOMIC_RELAXED);
+        if (pin && (pin >> CACHE_PIN_SHIFT) < pos + need
+            && pos < (pin >> CACHE_PIN_SHIFT) + (pin & ((1 << CACHE_PIN_SHIFT) - 1))) {
+            pthread_mutex_unlock(&file_cache->lock);
+            return 0;
+        }
+    }
+
+    e = victim;
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(file_cache->arena + pos, cache_buf, need);
+    e->hash = hash;
+    strcpy(e->path, info->cache_key);
+    e->dev = info->st.st_dev;
+    e->ino = info->st.st_ino;
+    e->size = info->st.st_size;
+    e->mtime = info->st.st_mtim;
+    e->offset = pos;
+    e->header_len = hlen;
+    e->body_len = len;
+    // 最も新しいものとしてリストの末尾に繋ぐ
+    e->older = file_cache->newest;
+    e->newer = -1;
+    if (file_cache->newest >= 0) file_cache->entries[file_cache->newest].newer = e - file_cache->entries;
+    else file_cache->oldest = e - file_cache->entries;
+    file_cache->newest = e - file_cache->entries;
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    file_cache->arena_pos = pos + need;
+    pthread_mutex_unlock(&file_cache->lock);
+
+    *header_len = hlen;
+    *body_len = len;
+    return 1;
+}
+
+/**
+ * エントリを無効にし、書いた順のリストから外す
+ * 読んでいる途中のワーカーはseqが変わったことで気づく。ロックを持って呼ぶこと。
+ **/
+static void cache_evict(struct CacheEntry *e)
+{
+    struct CacheEntry *entries = file_cache->entries;
+
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->hash = 0;
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    if (e->older >= 0) entries[e->older].newer = e->newer;
+    else file_cache->oldest = e->newer;
+    if (e->newer >= 0) entries[e->newer].older = e->older;
+    else file_cache->newest = e->older;
+}
+
+/**
+ * キャッシュの書き込みロックを取る
+ * 前の持ち主が書き込み中に死んでいた場合はリストが繋ぎかけかもしれないので、全てのエントリを捨ててやり直す。
+ * 送信中のワーカーが指しているデータはピンで守られているので、エントリを捨てても影響しない。
+ **/
+static void cache_lock(void)
+{
+    struct CacheEntry *e;
+    size_t i;
+    int err;
+
+    err = pthread_mutex_lock(&file_cache->lock);
+    if (err == EOWNERDEAD) {
+        for (i = 0; i < file_cache->nentries; i++) {
+            e = &file_cache->entries[i];
+            __atomic_store_n(&e->seq, e->seq | 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            e->hash = 0;
+            __atomic_store_n(&e->seq, (e->seq | 1) + 1, __ATOMIC_RELEASE);
+        }
+        file_cache->oldest = file_cache->newest = -1;
+        file_cache->arena_pos = 0;
+        pthread_mutex_consistent(&file_cache->lock);
+    }
+    else if (err != 0)
+        log_exit("pthread_mutex_lock() failed: %s", strerror(err));
+}
+
+/**
+ * infoのファイルをmmap()したものを参照を1つ増やして返す。使えなければNULLを返す
+ * 同じファイルのマッピングは使い回し、変更されていれば作り直す。
+ * lstat()の結果は覚えておいたものかもしれないので、開いているfdをfstat()して今の長さと更新時刻を確かめる。
+ * 変わっていればNULLを返し、ファイルの末尾より先のページを指さないようにする。
+ * 送信中に切り詰められた場合は、ページを読むのはカーネルなのでsendmsg()がEFAULTで失敗して接続を閉じるだけで済む。
+ * ユーザー空間からは読まないこと(response_save()もコピーしない)。読めばSIGBUSになる。
+ **/
+static struct Mapping* mapping_get(struct FileInfo *info)
+{
+    struct Mapping *m;
+    struct stat st;
+    uint32_t hash;
+    void *addr;
+    int fd;
+
+    if (info->size == 0 || info->size > MMAP_MAX_FILE_SIZE) return NULL;
+    // stat_cache_open()はlstat()した後で入れ替わったファイルを開かないので、fdはinfoと同じファイルを指す
+    fd = stat_cache_open(info->stat);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size != info->st.st_size
+        || st.st_mtim.tv_sec != info->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != info->st.st_mtim.tv_nsec)
+        return NULL;
+    hash = hash_string(info->path);
+    for (m = mapping_table[hash & (MMAP_TABLE_SIZE - 1)]; m; m = m->hnext) {
+        if (m->hash == hash && strcmp(m->path, info->path) == 0) break;
+    }
+    if (m) {
+        if (m->dev == info->st.st_dev && m->ino == info->st.st_ino && m->size == info->st.st_size
+            && m->mtime.tv_sec == info->st.st_mtim.tv_sec && m->mtime.tv_nsec == info->st.st_mtim.tv_nsec) {
+            // LRUの先頭に移す
+            if (m != mapping_lru_head) {
+                m->prev->next = m->next;
+                if (m->next) m->next->prev = m->prev;
+                else mapping_lru_tail = m->prev;
+                m->prev = NULL;
+                m->next = mapping_lru_head;
+                mapping_lru_head->prev = m;
+                mapping_lru_head = m;
+            }
+            m->refs++;
+            return m;
+        }
+        mapping_unlink(m);
+    }
+    // いっぱいなら送信中でないもののうち最も古いものを外す
+    if (n_mappings >= MMAP_MAX_ENTRIES) {
+        for (m = mapping_lru_tail; m && m->refs > 0; m = m->prev)
+            ;
+        if (!m) return NULL;
+        mapping_unlink(m);
+    }
+
+    addr = mmap(NULL, info->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) return NULL;
+    // 先頭から順に全体を送るので、先読みさせておく
+    madvise(addr, info->size, MADV_SEQUENTIAL);
+    madvise(addr, info->size, MADV_WILLNEED);
+
+    m = xmalloc(sizeof(struct Mapping));
+    m->path = xmalloc(strlen(info->path) + 1);
+    strcpy(m->path, info->path);
+    m->hash = hash;
+    m->dev = info->st.st_dev;
+    m->ino = info->st.st_ino;
+    m->size = info->st.st_size;
+    m->mtime = info->st.st_mtim;
+    m->addr = addr;
+    m->refs = 1;
+    m->stale = 0;
+    m->hnext = mapping_table[hash & (MMAP_TABLE_SIZE - 1)];
+    mapping_table[hash & (MMAP_TABLE_SIZE - 1)] = m;
+    m->prev = NULL;
+    m->next = mapping_lru_head;
+    if (mapping_lru_head) mapping_lru_head->prev = m;
+    else mapping_lru_tail = m;
+    mapping_lru_head = m;
+    n_mappings++;
+    return m;
+}
+
+/**
+ * mapping_get()で得た参照を返す
+ * 
+ **/
+static void mapping_release(struct Mapping *m)
+{
+    if (--m->refs > 0 || !m->stale) return;
+    munmap(m->addr, m->size);
+    free(m->path);
+    free(m);
+}
+
+/**
+ * マッピングをハッシュ表とLRUから外す
+ * 送信中のレスポンスが参照していれば、最後のmapping_release()でmunmap()する。
+ **/
+static void mapping_unlink(struct Mapping *m)
+{
+    struct Mapping **p;
+
+    for (p = &mapping_table[m->hash & (MMAP_TABLE_SIZE - 1)]; *p != m; p = &(*p)->hnext)
+        ;
+    *p = m->hnext;
+    if (m->prev) m->prev->next = m->next;
+    else mapping_lru_head = m->next;
+    if (m->next) m->next->prev = m->prev;
+    else mapping_lru_tail = m->prev;
+    n_mappings--;
+    m->stale = 1;
+    m->refs++;
+    mapping_release(m);
+}
+
+/**
+ * pathのlstat()の結果を参照を1つ増やして返す
+ * TTLの間は存在しないという結果も含めて前回のものを返す。過ぎていれば問い合わせ直し、
+ * 同じファイルのままなら開いたfdも引き続き使う。
+ * TTLの間でもその場で書き換えられることはあるので、開いたfdがあればfstat()して
+ * 長さと更新時刻が変わっていないことを確かめる。ヘッダはこのstから作るので、送る中身と食い違わない。
+ **/
+static struct StatEntry* stat_cache_get(const char *path)
+{
+    struct StatEntry *e = NULL;
+    struct stat st;
+    uint32_t hash;
+
+    hash = hash_string(path);
+    if (stat_cache_ttl > 0) {
+        e = stat_cache_find(path, hash);
+        if (e && timer_clock() < e->expires && (e->fd < 0 || (fstat(e->fd, &st) == 0 && same_file_p(&e->st, &st))))
+            return stat_cache_store(e, path, hash, NULL, 0);
+    }
+    return stat_cache_store(e, path, hash, &st, lstat(path, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+/**
+ * pathのエントリを表から探す。なければNULLを返す
+ * 
+ **/
+static struct StatEntry* stat_cache_find(const char *path, uint32_t hash)
+{
+    struct StatEntry *e;
+
+    for (e = stat_table[hash & (STAT_TABLE_SIZE - 1)]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) break;
+    }
+    return e;
+}
+
+/**
+ * TTLの間にpathをlstat()せずに済むか
+ * io_uringのエンジンが、問い合わせをリングに積むかどうかを決めるのに使う。
+ **/
+static int stat_cache_fresh_p(const char *path)
+{
+    struct StatEntry *e = stat_cache_find(path, hash_string(path));
+
+    return e && timer_clock() < e->expires;
+}
+
+/**
+ * 問い合わせた結果をeに入れるか新しいエントリを作り、参照を1つ増やして返す
+ * stがNULLならeをそのまま使う。eは表から探したpathのエントリか、なければNULL。
+ **/
+static struct StatEntry* stat_cache_store(struct StatEntry *e, const char *path, uint32_t hash,
+                                          const struct stat *st, int ok)
+{
+    uint64_t now = timer_clock();
+
+    if (!st) goto found;
+    if (e) {
+        if (!ok && !e->ok) {
+            e->expires = now + stat_cache_ttl;
+            goto found;
+        }
+        if (ok && e->ok && same_file_p(&e->st, st)) {
+            e->st = *st;
+            e->expires = now + stat_cache_ttl;
+            goto found;
+        }
+        stat_cache_unlink(e);
+    }
+
+    e = xmalloc(sizeof(struct StatEntry));
+    e->path = xmalloc(strlen(path) + 1);
+    strcpy(e->path, path);
+    e->hash = hash;
+    e->expires = now + stat_cache_ttl;
+    e->ok = ok;
+    if (ok) e->st = *st;
+    e->fd = -1;
+    e->refs = 1;
+    e->idle = 0;
+    // 使い回さない場合は表に入れず、参照がなくなれば解放する
+    e->stale = (stat_cache_ttl == 0);
+    if (e->stale) return e;
+    // いっぱいなら最も古いものを外す。送信中のものはfdを閉じずに残る
+    if (n_stat_entries >= STAT_CACHE_ENTRIES) stat_cache_unlink(stat_lru_tail);
+    e->hnext = stat_table[hash & (STAT_TABLE_SIZE - 1)];
+    stat_table[hash & (STAT_TABLE_SIZE - 1)] = e;
+    e->prev = NULL;
+    e->next = stat_lru_head;
+    if (stat_lru_head) stat_lru_head->prev = e;
+    else stat_lru_tail = e;
+    stat_lru_head = e;
+    n_stat_entries++;
+    return e;
+
+found:
+    // LRUの先頭に移す
+    if (e != stat_lru_head) {
+        e->prev->next = e->next;
+        if (e->next) e->next->prev = e->prev;
+        else stat_lru_tail = e->prev;
+        e->prev = NULL;
+        e->next = stat_lru_head;
+        stat_lru_head->prev = e;
+        stat_lru_head = e;
+    }
+    if (e->idle) stat_fd_remove(e);
+    e->refs++;
+    return e;
+}
+
+/**
+ * eのファイルを読み込み用に開いたfdを返す。開けなければ-1を返す
+ * fdはeが持ち、複数のレスポンスで共有する。pread()やsendfile()は位置を動かさないので互いに邪魔しない。
+ * lstat()の後で入れ替わっていればerrnoをESTALEにして返すので、問い合わせ直せばよい。
+ **/
+static int stat_cache_open(struct StatEntry *e)
+{
+    int fd;
+
+    if (e->fd >= 0) return e->fd;
+    fd = open(e->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (stat_cache_adopt(e, fd) < 0) {
+        e->expires = 0;
+        errno = ESTALE;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * 開いたfdがeと同じファイルならeに持たせる。違えばfdを閉じて-1を返す
+ * 
+ **/
+static int stat_cache_adopt(struct StatEntry *e, int fd)
+{
+    struct StatEntry *victim;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || !same_file_p(&e->st, &st)) {
+        close(fd);
+        return -1;
+    }
+    // 開いたままのfdが多ければ、使われていないもののうち最も古いものを閉じる
+    if (n_stat_fds >= STAT_CACHE_FDS && (victim = stat_fd_tail)) {
+        stat_fd_remove(victim);
+        close(victim->fd);
+        victim->fd = -1;
+        n_stat_fds--;
+    }
+    e->fd = fd;
+    n_stat_fds++;
+    return 0;
+}
+
+/**
+ * io_uringで問い合わせたpathの結果を覚える
+ * stがNULLなら存在しないか送れないものとして覚える。fdはpathを開いたもので、使わなければ閉じる。
+ * 待っている間に他のリクエストが問い合わせ直していれば、そちらを使う。
+ **/
+static void stat_cache_fill(const char *path, const struct stat *st, int fd)
+{
+    static const struct stat missing;
+    struct StatEntry *e;
+    uint32_t hash = hash_string(path);
+
+    e = stat_cache_find(path, hash);
+    if (e && timer_clock() < e->expires) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    e = stat_cache_store(e, path, hash, st ? st : &missing, st && S_ISREG(st->st_mode));
+    if (fd >= 0) {
+        if (e->ok && e->fd < 0)
+            stat_cache_adopt(e, fd);
+        else
+            close(fd);
+    }
+    stat_cache_release(e);
+}
+
+/**
+ * stat_cache_get()で得た参照を返す
+ * 
+ **/
+static void stat_cache_release(struct StatEntry *e)
+{
+    if (--e->refs > 0) return;
+    if (!e->stale) {
+        // 誰も使わなくなったfdは閉じる候補になる
+        if (e->fd >= 0) stat_fd_push(e);
+        return;
+    }
+    if (e->fd >= 0) {
+        close(e->fd);
+        n_stat_fds--;
+    }
+    free(e->path);
+    free(e);
+}
+
+/**
+ * エントリをハッシュ表とLRUから外す
+ * 使っているリクエストやレスポンスがあれば、最後のstat_cache_release()でfdを閉じる。
+ **/
+static void stat_cache_unlink(struct StatEntry *e)
+{
+    struct StatEntry **p;
+
+    for (p = &stat_table[e->hash & (STAT_TABLE_SIZE - 1)]; *p != e; p = &(*p)->hnext)
+        ;
+    *p = e->hnext;
+    if (e->prev) e->prev->next = e->next;
+    else stat_lru_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else stat_lru_tail = e->prev;
+    n_stat_entries--;
+    if (e->idle) stat_fd_remove(e);
+    e->stale = 1;
+    e->refs++;
+    stat_cache_release(e);
+}
+
+/**
+ * pathについて覚えているlstat()の結果と開いたfd、マッピングを捨てる
+ * アップロードで書き換えたファイルを、TTLを待たずに同じワーカーから読めるようにする。
+ **/
+static void stat_cache_forget(const char *path)
+{
+    struct StatEntry *e;
+    struct Mapping *m;
+    uint32_t hash = hash_string(path);
+
+    for (e = stat_table[hash & (STAT_TABLE_SIZE - 1)]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            stat_cache_unlink(e);
+            break;
+        }
+    }
+    for (m = mapping_table[hash & (MMAP_TABLE_SIZE - 1)]; m; m = m->hnext) {
+        if (m->hash == hash && strcmp(m->path, path) == 0) {
+            mapping_unlink(m);
+            break;
+        }
+    }
+}
+
+/**
+ * 使われなくなったfdを持つエントリを、fdのLRUの先頭に入れる
+ * 
+ **/
+static void stat_fd_push(struct StatEntry *e)
+{
+    e->idle = 1;
+    e->fd_prev = NULL;
+    e->fd_next = stat_fd_head;
+    if (stat_fd_head) stat_fd_head->fd_prev = e;
+    else stat_fd_tail = e;
+    stat_fd_head = e;
+}
+
+/**
+ * エントリをfdのLRUから外す
+ * 
+ **/
+static void stat_fd_remove(struct StatEntry *e)
+{
+    if (e->fd_prev) e->fd_prev->fd_next = e->fd_next;
+    else stat_fd_head = e->fd_next;
+    if (e->fd_next) e->fd_next->fd_prev = e->fd_prev;
+    else stat_fd_tail = e->fd_prev;
+    e->idle = 0;
+}
+
+/**
+ * 2つのstatが同じ内容の同じファイルを指しているか
+ * 書き換えられていれば長さか更新時刻が変わる。
+ **/
+static int same_file_p(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/**
+ * 文字列のハッシュ値(FNV-1a)を計算する
+ * 0は空きエントリの印に使うので返さない。
+ **/
+static uint32_t hash_string(const char *str)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *str; str++) {
+        h ^= (unsigned char)*str;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+/**
+ * "64M"のような単位(K, M, G)付きの大きさをバイト数に変換する
+ * 
+ **/
+static size_t parse_size(const char *str)
+{
+    char *end;
+    unsigned long long n;
+
+    n = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': n *= 1024; end++; break;
+    case 'm': case 'M': n *= 1024 * 1024; end++; break;
+    case 'g': case 'G': n *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (end == str || *end != '\0') {
+        fprintf(stderr, "invalid size: %s\n", str);
+        exit(1);
+    }
+    return (size_t)n;
+}
+
+/**
+ * --upload-path以下へのPUTかPOSTか
+ * 
+ **/
+static int upload_request_p(struct HTTPRequest *req)
+{
+    return (strcmp(req->method, "PUT") == 0 || strcmp(req->method, "POST") == 0)
+        && strncmp(req->path, upload_path, strlen(upload_path)) == 0;
+}
+
+/**
+ * アップロードされるボディの書き込み先を用意する
+ * docroot以下の同じパスに保存する。ディレクトリは作らない。
+ * Content-Lengthで長さが決まっていれば、受信バッファに届いた分を書いた後はsplice(2)で受け取る。
+ **/
+static int start_upload(struct Connection *conn, char *docroot)
+{
+    struct HTTPRequest *req = conn->req;
+    struct Upload *up;
+    struct stat st;
+    size_t len, plen = strlen(req->path);
+
+    // docrootの外に出るパスや、ディレクトリを指すパスには書き込まない
+    if (plen == 0 || req->path[plen - 1] == '/' || strstr(req->path, "/../")
+        || (plen >= 3 && strcmp(req->path + plen - 3, "/..") == 0)) {
+        conn->error = ERROR_400;
+        return -1;
+    }
+    up = arena_alloc(&conn->arena, sizeof(struct Upload));
+    len = strlen(docroot) + 1 + plen + 1;
+    up->path = arena_alloc(&conn->arena, len);
+    snprintf(up->path, len, "%s/%s", docroot, req->path);
+    up->tmp_path = arena_alloc(&conn->arena, len + 32);
+    snprintf(up->tmp_path, len + 32, "%s.upload-%d-%lu", up->path, (int)getpid(), n_uploads++);
+    stat_cache_forget(up->path);
+    up->created = (lstat(up->path, &st) < 0);
+    if (!up->created && !S_ISREG(st.st_mode)) {
+        conn->error = ERROR_400;
+        return -1;
+    }
+    up->failed = 0;
+    up->fd = open(up->tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (up->fd < 0) {
+        conn->error = (errno == ENOENT || errno == ENOTDIR) ? ERROR_404 : ERROR_500;
+        return -1;
+    }
+    req->upload = up;
+    conn->body_handler = upload_body;
+    // パイプが作れなければ受信バッファを経由して書き込む
+    if (conn->body.state == BODY_IDENTITY && pipe2(conn->pipe, O_CLOEXEC) < 0)
+        conn->pipe[0] = conn->pipe[1] = -1;
+    return 0;
+}
+
+/**
+ * 受信したボディをアップロード先に書き込む
+ * 
+ **/
+static int upload_body(struct Connection *conn, const char *buf, size_t len)
+{
+    struct Upload *up = conn->req->upload;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(up->fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            log_warn("failed to write %s: %s", up->tmp_path, n < 0 ? strerror(errno) : "no space");
+            conn->error = ERROR_500;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * 受け取り終えたファイルを置き換えてレスポンスを組み立てる
+ * 新しく作った場合は201を、既存のファイルを置き換えた場合は204を返す。
+ **/
+static void finish_upload(struct HTTPRequest *req, struct Response *res)
+{
+    static const char created[] = "Content-Length: 0\r\n\r\n";
+    struct Upload *up = req->upload;
+    int ret;
+
+    ret = close(up->fd);
+    up->fd = -1;
+    if (ret < 0 || rename(up->tmp_path, up->path) < 0) {
+        log_warn("failed to save %s: %s", up->path, strerror(errno));
+        unlink(up->tmp_path);
+        output_error_response(req, res, ERROR_500);
+        return;
+    }
+    // 受け取っている間に読まれて覚えたものも捨てる
+    stat_cache_forget(up->path);
+    if (up->created) {
+        output_common_header_fields(req, res, STATUS_LINE("201 Created"));
+        response_add(res, created, sizeof created - 1);
+    }
+    else {
+        // 204はContent-Lengthを付けられない
+        output_common_header_fields(req, res, STATUS_LINE("204 No Content"));
+        response_add(res, "\r\n", 2);
+    }
+}
+
+/**
+ * バックエンドが受け付けるソケットを作る
+ * ファイルシステムに残らないよう抽象名前空間のアドレスを使い、名前にはプロセスIDを入れて重ならないようにする。
+ **/
+static void setup_backends(void)
+{
+    int i, n;
+
+    for (i = 0; i < BACKEND_CONNS; i++) {
+        backends[i].fd = -1;
+    }
+    memset(&backend_addr, 0, sizeof backend_addr);
+    backend_addr.sun_family = AF_UNIX;
+    // sun_path[0]を'\0'のままにすると抽象名前空間になる
+    n = snprintf(backend_addr.sun_path + 1, sizeof backend_addr.sun_path - 1, "httpd2-backend-%d", (int)getpid());
+    backend_addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+    backend_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (backend_listen_fd < 0) log_exit("socket(2) failed: %s", strerror(errno));
+    if (bind(backend_listen_fd, (struct sockaddr*)&backend_addr, backend_addrlen) < 0)
+        log_exit("bind(2) failed: %s", strerror(errno));
+    if (listen(backend_listen_fd, SOMAXCONN) < 0)
+        log_exit("listen(2) failed: %s", strerror(errno));
+}
+
+/**
+ * バックエンドを起動して見守るプロセスを作成する
+ * 
+ **/
+static pid_t start_backends(void)
+{
+    pid_t parent = getpid();
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (pid == 0) {
+        backend_manager_main(parent);
+        exit(0);
+    }
+    return pid;
+}
+
+/**
+ * バックエンドを見守るプロセスの本体
+ * --backend-procsの数だけバックエンドを起動し、終了したものは作り直す。
+ * 親が終了したらバックエンドも終了させてから終わる。
+ **/
+static void backend_manager_main(pid_t parent)
+{
+    pid_t pids[MAX_BACKEND_PROCS];
+    time_t spawned_at[MAX_BACKEND_PROCS];
+    time_t respawn_at[MAX_BACKEND_PROCS]; // 作り直す時刻。pidsが0のスロットだけが使う
+    struct sigaction act;
+    int i;
+
+    // 親が先に終了してもSIGTERMで知らせてもらう
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
+        log_exit("prctl(2) failed: %s", strerror(errno));
+    // prctl()より前に親が終了していた場合
+    if (getppid() != parent) return;
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    watch_children();
+    // waitpid()を中断させたいのでSA_RESTARTは付けない
+    act.sa_handler = pool_terminate;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGTERM, &act, NULL) < 0)
+        log_exit("sigaction() failed: %s", strerror(errno));
+    act.sa_handler = noop_handler;
+    if (sigaction(SIGALRM, &act, NULL) < 0)
+        log_exit("sigaction() failed: %s", strerror(errno));
+
+    for (i = 0; i < backend_procs; i++) {
+        pids[i] = 0;
+        respawn_at[i] = 0;
+    }
+    while (!pool_terminating) {
+        time_t now = time(NULL), wake = 0;
+        int status;
+        pid_t pid;
+
+        for (i = 0; i < backend_procs; i++) {
+            if (pids[i] > 0) continue;
+            if (respawn_at[i] <= now) {
+                pids[i] = spawn_backend();
+                spawned_at[i] = now;
+            }
+            else if (!wake || respawn_at[i] < wake)
+                wake = respawn_at[i];
+        }
+        alarm(wake ? wake - now : 0);
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ECHILD && wake) {
+                sleep(wake - now);
+                continue;
+            }
+            log_exit("waitpid(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < backend_procs; i++) {
+            if (pids[i] != pid) continue;
+            if (WIFSIGNALED(status))
+                log_warn("backend %d killed by signal %d", (int)pid, WTERMSIG(status));
+            else
+                log_warn("backend %d exited with status %d", (int)pid, WEXITSTATUS(status));
+            // 起動直後に死ぬバックエンドはワーカーと同じくスロットごとに1秒置いて作り直す
+            pids[i] = 0;
+            respawn_at[i] = (time(NULL) - spawned_at[i] < 1) ? spawned_at[i] + 1 : 0;
+            break;
+        }
+    }
+    alarm(0);
+    for (i = 0; i < backend_procs; i++) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+}
+
+/**
+ * バックエンドを1つ起動する
+ * FastCGIと同じく、受け付け用のソケットを標準入力として渡す。
+ **/
+static pid_t spawn_backend(void)
+{
+    pid_t pid;
+    char *cmd;
+
+    pid = fork();
+    if (pid < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (pid == 0) {
+        // 見守るプロセスが終了したら後を追う。exec()しても引き継がれる
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        if (dup2(backend_listen_fd, 0) < 0) log_exit("dup2(2) failed: %s", strerror(errno));
+        // シェルを残さずにコマンドへ置き換わってもらい、シグナルが直接届くようにする
+        cmd = xmalloc(strlen(backend_command) + 6);
+        sprintf(cmd, "exec %s", backend_command);
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        log_exit("failed to run %s: %s", backend_command, strerror(errno));
+    }
+    return pid;
+}
+
+/**
+ * --backend-path以下へのリクエストか
+ * 
+ **/
+static int backend_request_p(struct HTTPRequest *req)
+{
+    return strncmp(req->path, backend_path, strlen(backend_path)) == 0;
+}
+
+/**
+ * リクエストをバックエンドに渡し始める
+ * 応答待ちの少ない接続を選んでREQUESTフレームを積む。ボディは届いた分からBODYフレームにして渡す。
+ * どの接続も埋まっていれば、待たせずに503を返して負荷を押し戻す。
+ **/
+static int start_backend_call(struct Connection *conn)
+{
+    struct HTTPRequest *req = conn->req;
+    struct BackendCall *call;
+    struct Backend *b = NULL, *c;
+    char *payload, *p;
+    size_t len;
+    int i, slot;
+
+    // ":method"と":path"に続けて、転送に関わるもの以外のヘッダを"名前\0値\0"で並べる
+    len = sizeof ":method" + strlen(req->method) + 1 + sizeof ":path" + strlen(req->path) + 1;
+    for (i = 0; i < HTTP_HEADER_COUNT; i++) {
+        if (req->known_header[i] && i != HTTP_HEADER_EXPECT && !hop_by_hop_p(http_header_name(i)))
+            len += strlen(http_header_name(i)) + strlen(req->known_header[i]) + 2;
+    }
+    for (i = 0; i < req->n_other_header; i++) {
+        if (!hop_by_hop_p(req->other_header[i].name))
+            len += strlen(req->other_header[i].name) + strlen(req->other_header[i].value) + 2;
+    }
+    if (len > BACKEND_FRAME_MAX) {
+        conn->error = ERROR_400;
+        return -1;
+    }
+    for (i = 0; i < BACKEND_CONNS; i++) {
+        c = &backends[i];
+        if (c->ncalls >= BACKEND_MAX_CALLS || c->outlen - c->outpos > BACKEND_OUTBUF_MAX) continue;
+        // 同じ数なら繋いである方を使う
+        if (!b || c->ncalls < b->ncalls || (c->ncalls == b->ncalls && c->fd >= 0 && b->fd < 0)) b = c;
+    }
+    if (!b || (b->fd < 0 && backend_connect(b) < 0)) {
+        conn->error = ERROR_503;
+        return -1;
+    }
+    for (slot = 0; b->calls[slot]; slot++)
+        ;
+    call = arena_alloc(&conn->arena, sizeof(struct BackendCall));
+    memset(call, 0, sizeof(struct BackendCall));
+    call->backend = b;
+    call->conn = conn;
+    call->id = b->generation++ * BACKEND_MAX_CALLS + slot;
+    b->calls[slot] = call;
+    b->ncalls++;
+    req->backend = call;
+    conn->body_handler = backend_body;
+
+    p = payload = arena_alloc(&conn->arena, len);
+    p = backend_put_field(p, ":method", req->method);
+    p = backend_put_field(p, ":path", req->path);
+    for (i = 0; i < HTTP_HEADER_COUNT; i++) {
+        if (req->known_header[i] && i != HTTP_HEADER_EXPECT && !hop_by_hop_p(http_header_name(i)))
+            p = backend_put_field(p, http_header_name(i), req->known_header[i]);
+    }
+    for (i = 0; i < req->n_other_header; i++) {
+        if (!hop_by_hop_p(req->other_header[i].name))
+            p = backend_put_field(p, req->other_header[i].name, req->other_header[i].value);
+    }
+    backend_queue(b, BACKEND_REQUEST, call->id, payload, len);
+    return 0;
+}
+
+/**
+ * "名前\0値\0"をpに書き込み、続きの位置を返す
+ * 
+ **/
+static char* backend_put_field(char *p, const char *name, const char *value)
+{
+    size_t n = strlen(name) + 1, v = strlen(value) + 1;
+
+    memcpy(p, name, n);
+    memcpy(p + n, value, v);
+    return p + n + v;
+}
+
+/**
+ * 接続ごとのヘッダか
+ * バックエンドとの間では使わないので、どちらの向きにも中継しない。
+ **/
+static int hop_by_hop_p(const char *name)
+{
+    static const char *names[] = {
+        "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade", NULL
+    };
+    int i;
+
+    for (i = 0; names[i]; i++) {
+        if (strcasecmp(name, names[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * 受信したボディをBODYフレームにしてバックエンドに渡す
+ * 長さは制限しない。送りきれない分がBACKEND_OUTBUF_MAXを超えたら、イベントループが受信を止める。
+ **/
+static int backend_body(struct Connection *conn, const char *buf, size_t len)
+{
+    struct BackendCall *call = conn->req->backend;
+    size_t n;
+
+    // 先に応答が揃ったか失敗した場合は、残りを読み捨てる
+    if (!call->backend) return 0;
+    for (; len > 0; buf += n, len -= n) {
+        n = len < BACKEND_FRAME_MAX ? len : BACKEND_FRAME_MAX;
+        backend_queue(call->backend, BACKEND_BODY, call->id, buf, n);
+    }
+    // 溜め込まないよう、大きくなったらイベントループを待たずに送る
+    if (call->backend->outlen - call->backend->outpos >= BACKEND_FRAME_MAX) backend_flush(call->backend);
+    return 0;
+}
+
+/**
+ * バックエンドの応答からレスポンスを組み立てる
+ * ボディはContent-Lengthを付けてそのまま送る。コピーせずにレスポンスに持たせる。
+ **/
+static void finish_backend_call(struct HTTPRequest *req, struct Response *res)
+{
+    struct BackendCall *call = req->backend;
+    char *buf;
+
+    if (call->failed) {
+        output_error_response(req, res, call->error);
+        return;
+    }
+    output_common_header_fields(req, res, call->status_line);
+    response_add(res, call->header, call->header_len);
+    // 204と304はボディを持たない
+    if (res->status == 204 || res->status == 304) {
+        response_add(res, "\r\n", 2);
+        return;
+    }
+    buf = arena_alloc(res->arena, 64);
+    response_add(res, buf, snprintf(buf, 64, "Content-Length: %zu\r\n\r\n", call->body_len));
+    if (strcmp(req->method, "HEAD") == 0 || call->body_len == 0) return;
+    res->buf = call->body;
+    res->buf_len = call->body_len;
+    call->body = NULL;
+    response_add(res, res->buf, res->buf_len);
+}
+
+/**
+ * バックエンドに渡したリクエストを終える
+ * 応答を待たずに終える場合は、バックエンドにも取り消しを伝える。
+ **/
+static void end_backend_call(struct Connection *conn)
+{
+    struct BackendCall *call = conn->req ? conn->req->backend : NULL;
+    struct Connection **p;
+
+    if (call) {
+        if (call->backend) backend_abort(call, ERROR_502);
+        free(call->body);
+        call->body = NULL;
+    }
+    // backend_abort()で並ぶこともあるので、その後で外す
+    if (conn->queued) {
+        for (p = &backend_ready; *p != conn; p = &(*p)->ready_next)
+            ;
+        *p = conn->ready_next;
+        conn->queued = 0;
+    }
+}
+
+/**
+ * 応答を待ちきれなかったリクエストを取り消して504を返させる
+ * 
+ **/
+static void backend_timeout(struct Connection *conn)
+{
+    struct BackendCall *call = conn->req->backend;
+
+    if (call->backend) backend_abort(call, ERROR_504);
+}
+
+/**
+ * ブロッキングエンジンでバックエンドの応答が揃うまで待ち、レスポンスを組み立てる
+ * 
+ **/
+static void backend_wait(struct Connection *conn, char *docroot)
+{
+    struct BackendCall *call = conn->req->backend;
+    struct Backend *b;
+    struct pollfd pfd;
+    time_t deadline = time(NULL) + BACKEND_TIMEOUT;
+    int n;
+
+    while (!call->done) {
+        b = call->backend;
+        backend_flush(b);
+        if (call->done) break;
+        if (time(NULL) >= deadline) {
+            backend_abort(call, ERROR_504);
+            break;
+        }
+        pfd.fd = b->fd;
+        pfd.events = POLLIN | (b->outpos < b->outlen ? POLLOUT : 0);
+        n = poll(&pfd, 1, 1000);
+        if (n < 0 && errno != EINTR) log_exit("poll(2) failed: %s", strerror(errno));
+        if (n <= 0) continue;
+        if (pfd.revents & POLLOUT) backend_flush(b);
+        if (pfd.revents & ~POLLOUT) backend_input(b);
+    }
+    // 1つの接続しか扱わないので、並んでいるのはこの接続だけ
+    backend_ready = NULL;
+    conn->queued = 0;
+    conn_output(conn, docroot);
+}
+
+/**
+ * ブロッキングエンジンでボディの受信を止めている間、バックエンドが受け取るまで待つ
+ * 応答が先に返ってくることもあるので読み込みも続ける。待ちきれなければ504にして残りのボディは読み捨てる。
+ **/
+static void backend_drain(struct Connection *conn)
+{
+    struct BackendCall *call = conn->req->backend;
+    struct pollfd pfd;
+    time_t deadline = time(NULL) + BACKEND_TIMEOUT;
+    int n;
+
+    while (backend_paused_p(conn)) {
+        if (time(NULL) >= deadline) {
+            backend_abort(call, ERROR_504);
+            break;
+        }
+        pfd.fd = call->backend->fd;
+        pfd.events = POLLIN | POLLOUT;
+        n = poll(&pfd, 1, 1000);
+        if (n < 0 && errno != EINTR) log_exit("poll(2) failed: %s", strerror(errno));
+        if (n <= 0) continue;
+        if (pfd.revents & POLLOUT) backend_flush(call->backend);
+        if (call->backend && (pfd.revents & ~POLLOUT)) backend_input(call->backend);
+    }
+}
+
+/**
+ * 応答が揃って送信を再開できる接続を1つ取り出す
+ * なければNULLを返す。
+ **/
+static struct Connection* backend_next_ready(void)
+{
+    struct Connection *conn = backend_ready;
+
+    if (!conn) return NULL;
+    backend_ready = conn->ready_next;
+    conn->queued = 0;
+    return conn;
+}
+
+/**
+ * epollやio_uringから返ってきたポインタがバックエンドへの接続を指しているか
+ * 
+ **/
+static int backend_p(void *p)
+{
+    return (char*)p >= (char*)backends && (char*)p < (char*)(backends + BACKEND_CONNS);
+}
+
+/**
+ * 溜まったフレームを送り、バックエンドへの接続をepollで監視する
+ * 送りきれなかった分があるときだけ書き込み可能になるのを待つ。
+ **/
+static void backend_watch(int epfd)
+{
+    struct epoll_event ev;
+    struct Backend *b;
+    int i;
+
+    for (i = 0; i < BACKEND_CONNS; i++) {
+        b = &backends[i];
+        if (b->fd >= 0) backend_flush(b);
+        if (b->fd < 0) continue;
+        ev.events = EPOLLIN | (b->outpos < b->outlen ? EPOLLOUT : 0);
+        ev.data.ptr = b;
+        if (ev.events == b->events) continue;
+        if (epoll_ctl(epfd, b->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, b->fd, &ev) < 0)
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        b->events = ev.events;
+    }
+}
+
+/**
+ * backend_watch()のio_uring版
+ * 読み込みと書き込みの待ちは別々に出し、完了したものだけを出し直す。
+ **/
+static void backend_uring_watch(struct Uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    struct Backend *b;
+    int i;
+
+    for (i = 0; i < BACKEND_CONNS; i++) {
+        b = &backends[i];
+        if (b->fd >= 0) backend_flush(b);
+        if (b->fd < 0) continue;
+        if (!b->poll_in) {
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = b->fd;
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = (uint64_t)(uintptr_t)b;
+            b->poll_in = 1;
+        }
+        if (!b->poll_out && b->outpos < b->outlen) {
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = b->fd;
+            sqe->poll32_events = POLLOUT;
+            sqe->user_data = (uint64_t)(uintptr_t)b | 1;
+            b->poll_out = 1;
+        }
+    }
+}
+
+/**
+ * バックエンドに繋ぐ
+ * 同じホストのUnixドメインソケットなのでconnect(2)はすぐに終わる。受け付けが追いつかなければ失敗する。
+ **/
+static int backend_connect(struct Backend *b)
+{
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&backend_addr, backend_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!b->inbuf) b->inbuf = xmalloc(sizeof(struct BackendFrame) + BACKEND_FRAME_MAX);
+    b->fd = fd;
+    b->inlen = b->outpos = b->outlen = 0;
+    return 0;
+}
+
+/**
+ * フレームを送信待ちに加える
+ * 送るのはbackend_flush()。
+ **/
+static void backend_queue(struct Backend *b, int type, uint32_t id, const void *data, size_t len)
+{
+    struct BackendFrame f;
+    size_t need = sizeof f + len;
+
+    // 送り終えた分を詰めても足りなければ広げる
+    if (b->outlen + need > b->outsize && b->outpos > 0) {
+        memmove(b->outbuf, b->outbuf + b->outpos, b->outlen - b->outpos);
+        b->outlen -= b->outpos;
+        b->outpos = 0;
+    }
+    if (b->outlen + need > b->outsize) {
+        if (b->outsize == 0) b->outsize = sizeof f + BACKEND_FRAME_MAX;
+        while (b->outlen + need > b->outsize)
+            b->outsize *= 2;
+        b->outbuf = realloc(b->outbuf, b->outsize);
+        if (!b->outbuf) log_exit("failed to allocate memory.");
+    }
+    memset(&f, 0, sizeof f);
+    f.type = type;
+    f.id = id;
+    f.len = len;
+    memcpy(b->outbuf + b->outlen, &f, sizeof f);
+    if (len > 0) memcpy(b->outbuf + b->outlen + sizeof f, data, len);
+    b->outlen += need;
+}
+
+/**
+ * 送信待ちのフレームを送れるだけ送る
+ * 送れなくなった接続は閉じ、応答を待っていたリクエストを失敗させる。
+ **/
+static void backend_flush(struct Backend *b)
+{
+    ssize_t n;
+
+    while (b->fd >= 0 && b->outpos < b->outlen) {
+        n = send(b->fd, b->outbuf + b->outpos, b->outlen - b->outpos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            log_warn("failed to send to backend: %s", strerror(errno));
+            backend_fail(b);
+            return;
+        }
+        b->outpos += n;
+    }
+    if (b->outpos == b->outlen) b->outpos = b->outlen = 0;
+    if (b->outlen - b->outpos <= BACKEND_OUTBUF_MAX) backend_resume(b);
+}
+
+/**
+ * 送り待ちが減ったので、ボディの受信を止めていた接続を再開させる
+ * 
+ **/
+static void backend_resume(struct Backend *b)
+{
+    int i;
+
+    for (i = 0; i < BACKEND_MAX_CALLS; i++) {
+        if (b->calls[i] && b->calls[i]->conn->paused) backend_push_ready(b->calls[i]->conn);
+    }
+}
+
+/**
+ * ボディの受信を止めるべきか
+ * バックエンドへの接続に送りきれていないフレームがBACKEND_OUTBUF_MAXを超えていれば、送れるまで待つ。
+ **/
+static int backend_paused_p(struct Connection *conn)
+{
+    struct BackendCall *call = conn->req ? conn->req->backend : NULL;
+    struct Backend *b = call ? call->backend : NULL;
+
+    return conn->state == CONN_BODY && b && b->fd >= 0 && b->outlen - b->outpos > BACKEND_OUTBUF_MAX;
+}
+
+/**
+ * バックエンドから読めるだけ読み込み、揃ったフレームを処理する
+ * 
+ **/
+static void backend_input(struct Backend *b)
+{
+    struct BackendFrame f;
+    size_t pos;
+    ssize_t n;
+
+    while (b->fd >= 0) {
+        n = read(b->fd, b->inbuf + b->inlen, sizeof f + BACKEND_FRAME_MAX - b->inlen);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            // 応答待ちがなければ、バックエンドの作り直しなどで閉じられただけ
+            if (b->ncalls > 0) log_warn("backend connection closed: %s", n < 0 ? strerror(errno) : "EOF");
+            backend_fail(b);
+            return;
+        }
+        b->inlen += n;
+        for (pos = 0; b->inlen - pos >= sizeof f; pos += sizeof f + f.len) {
+            memcpy(&f, b->inbuf + pos, sizeof f);
+            if (f.len > BACKEND_FRAME_MAX) {
+                log_warn("backend sent a too large frame");
+                backend_fail(b);
+                return;
+            }
+            if (b->inlen - pos < sizeof f + f.len) break;
+            if (backend_frame(b, &f, b->inbuf + pos + sizeof f) < 0) {
+                log_warn("backend sent an unknown frame type %d", f.type);
+                backend_fail(b);
+                return;
+            }
+        }
+        memmove(b->inbuf, b->inbuf + pos, b->inlen - pos);
+        b->inlen -= pos;
+    }
+}
+
+/**
+ * バックエンドから届いたフレームを1つ処理する
+ * 接続ごと使えなくなる誤りなら-1を返す。1つのリクエストだけに関わる誤りはそのリクエストを502にする。
+ **/
+static int backend_frame(struct Backend *b, struct BackendFrame *f, char *payload)
+{
+    struct BackendCall *call = b->calls[f->id % BACKEND_MAX_CALLS];
+    char *body;
+
+    if (f->type != BACKEND_RESPONSE && f->type != BACKEND_BODY) return -1;
+    // 取り消したリクエストの残りは捨てる
+    if (!call || call->id != f->id) return 0;
+    if (f->type == BACKEND_RESPONSE) {
+        if (call->status_line || backend_response_header(call, payload, f->len) < 0) {
+            log_warn("backend sent an invalid response header");
+            backend_abort(call, ERROR_502);
+        }
+        return 0;
+    }
+    if (!call->status_line) {
+        log_warn("backend sent a body before the response header");
+        backend_abort(call, ERROR_502);
+        return 0;
+    }
+    if (f->len == 0) {
+        backend_complete(call, 0, ERROR_502);
+        return 0;
+    }
+    if (call->body_len + f->len > BACKEND_RESPONSE_MAX) {
+        log_warn("backend response is too large");
+        backend_abort(call, ERROR_502);
+        return 0;
+    }
+    if (call->body_len + f->len > call->body_size) {
+        if (call->body_size == 0) call->body_size = BACKEND_FRAME_MAX;
+        while (call->body_len + f->len > call->body_size)
+            call->body_size *= 2;
+        body = realloc(call->body, call->body_size);
+        if (!body) log_exit("failed to allocate memory.");
+        call->body = body;
+    }
+    memcpy(call->body + call->body_len, payload, f->len);
+    call->body_len += f->len;
+    return 0;
+}
+
+/**
+ * RESPONSEフレームからステータスラインと中継するヘッダを組み立てる
+ * レスポンスを分割されないよう、名前がトークンでないものや値に制御文字を含むものは受け付けない。
+ **/
+static int backend_response_header(struct BackendCall *call, char *payload, size_t len)
+{
+    struct Arena *arena = &call->conn->arena;
+    char *p, *end = payload + len, *name, *value, *h;
+    size_t hlen = 0, n;
+    int pass, code;
+
+    if (len == 0 || payload[len - 1] != '\0') return -1;
+    // 1回目で確かめて長さを数え、2回目で書き込む
+    for (pass = 0; pass < 2; pass++) {
+        for (p = payload; p < end; p = value + strlen(value) + 1) {
+            name = p;
+            value = name + strlen(name) + 1;
+            if (value >= end) return -1;
+            for (h = value; *h; h++) {
+                if (((unsigned char)*h < 0x20 && *h != '\t') || *h == 0x7f) return -1;
+            }
+            if (p == payload) {
+                // 最初は":status"で、"200 OK"のように3桁のコードから始まる
+                if (strcmp(name, ":status") != 0 || !isdigit((unsigned char)value[0]) || !isdigit((unsigned char)value[1])
+                    || !isdigit((unsigned char)value[2]) || (value[3] != '\0' && value[3] != ' '))
+                    return -1;
+                code = atoi(value);
+                if (code < 200 || code > 599) return -1;
+                if (pass == 1) {
+                    n = strlen(value) + 16;
+                    call->status_line = arena_alloc(arena, n);
+                    snprintf(call->status_line, n, "HTTP/1.%d %s%s\r\n", HTTP_MINOR_VERSION, value, value[3] ? "" : " ");
+                }
+                continue;
+            }
+            if (*name == '\0') return -1;
+            for (h = name; *h; h++) {
+                if (!isalnum((unsigned char)*h) && !strchr("!#$%&'*+-.^_`|~", *h)) return -1;
+            }
+            // 長さと日付、サーバ名はこちらで付ける
+            if (hop_by_hop_p(name) || strcasecmp(name, "content-length") == 0
+                || strcasecmp(name, "date") == 0 || strcasecmp(name, "server") == 0)
+                continue;
+            if (pass == 0) {
+                hlen += strlen(name) + 2 + strlen(value) + 2;
+                continue;
+            }
+            n = strlen(name);
+            memcpy(h = call->header + call->header_len, name, n);
+            memcpy(h + n, ": ", 2);
+            memcpy(h + n + 2, value, strlen(value));
+            memcpy(h + n + 2 + strlen(value), "\r\n", 2);
+            call->header_len += n + 2 + strlen(value) + 2;
+        }
+        if (pass == 0) {
+            call->header = arena_alloc(arena, hlen > 0 ? hlen : 1);
+            call->header_len = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 応答を待ち終えたリクエストを接続から外す
+ * 応答を待っていたHTTPの接続はbackend_readyに並べ、イベントループに送信を再開してもらう。
+ **/
+static void backend_complete(struct BackendCall *call, int failed, enum ErrorPageId error)
+{
+    struct Backend *b = call->backend;
+    struct Connection *conn = call->conn;
+
+    b->calls[call->id % BACKEND_MAX_CALLS] = NULL;
+    b->ncalls--;
+    call->backend = NULL;
+    call->done = 1;
+    call->failed = failed;
+    call->error = error;
+    // ボディの受信を止めていた接続も、残りを読み捨てられるように再開させる
+    if (conn->state == CONN_BACKEND || conn->paused) backend_push_ready(conn);
+}
+
+/**
+ * 接続をbackend_readyに並べ、イベントループに処理を再開してもらう
+ * 
+ **/
+static void backend_push_ready(struct Connection *conn)
+{
+    conn->paused = 0;
+    if (conn->queued) return;
+    conn->queued = 1;
+    conn->ready_next = backend_ready;
+    backend_ready = conn;
+}
+
+/**
+ * 応答を待つのをやめて失敗として扱う
+ * バックエンドにも取り消しを伝え、処理を打ち切ってもらう。
+ **/
+static void backend_abort(struct BackendCall *call, enum ErrorPageId error)
+{
+    if (call->backend->fd >= 0) backend_queue(call->backend, BACKEND_ABORT, call->id, NULL, 0);
+    backend_complete(call, 1, error);
+}
+
+/**
+ * バックエンドへの接続を閉じ、応答を待っていたリクエストを全て502にする
+ * 次のリクエストで繋ぎ直す。
+ **/
+static void backend_fail(struct Backend *b)
+{
+    int i;
+
+    // io_uringで待っている操作もshutdown(2)で終わらせる
+    shutdown(b->fd, SHUT_RDWR);
+    close(b->fd);
+    b->fd = -1;
+    b->events = 0;
+    b->inlen = b->outpos = b->outlen = 0;
+    for (i = 0; i < BACKEND_MAX_CALLS; i++) {
+        if (b->calls[i]) backend_complete(b->calls[i], 1, ERROR_502);
+    }
+}
+
+/**
+ * --proxyの"prefix=host:port[,host:port...]"を経路に加える
+ * 上流の名前は起動時に1回だけ解決する。
+ **/
+static void add_proxy_route(char *spec)
+{
+    struct ProxyRoute *route;
+    char *eq = strchr(spec, '='), *name, *save;
+
+    if (n_proxy_routes == MAX_PROXY_ROUTES) {
+        fprintf(stderr, "too many --proxy routes (max %d)\n", MAX_PROXY_ROUTES);
+        exit(1);
+    }
+    if (spec[0] != '/' || !eq) {
+        fprintf(stderr, "invalid --proxy: %s\n", spec);
+        exit(1);
+    }
+    route = &proxy_routes[n_proxy_routes++];
+    *eq = '\0';
+    route->prefix = spec;
+    route->prefix_len = strlen(spec);
+    for (name = strtok_r(eq + 1, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (route->n_upstreams == MAX_UPSTREAMS) {
+            fprintf(stderr, "too many upstreams for %s (max %d)\n", spec, MAX_UPSTREAMS);
+            exit(1);
+        }
+        resolve_upstream(&route->upstreams[route->n_upstreams++], name);
+    }
+    if (route->n_upstreams == 0) {
+        fprintf(stderr, "no upstream for %s\n", spec);
+        exit(1);
+    }
+}
+
+/**
+ * "host:port"を解決してアドレスを入れる
+ * IPv6のアドレスは"[::1]:8080"のように括弧で囲む。
+ **/
+static void resolve_upstream(struct Upstream *u, char *name)
+{
+    struct addrinfo hints, *res;
+    char buf[256], *host, *port;
+    int err;
+
+    if (strlen(name) >= sizeof buf || !(port = strrchr(strcpy(buf, name), ':')) || port == buf) {
+        fprintf(stderr, "invalid upstream: %s\n", name);
+        exit(1);
+    }
+    *port++ = '\0';
+    host = buf;
+    if (host[0] == '[' && port[-2] == ']') {
+        host++;
+        port[-2] = '\0';
+    }
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "%s: %s\n", name, gai_strerror(err));
+        exit(1);
+    }
+    u->name = name;
+    memcpy(&u->addr, res->ai_addr, res->ai_addrlen);
+    u->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+/**
+ * リクエストを転送する経路を探す
+ * 当たるものがなければNULLを返す。
+ **/
+static struct ProxyRoute* proxy_route(struct HTTPRequest *req)
+{
+    int i;
+
+    for (i = 0; i < n_proxy_routes; i++) {
+        if (strncmp(req->path, proxy_routes[i].prefix, proxy_routes[i].prefix_len) == 0) return &proxy_routes[i];
+    }
+    return NULL;
+}
+
+/**
+ * リクエストを上流に転送する準備をする
+ * 上流に繋ぐのはボディを受け取り終えてから。
+ **/
+static void start_proxy_call(struct Connection *conn, struct ProxyRoute *route)
+{
+    struct ProxyCall *call = arena_alloc(&conn->arena, sizeof(struct ProxyCall));
+
+    memset(call, 0, sizeof(struct ProxyCall));
+    call->route = route;
+    conn->req->proxy = call;
+    conn->body_handler = proxy_body;
+}
+
+/**
+ * 受信したボディを上流に送るまで溜めておく
+ * チャンク形式のものもContent-Lengthを付けて送るので、長さはMAX_REQUEST_BODY_LENGTHまでとする。
+ **/
+static int proxy_body(struct Connection *conn, const char *buf, size_t len)
+{
+    struct ProxyCall *call = conn->req->proxy;
+    char *body;
+
+    if (conn->body_received > MAX_REQUEST_BODY_LENGTH) {
+        conn->error = ERROR_413;
+        return -1;
+    }
+    if (call->body_len + len > call->body_size) {
+        if (call->body_size == 0) call->body_size = FILE_CHUNK_SIZE;
+        while (call->body_len + len > call->body_size)
+            call->body_size *= 2;
+        body = realloc(call->body, call->body_size);
+        if (!body) log_exit("failed to allocate memory.");
+        call->body = body;
+    }
+    memcpy(call->body + call->body_len, buf, len);
+    call->body_len += len;
+    return 0;
+}
+
+/**
+ * 上流に送るリクエストラインとヘッダを組み立てる
+ * 接続ごとのヘッダとExpectは送らない。上流への接続はkeep-aliveで使い回すのでHTTP/1.1で送る。
+ * Hostのないリクエストには経路の最初の上流の名前を使う。
+ **/
+static void build_proxy_request(struct Connection *conn)
+{
+    struct HTTPRequest *req = conn->req;
+    struct ProxyCall *call = req->proxy;
+    char *host = lookup_header_field_value(req, HTTP_HEADER_HOST);
+    char length[32];
+    size_t len;
+    char *p;
+    int i;
+
+    if (!host) host = call->route->upstreams[0].name;
+    length[0] = '\0';
+    if (call->body_len > 0 || req->length != 0) snprintf(length, sizeof length, "%zu", call->body_len);
+    // 長さを数えてから書き込む
+    len = strlen(req->method) + 1 + strlen(req->path) + sizeof " HTTP/1.1\r\n" + strlen("host") + strlen(host) + 4;
+    if (length[0]) len += strlen("content-length") + strlen(length) + 4;
+    for (i = 0; i < HTTP_HEADER_COUNT; i++) {
+        if (req->known_header[i] && i != HTTP_HEADER_HOST && i != HTTP_HEADER_CONTENT_LENGTH
+            && i != HTTP_HEADER_EXPECT && !hop_by_hop_p(http_header_name(i)))
+            len += strlen(http_header_name(i)) + strlen(req->known_header[i]) + 4;
+    }
+    for (i = 0; i < req->n_other_header; i++) {
+        if (!hop_by_hop_p(req->other_header[i].name))
+            len += strlen(req->other_header[i].name) + strlen(req->other_header[i].value) + 4;
+    }
+    len += 2;
+    p = call->head = arena_alloc(&conn->arena, len);
+    p += sprintf(p, "%s %s HTTP/1.1\r\n", req->method, req->path);
+    p = proxy_put_header(p, "host", host);
+    if (length[0]) p = proxy_put_header(p, "content-length", length);
+    for (i = 0; i < HTTP_HEADER_COUNT; i++) {
+        if (req->known_header[i] && i != HTTP_HEADER_HOST && i != HTTP_HEADER_CONTENT_LENGTH
+            && i != HTTP_HEADER_EXPECT && !hop_by_hop_p(http_header_name(i)))
+            p = proxy_put_header(p, http_header_name(i), req->known_header[i]);
+    }
+    for (i = 0; i < req->n_other_header; i++) {
+        if (!hop_by_hop_p(req->other_header[i].name))
+            p = proxy_put_header(p, req->other_header[i].name, req->other_header[i].value);
+    }
+    memcpy(p, "\r\n", 2);
+    call->head_len = p + 2 - call->head;
+    call->in = arena_alloc(&conn->arena, PROXY_BUF_SIZE);
+    http_parser_init(&call->parser);
+}
+
+/**
+ * "名前: 値\r\n"をpに書き込み、続きの位置を返す
+ * 
+ **/
+static char* proxy_put_header(char *p, const char *name, const char *value)
+{
+    size_t n = strlen(name), v = strlen(value);
+
+    memcpy(p, name, n);
+    memcpy(p + n, ": ", 2);
+    memcpy(p + n + 2, value, v);
+    memcpy(p + n + 2 + v, "\r\n", 2);
+    return p + n + 2 + v + 2;
+}
+
+/**
+ * 上流に繋いでリクエストを送り、レスポンスのヘッダを受け取る
+ * ヘッダが揃うか失敗してレスポンスを組み立てられるようになったら1を返す。
+ * 上流のソケットで待つ必要があれば、待つイベントをcall->waitに入れて0を返す。
+ **/
+static int proxy_pump(struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req->proxy;
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total;
+    ssize_t n;
+    int ret;
+
+    if (!call->head) build_proxy_request(conn);
+    total = call->head_len + call->body_len;
+    for (;;) {
+        if (call->failed) break;
+        if (!call->uc) {
+            proxy_connect(conn);
+            continue;
+        }
+        // ヘッダとボディをまとめて送る。connect(2)が終わっていなければEAGAINになる
+        if (call->sent < total) {
+            memset(&msg, 0, sizeof msg);
+            msg.msg_iov = iov;
+            if (call->sent < call->head_len) {
+                iov[0].iov_base = call->head + call->sent;
+                iov[0].iov_len = call->head_len - call->sent;
+                iov[1].iov_base = call->body;
+                iov[1].iov_len = call->body_len;
+                msg.msg_iovlen = call->body_len > 0 ? 2 : 1;
+            }
+            else {
+                iov[0].iov_base = call->body + (call->sent - call->head_len);
+                iov[0].iov_len = total - call->sent;
+                msg.msg_iovlen = 1;
+            }
+            n = sendmsg(call->uc->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                call->wait = POLLOUT;
+                return 0;
+            }
+            if (n < 0) {
+                proxy_failed(conn, strerror(errno));
+                continue;
+            }
+            call->sent += n;
+            continue;
+        }
+        n = read(call->uc->fd, call->in + call->inlen, PROXY_BUF_SIZE - call->inlen);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            call->wait = POLLIN;
+            return 0;
+        }
+        if (n <= 0) {
+            proxy_failed(conn, n < 0 ? strerror(errno) : "connection closed");
+            continue;
+        }
+        call->inlen += n;
+        ret = proxy_response_header(conn);
+        if (ret > 0) {
+            // 応答できたので、切り離していても戻す
+            call->uc->upstream->fails = 0;
+            call->uc->upstream->down_until = 0;
+            break;
+        }
+        if (ret < 0 || call->inlen == PROXY_BUF_SIZE)
+            proxy_failed(conn, "invalid response header");
+    }
+    call->wait = 0;
+    return 1;
+}
+
+/**
+ * 上流を選んで繋ぐ
+ * 順番に選び、切り離している上流は飛ばす。全て切り離していれば最も早く戻るものを試す。
+ * keep-aliveで空いている接続があればそれを使い、なければ新しく繋ぐ。
+ **/
+static void proxy_connect(struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req->proxy;
+    struct ProxyRoute *route = call->route;
+    struct Upstream *u = NULL, *c = NULL;
+    struct UpstreamConn *uc;
+    time_t now = time(NULL);
+    char b;
+    int i, fd, one = 1;
+
+    for (i = 0; i < route->n_upstreams; i++) {
+        c = &route->upstreams[(route->next + i) % route->n_upstreams];
+        if (c->down_until <= now) break;
+        if (!u || c->down_until < u->down_until) u = c;
+    }
+    if (i < route->n_upstreams) u = c;
+    route->next = (u - route->upstreams + 1) % route->n_upstreams;
+
+    while ((uc = u->idle)) {
+        u->idle = uc->next;
+        if (uc->next) uc->next->pprev = &u->idle;
+        u->nidle--;
+        timer_cancel(&uc->timer);
+        // 空いている間に上流が閉じていないか確かめる。何か届いていれば前の応答の残りなので使わない
+        if (now - uc->idle_since < UPSTREAM_IDLE_TIMEOUT && recv(uc->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            call->uc = uc;
+            call->reused = 1;
+            return;
+        }
+        upstream_close(uc);
+    }
+    call->tries++;
+    fd = socket(u->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_warn("socket(2) failed: %s", strerror(errno));
+        call->failed = 1;
+        call->error = ERROR_503;
+        return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    uc = xmalloc(sizeof(struct UpstreamConn));
+    uc->fd = fd;
+    uc->upstream = u;
+    uc->events = 0;
+    uc->next = NULL;
+    uc->timer.pprev = NULL;
+    call->uc = uc;
+    call->reused = 0;
+    if (connect(fd, (struct sockaddr*)&u->addr, u->addrlen) < 0 && errno != EINPROGRESS)
+        proxy_failed(conn, strerror(errno));
+}
+
+/**
+ * 上流とのやり取りに失敗したので、接続を閉じて試し直すか502にする
+ * 上流がまだ何も処理していないはずの場合か、何度送っても同じ結果になるメソッドの場合だけ別の上流で試し直す。
+ * 使い回した接続が閉じられていただけなら、上流の失敗には数えない。
+ **/
+static void proxy_failed(struct Connection *conn, const char *reason)
+{
+    struct ProxyCall *call = conn->req->proxy;
+    struct Upstream *u = call->uc->upstream;
+
+    if (!call->reused || call->timed_out) {
+        log_warn("upstream %s failed: %s", u->name, call->timed_out ? "timed out" : reason);
+        upstream_failed(u);
+    }
+    upstream_close(call->uc);
+    call->uc = NULL;
+    if (!call->timed_out && call->inlen == 0 && call->tries < call->route->n_upstreams
+        && (call->sent == 0 || idempotent_p(conn->req->method))) {
+        call->sent = 0;
+        return;
+    }
+    call->failed = 1;
+    call->error = call->timed_out ? ERROR_504 : ERROR_502;
+}
+
+/**
+ * 何度送っても同じ結果になるメソッドか
+ * 
+ **/
+static int idempotent_p(const char *method)
+{
+    static const char *methods[] = { "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE", NULL };
+    int i;
+
+    for (i = 0; methods[i]; i++) {
+        if (strcmp(method, methods[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * 受信した分だけ上流のレスポンスのヘッダを解析し、ボディの区切り方を決める
+ * 揃ったら1を、まだ足りなければ0を、不正なら-1を返す。
+ * 100 Continueなどの途中経過は中継せずに読み捨てる。プロトコルの切り替え(101)には対応しない。
+ **/
+static int proxy_response_header(struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req->proxy;
+    struct HTTPParser *p = &call->parser;
+    struct HTTPParsedHeader *h;
+    char *te = NULL, *val;
+    size_t len;
+    int i;
+
+    for (;;) {
+        switch (http_parse_response(p, call->in, call->inlen)) {
+        case HTTP_PARSE_ERROR:
+            return -1;
+        case HTTP_PARSE_AGAIN:
+            return 0;
+        }
+        if (p->status >= 200) break;
+        if (p->status == 101) return -1;
+        memmove(call->in, call->in + p->pos, call->inlen - p->pos);
+        call->inlen -= p->pos;
+        http_parser_init(p);
+    }
+    call->inpos = p->pos;
+    call->keep_alive = p->minor_version >= 1;
+    // 値はヘッダの中の区切り文字を終端に置き換えて、そのまま文字列として使う
+    call->in[p->reason.off + p->reason.len] = '\0';
+    for (i = 0; i < p->nheaders; i++) {
+        h = &p->headers[i];
+        call->in[h->name.off + h->name.len] = '\0';
+        call->in[h->value.off + h->value.len] = '\0';
+        val = call->in + h->value.off;
+        if (h->id == HTTP_HEADER_CONNECTION) {
+            if (header_token_p(val, "close")) call->keep_alive = 0;
+            else if (header_token_p(val, "keep-alive")) call->keep_alive = 1;
+        }
+        else if (h->id == HTTP_HEADER_TRANSFER_ENCODING)
+            te = val;
+    }
+    memset(&call->chunk, 0, sizeof call->chunk);
+    if (strcmp(conn->req->method, "HEAD") == 0 || p->status == 204 || p->status == 304)
+        call->framing = PROXY_NONE;
+    else if (te) {
+        // chunkedが最後でなければ、上流が閉じるまでがボディになる
+        len = strlen(te);
+        call->framing = (len >= 7 && strcasecmp(te + len - 7, "chunked") == 0) ? PROXY_CHUNKED : PROXY_CLOSE;
+        call->chunk.state = BODY_CHUNK_SIZE;
+        call->dechunk = conn->req->protocol_minor_version < 1;
+    }
+    else if (p->content_length >= 0) {
+        call->framing = PROXY_LENGTH;
+        call->remain = p->content_length;
+    }
+    else
+        call->framing = PROXY_CLOSE;
+    if (call->framing == PROXY_CLOSE) call->keep_alive = 0;
+    return 1;
+}
+
+/**
+ * 上流のレスポンスのヘッダからレスポンスを組み立てる
+ * ボディはヘッダと一緒に届いた分だけを加え、残りはconn_write()からproxy_relay()で中継する。
+ * 長さの分からないボディは接続を閉じて終わりを伝える。
+ **/
+static void finish_proxy_call(struct HTTPRequest *req, struct Response *res)
+{
+    struct ProxyCall *call = req->proxy;
+    struct HTTPParser *p = &call->parser;
+    struct HTTPParsedHeader *h;
+    const char *name;
+    char *buf, *q;
+    size_t len;
+    int i;
+
+    if (call->failed) {
+        output_error_response(req, res, call->error);
+        return;
+    }
+    if (call->framing == PROXY_CLOSE || (call->framing == PROXY_CHUNKED && call->dechunk)) req->keep_alive = 0;
+    len = p->reason.len + 32;
+    buf = arena_alloc(res->arena, len);
+    snprintf(buf, len, "HTTP/1.%d %03d %s\r\n", HTTP_MINOR_VERSION, p->status, call->in + p->reason.off);
+    output_common_header_fields(req, res, buf);
+    // 長さと転送の仕方、日付、サーバ名はこちらで付ける
+    len = 64;
+    for (i = 0; i < p->nheaders; i++) {
+        h = &p->headers[i];
+        name = call->in + h->name.off;
+        if (h->id == HTTP_HEADER_CONTENT_LENGTH || hop_by_hop_p(name)
+            || strcasecmp(name, "date") == 0 || strcasecmp(name, "server") == 0) {
+            h->name.len = 0;
+            continue;
+        }
+        len += h->name.len + h->value.len + 4;
+    }
+    q = buf = arena_alloc(res->arena, len);
+    for (i = 0; i < p->nheaders; i++) {
+        h = &p->headers[i];
+        if (h->name.len > 0) q = proxy_put_header(q, call->in + h->name.off, call->in + h->value.off);
+    }
+    if (call->framing == PROXY_LENGTH || (call->framing == PROXY_NONE && p->content_length >= 0 && p->status != 204))
+        q += sprintf(q, "Content-Length: %ld\r\n", p->content_length);
+    else if (call->framing == PROXY_CHUNKED && !call->dechunk)
+        q += sprintf(q, "Transfer-Encoding: chunked\r\n");
+    memcpy(q, "\r\n", 2);
+    response_add(res, buf, q + 2 - buf);
+    res->proxy = call;
+    // ヘッダと一緒に届いていたボディの先頭はヘッダに続けて送る
+    proxy_consume(call);
+    if (call->outlen > 0) response_add(res, call->out, call->outlen);
+    call->outlen = 0;
+}
+
+/**
+ * 上流からのボディを相手に中継する
+ * 長さが分かるか上流が閉じるまでのボディはパイプを経由してsplice(2)で移し、ユーザー空間にコピーしない。
+ * チャンク形式のものは終わりを見つけるために受信バッファに読み込み、そのまま(HTTP/1.0の相手には中身だけを)送る。
+ * conn_write()と同じく、送り終えたら1を、続きがあれば0を、エラーなら-1を返す。
+ * 上流から届くのを待つ場合はcall->waitにPOLLINを入れる。
+ **/
+static int proxy_relay(struct Connection *conn)
+{
+    struct ProxyCall *call = conn->res.proxy;
+    size_t len;
+    ssize_t n;
+
+    call->wait = 0;
+    for (;;) {
+        // 受け取ってある分を先に送りきる
+        if (call->piped > 0 || call->outlen > 0) {
+            if (call->piped > 0)
+                n = splice(conn->pipe[0], NULL, conn->fd, NULL, call->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            else
+                n = send(conn->fd, call->out, call->outlen, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            if (n <= 0) return -1;
+            if (call->piped > 0)
+                call->piped -= n;
+            else {
+                call->out += n;
+                call->outlen -= n;
+            }
+            conn->res.sent += n;
+            continue;
+        }
+        if (call->broken || call->timed_out) return -1;
+        if (call->inpos < call->inlen) {
+            proxy_consume(call);
+            continue;
+        }
+        if (proxy_body_done_p(call)) {
+            proxy_release(call);
+            conn->res.proxy = NULL;
+            return 1;
+        }
+        if (call->framing != PROXY_CHUNKED && conn->pipe[0] < 0 && !call->copy) {
+            // パイプが作れなければ受信バッファを経由して送る
+            if (pipe2(conn->pipe, O_CLOEXEC) < 0) {
+                conn->pipe[0] = conn->pipe[1] = -1;
+                call->copy = 1;
+            }
+        }
+        if (conn->pipe[0] >= 0) {
+            len = SPLICE_CHUNK_SIZE;
+            if (call->framing == PROXY_LENGTH && call->remain < (long)len) len = call->remain;
+            n = splice(call->uc->fd, NULL, conn->pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+        else
+            n = read(call->uc->fd, call->in, PROXY_BUF_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            call->wait = POLLIN;
+            return 0;
+        }
+        if (n == 0 && call->framing == PROXY_CLOSE && !call->timed_out) {
+            call->eof = 1;
+            continue;
+        }
+        if (n <= 0) {
+            log_warn("upstream %s closed in the middle of a response", call->uc->upstream->name);
+            return -1;
+        }
+        if (conn->pipe[0] >= 0) {
+            call->piped = n;
+            if (call->framing == PROXY_LENGTH) call->remain -= n;
+        }
+        else {
+            call->inpos = 0;
+            call->inlen = n;
+        }
+    }
+}
+
+/**
+ * 受信バッファにある上流からのボディを、相手に送る部分としてcall->outに取り出す
+ * レスポンスの終わりより後ろに何か届いていたら、上流への接続は使い回さない。
+ **/
+static void proxy_consume(struct ProxyCall *call)
+{
+    char *in = call->in + call->inpos, *w = in;
+    size_t avail = call->inlen - call->inpos, used = 0, len;
+    const char *data;
+    ssize_t n;
+
+    call->out = in;
+    switch (call->framing) {
+    case PROXY_LENGTH:
+        used = avail < (size_t)call->remain ? avail : (size_t)call->remain;
+        call->remain -= used;
+        call->outlen = used;
+        break;
+    case PROXY_CLOSE:
+        used = call->outlen = avail;
+        break;
+    case PROXY_CHUNKED:
+        // 区切りを追って終わりを探す。中身は復号したものが元の位置より前に来るので、その場で詰められる
+        while (used < avail && call->chunk.state != BODY_DONE) {
+            n = body_decode(&call->chunk, in + used, avail - used, &data, &len);
+            if (n < 0) {
+                call->broken = 1;
+                break;
+            }
+            if (call->dechunk && len > 0) {
+                memmove(w, data, len);
+                w += len;
+            }
+            used += n;
+        }
+        call->outlen = call->dechunk ? (size_t)(w - in) : used;
+        break;
+    case PROXY_NONE:
+        break;
+    }
+    if (used < avail) call->keep_alive = 0;
+    call->inpos = call->inlen;
+}
+
+/**
+ * 上流からのボディを全て受け取ったか
+ * 
+ **/
+static int proxy_body_done_p(struct ProxyCall *call)
+{
+    switch (call->framing) {
+    case PROXY_LENGTH:
+        return call->remain == 0;
+    case PROXY_CHUNKED:
+        return call->chunk.state == BODY_DONE;
+    case PROXY_CLOSE:
+        return call->eof;
+    default:
+        return 1;
+    }
+}
+
+/**
+ * 上流への接続を手放す
+ * 使い回せるものは空いている接続に戻し、次のリクエストで使う。
+ **/
+static void proxy_release(struct ProxyCall *call)
+{
+    struct UpstreamConn *uc = call->uc;
+    struct Upstream *u;
+
+    if (!uc) return;
+    call->uc = NULL;
+    u = uc->upstream;
+    if (!call->keep_alive || call->timed_out || u->nidle >= UPSTREAM_IDLE_MAX) {
+        upstream_close(uc);
+        return;
+    }
+    // 空いている間に上流が閉じても、使い終えた接続が起こされないようepollから外しておく
+    if (uc->events) {
+        if (epoll_ctl(uc->epfd, EPOLL_CTL_DEL, uc->fd, NULL) < 0)
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+        uc->events = 0;
+    }
+    uc->idle_since = time(NULL);
+    uc->next = u->idle;
+    if (uc->next) uc->next->pprev = &uc->next;
+    uc->pprev = &u->idle;
+    u->idle = uc;
+    u->nidle++;
+    // 上流のタイムアウトで閉じられた接続に送ってしまわないよう、それより先に閉じる
+    timer_arm(&idle_timers, &uc->timer, timer_clock() + UPSTREAM_IDLE_TIMEOUT);
+}
+
+/**
+ * 上流に転送したリクエストを終える
+ * 中継の途中で終えた上流への接続は、続きが届くかもしれないので使い回さない。
+ **/
+static void end_proxy_call(struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req ? conn->req->proxy : NULL;
+
+    if (!call) return;
+    if (call->uc) {
+        upstream_close(call->uc);
+        call->uc = NULL;
+    }
+    free(call->body);
+    call->body = NULL;
+}
+
+/**
+ * 上流のソケットで待っているか
+ * 
+ **/
+static int proxy_waiting_p(struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req ? conn->req->proxy : NULL;
+
+    return call && call->uc && call->wait;
+}
+
+/**
+ * 上流を待ちきれなかった
+ * 上流への接続をshutdown(2)して待っている操作を終わらせ、ヘッダを受け取る前なら504を、中継の途中なら切断にする。
+ **/
+static void proxy_timeout(struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req->proxy;
+
+    if (call->timed_out) return;
+    call->timed_out = 1;
+    shutdown(call->uc->fd, SHUT_RDWR);
+}
+
+/**
+ * 上流を待つか相手への送信を待つかに応じて、epollに登録するソケットを切り替える
+ * 1回のepoll_wait(2)で同じ接続のイベントが2つ返り、解放した接続を触ることがないよう、常にどちらか一方だけを登録する。
+ **/
+static void proxy_watch(int epfd, struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req->proxy;
+    struct UpstreamConn *uc = call->uc;
+    struct epoll_event ev;
+    uint32_t events = call->wait == POLLIN ? EPOLLIN : call->wait == POLLOUT ? EPOLLOUT : 0;
+    int op;
+
+    conn_watch(epfd, conn, events ? 0 : EPOLLOUT);
+    if (!uc || uc->events == events) return;
+    op = !events ? EPOLL_CTL_DEL : uc->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, op, uc->fd, &ev) < 0)
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    uc->epfd = epfd;
+    uc->events = events;
+}
+
+/**
+ * io_uringで上流のソケットがcall->waitのイベントを待つ
+ * 接続ごとに完了待ちの操作は1つだけなので、その間は相手のソケットでは何も待たない。
+ **/
+static void proxy_uring_poll(struct Uring *ring, struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req->proxy;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = call->uc->fd;
+    sqe->poll32_events = call->wait;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+    conn->op = URING_OP_PROXY;
+}
+
+/**
+ * ブロッキングエンジンで上流のソケットがcall->waitのイベントを待つ
+ * 中継の途中で相手への送信が詰まっていれば、相手のソケットが書き込み可能になるのを待つ。
+ * PROXY_TIMEOUT秒待っても何も起きなければproxy_timeout()する。
+ **/
+static void proxy_wait(struct Connection *conn)
+{
+    struct ProxyCall *call = conn->req->proxy;
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = call->wait ? call->uc->fd : conn->fd;
+    pfd.events = call->wait ? call->wait : POLLOUT;
+    do {
+        n = poll(&pfd, 1, PROXY_TIMEOUT * 1000);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) log_exit("poll(2) failed: %s", strerror(errno));
+    if (n == 0) proxy_timeout(conn);
+}
+
+/**
+ * 上流の失敗を数え、続けてPROXY_MAX_FAILS回失敗したらPROXY_FAIL_TIMEOUT秒の間切り離す
+ * 切り離している間に試しに送って失敗すれば、また切り離す。
+ **/
+static void upstream_failed(struct Upstream *u)
+{
+    time_t now = time(NULL);
+
+    if (++u->fails < PROXY_MAX_FAILS) return;
+    if (u->down_until <= now) log_warn("upstream %s is disabled for %d seconds", u->name, PROXY_FAIL_TIMEOUT);
+    u->down_until = now + PROXY_FAIL_TIMEOUT;
+}
+
+/**
+ * 上流への接続を閉じて解放する
+ * close()すればepollからも自動的に外れる。
+ **/
+static void upstream_close(struct UpstreamConn *uc)
+{
+    timer_cancel(&uc->timer);
+    close(uc->fd);
+    free(uc);
+}
+
+/**
+ * 空いたままUPSTREAM_IDLE_TIMEOUT秒使わなかった上流への接続を閉じる
+ * timer_expire()から呼ばれる。ブロッキングエンジンでは呼ばれないので、proxy_connect()が使う前にも確かめる。
+ **/
+static void upstream_idle_timeout(struct Timer *t)
+{
+    struct UpstreamConn *uc = TIMER_UPSTREAM(t);
+
+    *uc->pprev = uc->next;
+    if (uc->next) uc->next->pprev = uc->pprev;
+    uc->upstream->nidle--;
+    upstream_close(uc);
+}
+
+static void method_not_allowed(struct HTTPRequest *req, struct Response *res)
+{
+    output_error_response(req, res, ERROR_405);
+}
+
+static void not_implemented(struct HTTPRequest *req, struct Response *res)
+{
+    output_error_response(req, res, ERROR_501);
+}
+
+static void not_found(struct HTTPRequest *req, struct Response *res)
+{
+    output_error_response(req, res, ERROR_404);
+}
+
+/**
+ * リクエストに対するエラーレスポンスを加える
+ * 接続を維持するかどうかとHEADかどうかに応じて、組み立て済みのものから選ぶ。
+ **/
+static void output_error_response(struct HTTPRequest *req, struct Response *res, enum ErrorPageId id)
+{
+    output_error_page(res, id, req->keep_alive, strcmp(req->method, "HEAD") == 0);
+}
+
+/**
+ * 組み立て済みのエラーレスポンスを加える
+ * Dateの値は常に同じ長さなので、秒が変わっていればその部分だけを上書きする。
+ **/
+static void output_error_page(struct Response *res, enum ErrorPageId id, int keep_alive, int head)
+{
+    struct ErrorPage *page = &error_pages[id];
+    size_t off = strlen(page->status_line);
+
+    update_date_header();
+    if (page->date_time != date_header_time) {
+        memcpy(page->buf[0] + off, date_header, date_header_len);
+        memcpy(page->buf[1] + off, date_header, date_header_len);
+        page->date_time = date_header_time;
+    }
+    response_add(res, page->buf[keep_alive], head ? page->header_len[keep_alive] : page->len[keep_alive]);
+    res->status = page->code;
+}
+
+/**
+ * 全てのエラーレスポンスを組み立てる
+ * dirを指定した場合はdocroot以下のdir/404.htmlのようなファイルがあればそれを本文に使う。
+ **/
+static void setup_error_pages(char *docroot, char *dir)
+{
+    static const char *connection[2] = { "close", "keep-alive" };
+    struct ErrorPage *page;
+    char *html;
+    size_t html_len, size;
+    int i, k;
+
+    update_date_header();
+    for (i = 0; i < N_ERROR_PAGES; i++) {
+        page = &error_pages[i];
+        html = dir ? load_error_page(docroot, dir, page->code, &html_len) : NULL;
+        if (!html) {
+            size = LINE_BUF_SIZE;
+            html = xmalloc(size);
+            // タイトルはステータスラインから"HTTP/1.x "と改行を除いたもの
+            html_len = snprintf(html, size,
+                                "<html>\r\n"
+                                "<head><title>%.*s</title></head>\r\n"
+                                "<body><p>%s</p></body>\r\n"
+                                "</html>\r\n",
+                                (int)strlen(page->status_line) - 11, page->status_line + 9, page->message);
+        }
+        for (k = 0; k < 2; k++) {
+            size = LINE_BUF_SIZE + html_len;
+            page->buf[k] = xmalloc(size);
+            page->header_len[k] = snprintf(page->buf[k], size,
+                                           "%s%s" SERVER_HEADER "Connection: %s\r\n%s"
+                                           "Content-Length: %ld\r\nContent-Type: text/html\r\n\r\n",
+                                           page->status_line, date_header, connection[k],
+                                           page->extra_header, (long)html_len);
+            memcpy(page->buf[k] + page->header_len[k], html, html_len);
+            page->len[k] = page->header_len[k] + html_len;
+        }
+        page->date_time = date_header_time;
+        free(html);
+    }
+}
+
+/**
+ * docroot以下のdir/<code>.htmlを読み込む
+ * なければNULLを返す。大きすぎるものは使わない。
+ **/
+static char* load_error_page(char *docroot, char *dir, int code, size_t *len)
+{
+    char name[32];
+    char *base, *path, *buf;
+    struct stat st;
+    ssize_t n;
+    size_t done;
+    int fd;
+
+    base = build_fspath(docroot, dir);
+    snprintf(name, sizeof name, "%d.html", code);
+    path = build_fspath(base, name);
+    free(base);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > ERROR_PAGE_MAX_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    buf = xmalloc(st.st_size + 1);
+    for (done = 0; done < (size_t)st.st_size; done += n) {
+        n = read(fd, buf + done, st.st_size - done);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) break;
+    }
+    close(fd);
+    *len = done;
+    return buf;
+}
+
+/**
+ * 全リクエストに共通のレスポンスヘッダを加える
+ * ステータスラインとServer・Connectionは組み立て済みの雛形をそのまま使い、Dateだけをコピーする。
+ **/
+static void output_common_header_fields(struct HTTPRequest *req, struct Response *res, const char *status_line)
+{
+    static const char keep_alive[] = SERVER_HEADER "Connection: keep-alive\r\n";
+    static const char close[] = SERVER_HEADER "Connection: close\r\n";
+
+    response_add(res, status_line, strlen(status_line));
+    // "HTTP/1.1 "の後ろがステータスコード
+    res->status = atoi(status_line + 9);
+    update_date_header();
+    // date_headerは送信中に書き換わることがあるのでコピーしておく
+    response_add_copy(res, date_header, date_header_len);
+    if (req->keep_alive)
+        response_add(res, keep_alive, sizeof keep_alive - 1);
+    else
+        response_add(res, close, sizeof close - 1);
+}
+
+/**
+ * Dateヘッダを現在時刻で作り直す
+ * 秒が変わっていなければ前回のものをそのまま使う。
+ **/
+static void update_date_header(void)
+{
+    time_t t;
+    char buf[TIME_BUF_SIZE];
+
+    t = time(NULL);
+    if (t == date_header_time) return;
+    format_http_date(t, buf, sizeof buf);
+    date_header_len = snprintf(date_header, sizeof date_header, "Date: %s\r\n", buf);
+    date_header_time = t;
+}
+
+/**
+ * レスポンスの末尾にdataを加える
+ * dataはコピーしないので、送り終えるまで残っている領域でなければならない。
+ **/
+static void response_add(struct Response *res, const void *data, size_t len)
+{
+    if (res->iovcnt == RESPONSE_IOV_MAX) log_exit("too many response segments");
+    res->iov[res->iovcnt].iov_base = (void*)data;
+    res->iov[res->iovcnt].iov_len = len;
+    res->iovcnt++;
+}
+
+/**
+ * dataをarenaにコピーしてからレスポンスに加える
+ * 
+ **/
+static void response_add_copy(struct Response *res, const void *data, size_t len)
+{
+    char *p = arena_alloc(res->arena, len);
+
+    memcpy(p, data, len);
+    response_add(res, p, len);
+}
+
+/**
+ * res->fdのoffsetからlenバイトをレスポンスに加える
+ * 
+ **/
+static void response_add_file(struct Response *res, off_t offset, size_t len)
+{
+    if (len == 0) return;
+    response_add(res, NULL, len);
+    res->file_offset[res->iovcnt - 1] = offset;
+}
+
+/**
+ * 送信できたnバイト分だけiovを進める
+ * ファイルの区間の位置はconn_write()が進めるので、ここでは残りの長さだけを減らす。
+ **/
+static void response_consume(struct Response *res, size_t n)
+{
+    struct iovec *v;
+
+    res->sent += n;
+    while (n > 0 && res->iovpos < res->iovcnt) {
+        v = &res->iov[res->iovpos];
+        if (n < v->iov_len) {
+            if (v->iov_base) v->iov_base = (char*)v->iov_base + n;
+            v->iov_len -= n;
+            return;
+        }
+        n -= v->iov_len;
+        res->iovpos++;
+    }
+}
+
+/**
+ * 送り残しのメモリ上のデータをarenaにコピーする
+ * 後から書き換わる領域(cache_bufなど)を指したまま送信待ちにしないために使う。
+ * 連続したメモリ上のデータは1つにまとめ、ファイルやマッピング、res->bufの区間はそのまま残す。
+ **/
+static void response_save(struct Response *res)
+{
+    size_t len;
+    char *p;
+    int i, k, end;
+
+    if (res->owned) return;
+    for (i = res->iovpos, k = 0; i < res->iovcnt; k++) {
+        if (res->iov[i].iov_base == NULL || retained_p(res, res->iov[i].iov_base)) {
+            res->file_offset[k] = res->file_offset[i];
+            res->iov[k] = res->iov[i];
+            i++;
+            continue;
+        }
+        len = 0;
+        for (end = i; end < res->iovcnt && res->iov[end].iov_base && !retained_p(res, res->iov[end].iov_base); end++)
+            len += res->iov[end].iov_len;
+        p = arena_alloc(res->arena, len);
+        for (; i < end; i++) {
+            memcpy(p, res->iov[i].iov_base, res->iov[i].iov_len);
+            p += res->iov[i].iov_len;
+        }
+        // iov[k]はコピー元を読み終えてから書き換える(k <= iなので上書きの心配はない)
+        res->iov[k].iov_base = p - len;
+        res->iov[k].iov_len = len;
+    }
+    res->iovcnt = k;
+    res->iovpos = 0;
+    res->owned = 1;
+    // 共有キャッシュを指していた部分もコピーし終えたので、上書きされても構わない
+    cache_unpin(res);
+}
+
+/**
+ * 次のレスポンスのために空にする
+ * arena上の領域はarena_reset()でまとめて捨てられる。
+ **/
+static void response_reset(struct Response *res)
+{
+    res->iovcnt = res->iovpos = 0;
+    res->owned = 0;
+    res->status = 0;
+    res->sent = 0;
+    cache_unpin(res);
+    // 共有しているfdは閉じずに参照を返す
+    if (res->file) stat_cache_release(res->file);
+    else if (res->fd >= 0) close(res->fd);
+    res->fd = -1;
+    res->file = NULL;
+    if (res->map) mapping_release(res->map);
+    res->map = NULL;
+    free(res->buf);
+    res->buf = NULL;
+    res->buf_len = 0;
+    res->proxy = NULL;
+}
+
+/**
+ * pがレスポンスが送り終えるまで持っている領域(マッピングかres->buf、上流からの受信バッファ)の中を指しているか
+ * 上流からの受信バッファはiovを送り終えるまで次の受信に使わない。
+ **/
+static int retained_p(struct Response *res, const void *p)
+{
+    if (res->buf && (const char*)p >= res->buf && (const char*)p < res->buf + res->buf_len) return 1;
+    if (res->proxy && (const char*)p >= res->proxy->in && (const char*)p < res->proxy->in + PROXY_BUF_SIZE) return 1;
+    return res->map && (const char*)p >= (char*)res->map->addr
+        && (const char*)p < (char*)res->map->addr + res->map->size;
+}
+
+/**
+ * 構造体FileInfoのポインタを取得する
+ * 
+ **/
+static struct FileInfo* get_fileinfo(char *docroot, char *urlpath)
+{
+    struct FileInfo *info;
+    const struct MimeType *mime;
+
     info = xmalloc(sizeof(struct FileInfo));
     info->path = build_fspath(docroot, urlpath);
+    info->cache_key = info->path;
     info->ok = 0;
-    if (lstat(info->path, &st) < 0) return info;
-    if (!S_ISREG(st.st_mode)) return info;
+    info->etag[0] = '\0';
+    info->encoding = NULL;
+    info->compress = 0;
+    info->vary = 0;
+    // 存在しないパスもしばらく覚えているので、同じパスへの404はlstat()せずに返せる
+    info->stat = stat_cache_get(info->path);
+    if (!info->stat->ok) return info;
     info->ok = 1;
-    info->size = st.st_size;
+    info->size = info->stat->st.st_size;
+    info->st = info->stat->st;
+    mime = guess_content_type(info);
+    info->type = mime->type;
+    info->compressible = mime->compressible;
     return info;
 }
 
 /**
- * 指定のフルパスを格納したメモリアドレスのポインタを返す
+ * 指定のフルパスを格納したメモリアドレスのポインタを返す
+ * 
+ **/
+static char * build_fspath(char *docroot, char *urlpath)
+{
+    char *path;
+
+    path = xmalloc(strlen(docroot)+1+strlen(urlpath)+1);
+    sprintf(path, "%s/%s", docroot, urlpath);
+
+    return path;
+}
+
+/**
+ * ソケットsockから受け取った内容を
+ * HTTPRequestの構造に格納し、
+ * docrootに流して、同じソケットに出力する
+ * 終わったらソケットを閉じる。
+ **/
+static void service(int sock, struct sockaddr *addr, char *docroot)
+{
+    struct Connection conn;
+    struct timeval tv;
+    struct timespec t0;
+    ssize_t n;
+    int ret;
+
+    // 次のリクエストをkeepalive_timeout秒以上待たないようにする。
+    // パイプライン化されたリクエストは受信バッファに既にあるので待たずに解析できる。
+    // 1つの接続しか扱わないのでタイマーホイールは使わず、ソケットのタイムアウトで済ませる。
+    tv.tv_sec = keepalive_timeout;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    // 受け取らない相手への送信でプロセスが止まったままにならないようにする
+    tv.tv_sec = SEND_TIMEOUT;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    if (metrics) clock_gettime(CLOCK_MONOTONIC, &t0);
+    init_connection(&conn, sock, addr);
+    if (metrics) conn_accepted(&t0);
+    for (;;) {
+        // 受信済みの分を解析し、足りなければ続きを待つ
+        ret = conn_parse(&conn, docroot);
+        if (ret == 0) {
+            // 相手の切断やタイムアウトで読めなければ終わる
+            // ヘッダを少しずつ送ってくる相手は受信のたびにタイムアウトが延びるので、最初のバイトからの時間でも打ち切る
+            if (conn.state == CONN_REQUEST && conn.inlen > 0 && timer_clock() >= conn.header_deadline) {
+                n = -1;
+                errno = EAGAIN;
+            }
+            else {
+                // バックエンドがボディを受け取りきれていなければ、送れるまで次を読まない
+                if (backend_paused_p(&conn)) backend_drain(&conn);
+                n = conn_read(&conn);
+            }
+            if (n > 0) continue;
+            // リクエストの途中でタイムアウトした場合は408を返す
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && conn_pending(&conn)) {
+                conn_error(&conn, ERROR_408);
+                conn_write(&conn);
+            }
+            break;
+        }
+        // ブロッキングのソケットなので、conn_write()は送り終えるかエラーになるまで戻らない
+        if (ret < 0)
+            conn_error(&conn, conn.error);
+        else
+            conn_respond(&conn, docroot);
+        if (conn.state == CONN_BACKEND)
+            backend_wait(&conn, docroot);
+        // 上流とのやり取りは、上流のソケットで読み書きできるようになるのを待ちながら進める
+        while (conn.state == CONN_PROXY) {
+            proxy_wait(&conn);
+            if (proxy_pump(&conn)) conn_output(&conn, docroot);
+        }
+        while ((ret = conn_write(&conn)) == 0 && conn.res.proxy)
+            proxy_wait(&conn);
+        if (ret <= 0) break;
+        if (!conn.keep_alive) break;
+        // リクエストに使ったメモリはまとめて捨て、次のリクエストで使い直す
+        conn_reset(&conn);
+    }
+    release_connection(&conn);
+}
+
+/**
+ * signalを捕捉してハンドリングするための処理
+ * signalはカーネルや端末からプロセスへ何かを通知するための手段。
+ * いくつかの種類がありそれぞれマクロで名前がつけられているが実体はint型の整数である。
+ **/
+
+/**
+ * signal捕捉を有効化する
+ * 
+ **/
+static void install_signal_handlers(void)
+{
+    trap_signal(SIGPIPE, signal_exit);
+    detach_children();
+}
+
+/**
+ * signalを受け取って実際にそれをハンドリングする
+ * 
+ **/
+static void trap_signal(int sig, sighandler_t handler)
+{
+    struct sigaction act;
+    
+    act.sa_handler = handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if(sigaction(sig, &act, NULL)<0){
+        log_exit("sigaction() failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * 子プロセスの停止・終了時の挙動を設定する
+ * 
+ **/
+static void detach_children(void)
+{
+    struct sigaction act;
+
+    // no operation 何もしない関数をハンドラとして登録する
+    act.sa_handler = noop_handler;
+    sigemptyset(&act.sa_mask);
+    // SA_NOCLDWAITによって子プロセス終了時にwait()を行わないということをカーネルに伝える。
+    // これによって親のために子プロセスの終了時ステータスをカーネルが保持し続ける子のゾンビ化を防ぐことができる。
+    act.sa_flags = SA_RESTART | SA_NOCLDWAIT;
+    // 子プロセスが停止あるいは終了した際に生成される
+    if (sigaction(SIGCHLD, &act, NULL) < 0) {
+        log_exit("sigaction() failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * 子プロセスの終了を親がwait()で受け取れるようにする
+ * ワーカープールの親プロセスは自分で子をwait()するのでdetach_children()の代わりにこちらを使う。
+ **/
+static void watch_children(void)
+{
+    struct sigaction act;
+
+    act.sa_handler = SIG_DFL;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &act, NULL) < 0) {
+        log_exit("sigaction() failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * ワーカープールの終了要求を記録する
+ * 
+ **/
+static void pool_terminate(int sig)
+{
+    pool_terminating = 1;
+}
+
+/**
+ * no operation 何もしない関数
+ * 
+ **/
+static void noop_handler(int sig)
+{
+    ;
+}
+
+/**
+ * signalの種別を受け取ってlogを出力してからexitする
+ * 
+ **/
+static void signal_exit(int sig)
+{
+    log_exit("exit by signal %d", sig);
+}
+
+/**
+ * malloc()を安全に呼び出す
+ * 
+ **/
+static void* xmalloc(size_t sz)
+{
+    void *p;
+
+    p = malloc(sz);
+    if (!p){
+        // 失敗時はexitするので呼び出す際のエラーチェックが不要
+        log_exit("failed to allocate memory.");
+    }
+    
+    return p;
+}
+
+/**
+ * アリーナからszバイトの領域を割り当てる
+ * 現在のブロックの続きを切り出すだけなので速い。ブロックが足りなくなったら次のブロックに移る。
+ **/
+static void* arena_alloc(struct Arena *arena, size_t sz)
+{
+    struct ArenaBlock *b;
+    void *p;
+
+    // ポインタやlongを置いても問題ないように揃える
+    sz = (sz + 15) & ~(size_t)15;
+    // ボディのような大きな領域は専用のブロックにする
+    if (sz > ARENA_BLOCK_SIZE / 2) {
+        b = xmalloc(sizeof(struct ArenaBlock) + sz);
+        b->size = sz;
+        b->next = arena->large;
+        arena->large = b;
+        return b->data;
+    }
+    if (!arena->current || arena->used + sz > arena->current->size) {
+        // リセット前に確保したブロックが残っていればそれを使い直す
+        b = arena->current ? arena->current->next : arena->first;
+        if (!b) {
+            b = xmalloc(sizeof(struct ArenaBlock) + ARENA_BLOCK_SIZE);
+            b->size = ARENA_BLOCK_SIZE;
+            b->next = NULL;
+            if (arena->current) arena->current->next = b;
+            else arena->first = b;
+        }
+        arena->current = b;
+        arena->used = 0;
+    }
+    p = arena->current->data + arena->used;
+    arena->used += sz;
+    return p;
+}
+
+/**
+ * アリーナから割り当てた領域を全て捨てる
+ * ブロックは解放せずに次回に使い直すので、通常は定数時間で終わる。
+ **/
+static void arena_reset(struct Arena *arena)
+{
+    struct ArenaBlock *b;
+
+    while ((b = arena->large)) {
+        arena->large = b->next;
+        free(b);
+    }
+    arena->current = arena->first;
+    arena->used = 0;
+}
+
+/**
+ * アリーナが持つ全てのブロックを解放する
  * 
  **/
-static char * build_fspath(char *docroot, char *urlpath)
+static void arena_destroy(struct Arena *arena)
 {
-    char *path;
+    struct ArenaBlock *b;
 
-    path = xmalloc(strlen(docroot)+1+strlen(urlpath)+1);
-    sprintf(path, "%s/%s", docroot, urlpath);
+    arena_reset(arena);
+    while ((b = arena->first)) {
+        arena->first = b->next;
+        free(b);
+    }
+    arena->current = NULL;
+}
 
-    return path;
+static void free_fileinfo(struct FileInfo *info)
+{
+    // 中身からfree()する
+    if (info->cache_key != info->path) free(info->cache_key);
+    stat_cache_release(info->stat);
+    free(info->path);
+    free(info);
+}
+
+static const struct MimeType* guess_content_type(struct FileInfo *info)
+{
+    const char *name, *ext;
+
+    // 拡張子はファイル名の最後の'.'より後ろ。ディレクトリ名の'.'や隠しファイルの先頭の'.'は見ない
+    name = strrchr(info->path, '/');
+    name = name ? name + 1 : info->path;
+    ext = strrchr(name, '.');
+    if (!ext || ext == name) return &default_mime_type;
+    ext++;
+    return lookup_mime_type(ext, strlen(ext));
 }
 
 /**
- * inから受け取ったストリームの内容を
- * HTTPRequestの構造に格納し、
- * docrootに流して、outのストリームに出力する
+ * 拡張子からContent-Typeを引くハッシュ表を作る
+ * fileを指定した場合はmime.types形式のファイルを読み込み、組み込みの対応表より優先する。
+ **/
+static void setup_mime_types(const char *file)
+{
+    int i;
+
+    if (file) load_mime_types(file);
+    for (i = 0; i < (int)(sizeof builtin_mime_types / sizeof builtin_mime_types[0]); i++) {
+        add_mime_type(builtin_mime_types[i].ext, strlen(builtin_mime_types[i].ext), builtin_mime_types[i].type);
+    }
+}
+
+/**
+ * mime.types形式("type ext1 ext2 ..."の行が並び、#以降はコメント)のファイルを読み込む
  * 
  **/
-static void service(FILE *in, FILE *out, char *docroot)
+static void load_mime_types(const char *file)
 {
-    struct HTTPRequest *req;
+    FILE *f;
+    char line[LINE_BUF_SIZE];
+    char *p, *type, *ext;
 
-    // ストリームをリクエストとして受け取り、パースして構造体を取得する。
-    req = read_request(in);
-    respond_to(req, out, docroot);
-    free_request(req);
+    f = fopen(file, "r");
+    if (!f) log_exit("failed to open %s: %s", file, strerror(errno));
+    while (fgets(line, sizeof line, f)) {
+        if ((p = strchr(line, '#'))) *p = '\0';
+        type = strtok_r(line, " \t\r\n", &p);
+        if (!type) continue;
+        // 表は作った後に書き換えないので、文字列は解放しない
+        type = strdup(type);
+        if (!type) log_exit("failed to allocate memory");
+        while ((ext = strtok_r(NULL, " \t\r\n", &p))) {
+            add_mime_type(ext, strlen(ext), type);
+        }
+    }
+    fclose(f);
 }
 
 /**
- * signalを捕捉してハンドリングするための処理
- * signalはカーネルや端末からプロセスへ何かを通知するための手段。
- * いくつかの種類がありそれぞれマクロで名前がつけられているが実体はint型の整数である。
+ * 拡張子extにtypeを対応させる。既に登録済みの拡張子は上書きしない
+ * 
+ **/
+static void add_mime_type(const char *ext, size_t len, const char *type)
+{
+    struct MimeType *m;
+    char *key;
+    uint32_t h;
+
+    if (len == 0 || len >= MIME_EXT_MAX) return;
+    if (lookup_mime_type(ext, len) != &default_mime_type) return;
+    // 負荷率を1/2以下に保ち、探索が必ず空きで止まるようにする
+    if (n_mime_types >= MIME_TABLE_SIZE / 2)
+        log_exit("too many MIME types (max %d)", MIME_TABLE_SIZE / 2);
+    key = xmalloc(len + 1);
+    memcpy(key, ext, len);
+    key[len] = '\0';
+    http_downcase(key, len);
+    h = hash_extension(key, len);
+    for (m = &mime_table[h & (MIME_TABLE_SIZE - 1)]; m->ext; m = &mime_table[++h & (MIME_TABLE_SIZE - 1)])
+        ;
+    m->ext = key;
+    m->type = type;
+    m->compressible = compressible_type_p(type);
+    n_mime_types++;
+}
+
+/**
+ * 拡張子(大文字小文字を区別しない)に対応するMIMEタイプを返す。なければdefault_mime_typeを返す
+ * リクエストごとに呼ばれるのでメモリを確保しない。
  **/
+static const struct MimeType* lookup_mime_type(const char *ext, size_t len)
+{
+    const struct MimeType *m;
+    char key[MIME_EXT_MAX];
+    uint32_t h;
+
+    if (len == 0 || len >= MIME_EXT_MAX) return &default_mime_type;
+    memcpy(key, ext, len);
+    http_downcase(key, len);
+    h = hash_extension(key, len);
+    for (m = &mime_table[h & (MIME_TABLE_SIZE - 1)]; m->ext; m = &mime_table[++h & (MIME_TABLE_SIZE - 1)]) {
+        if (strncmp(m->ext, key, len) == 0 && m->ext[len] == '\0') return m;
+    }
+    return &default_mime_type;
+}
 
 /**
- * signal捕捉を有効化する
+ * 小文字にした拡張子のハッシュ値(FNV-1a)を計算する
  * 
  **/
-static void install_signal_handlers(void)
+static uint32_t hash_extension(const char *ext, size_t len)
 {
-    trap_signal(SIGPIPE, signal_exit);
-    detach_children();
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)ext[i];
+        h *= 16777619u;
+    }
+    return h;
 }
 
 /**
- * signalを受け取って実際にそれをハンドリングする
+ * ログを出力し退場する
  * 
  **/
-static void trap_signal(int sig, sighandler_t handler)
+static void log_exit(const char *fmt, ...)
 {
-    struct sigaction act;
-    
-    act.sa_handler = handler;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = SA_RESTART;
-    if(sigaction(sig, &act, NULL)<0){
-        log_exit("sigaction() failed: %s", strerror(errno));
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (debug_mode) {
+        // vfprintf()はva_listを渡すことのできるfprintf()
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
     }
+    else {
+        // vsyslog()はva_listを渡すことのできるsyslog()
+        vsyslog(LOG_ERR, fmt, ap);
+    }
+    va_end(ap);
+    exit(1);
 }
 
 /**
- * 子プロセスの停止・終了時の挙動を設定する
+ * 受け付けた接続を数え、t0からの所要時間を記録する
  * 
  **/
-static void detach_children(void)
+static void conn_accepted(struct timespec *t0)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record_stage(STAGE_ACCEPT, t0, &now);
+    metric_add(&metrics->connections, 1);
+    __atomic_fetch_add(&metrics->active, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * 送り終えた(あるいは送るのをやめた)レスポンスを計測値とアクセスログに記録する
+ * 
+ **/
+static void conn_finish(struct Connection *conn)
+{
+    struct timespec now;
+
+    if (conn->res.status == 0) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (metrics) {
+        metric_add(&metrics->requests, 1);
+        metric_add(&metrics->bytes, conn->res.sent);
+        if (conn->res.status < 600) metric_add(&metrics->status[conn->res.status], 1);
+        // 408のように受信し始めていないリクエストの分は記録しない
+        if (conn->req) {
+            record_stage(STAGE_READ, &conn->request_start, &conn->started);
+            record_stage(STAGE_TOTAL, &conn->request_start, &now);
+        }
+        record_stage(STAGE_SEND, &conn->ready, &now);
+    }
+    if (log_ring) log_access(conn, &now);
+}
+
+/**
+ * ワーカーごとの計測値の領域を用意する
+ * 
+ **/
+static void setup_metrics(void)
+{
+    n_metrics = n_workers > 0 ? n_workers : 1;
+    all_metrics = mmap(NULL, sizeof(struct Metrics) * n_metrics, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (all_metrics == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+    metrics = &all_metrics[0];
+}
+
+/**
+ * カウンタにnを足す
+ * 接続ごとにfork()する場合は複数のプロセスが同じ領域に書き込むので、常に原子的に足す。
+ **/
+static void metric_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * fromからtoまでの所要時間をstageの分布に加える
+ * 
+ **/
+static void record_stage(enum Stage stage, struct timespec *from, struct timespec *to)
+{
+    struct Histogram *h = &metrics->stages[stage];
+    int64_t ns;
+
+    ns = (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+    if (ns < 0) ns = 0;
+    metric_add(&h->count, 1);
+    metric_add(&h->sum, ns);
+    metric_add(&h->buckets[histogram_index(ns)], 1);
+}
+
+/**
+ * nsが入るバケットの番号を返す
+ * 2^HIST_SUB_BITS未満はそのまま、それ以上は最上位ビットの位置と続くHIST_SUB_BITSビットで決まる。
+ **/
+static int histogram_index(uint64_t ns)
+{
+    int e, idx;
+
+    if (ns < (1 << HIST_SUB_BITS)) return ns;
+    e = 63 - __builtin_clzll(ns);
+    idx = ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((ns >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/**
+ * バケットidxに入る最大の値を返す
+ * 
+ **/
+static uint64_t histogram_upper(int idx)
 {
+    int e, m;
+
+    if (idx < (1 << HIST_SUB_BITS)) return idx;
+    e = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    m = idx & ((1 << HIST_SUB_BITS) - 1);
+    return ((uint64_t)((1 << HIST_SUB_BITS) + m + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+/**
+ * 全てのワーカーの計測値を合計し、Prometheusのテキスト形式で返す
+ * 分布はスクレイプごとにleの組が変わらないよう、2のべき乗の区切り(2^HIST_SUB_BITSバケットごと)を
+ * 値の有無にかかわらず全て累積で出力する。最後のバケットは上限がないので"+Inf"にだけ数える。
+ * ワーカーは数え途中でも止めずに読むので、_countは個別のカウンタではなくバケットの合計にして"+Inf"とそろえる。
+ **/
+static void output_stats(struct HTTPRequest *req, struct Response *res)
+{
+    struct Metrics sum;
+    char *buf, *header;
+    size_t len = 0, hlen;
+    uint64_t cum;
+    int i, k, b;
+
+#define STATS_PRINTF(...) (len += snprintf(buf + len, len < STATS_BUF_SIZE ? STATS_BUF_SIZE - len : 0, __VA_ARGS__))
+    memset(&sum, 0, sizeof sum);
+    for (i = 0; i < n_metrics; i++) {
+        struct Metrics *m = &all_metrics[i];
+
+        sum.connections += __atomic_load_n(&m->connections, __ATOMIC_RELAXED);
+        sum.active += __atomic_load_n(&m->active, __ATOMIC_RELAXED);
+        sum.requests += __atomic_load_n(&m->requests, __ATOMIC_RELAXED);
+        sum.bytes += __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+        for (k = 0; k < 600; k++) {
+            sum.status[k] += __atomic_load_n(&m->status[k], __ATOMIC_RELAXED);
+        }
+        for (k = 0; k < N_STAGES; k++) {
+            sum.stages[k].count += __atomic_load_n(&m->stages[k].count, __ATOMIC_RELAXED);
+            sum.stages[k].sum += __atomic_load_n(&m->stages[k].sum, __ATOMIC_RELAXED);
+            for (b = 0; b < HIST_BUCKETS; b++) {
+                sum.stages[k].buckets[b] += __atomic_load_n(&m->stages[k].buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    buf = arena_alloc(res->arena, STATS_BUF_SIZE);
+    STATS_PRINTF("# TYPE httpd_connections_total counter\nhttpd_connections_total %lu\n",
+                 (unsigned long)sum.connections);
+    STATS_PRINTF("# TYPE httpd_active_connections gauge\nhttpd_active_connections %ld\n", (long)sum.active);
+    STATS_PRINTF("# TYPE httpd_requests_total counter\nhttpd_requests_total %lu\n", (unsigned long)sum.requests);
+    STATS_PRINTF("# TYPE httpd_sent_bytes_total counter\nhttpd_sent_bytes_total %lu\n", (unsigned long)sum.bytes);
+    STATS_PRINTF("# TYPE httpd_responses_total counter\n");
+    for (k = 0; k < 600; k++) {
+        if (sum.status[k])
+            STATS_PRINTF("httpd_responses_total{code=\"%d\"} %lu\n", k, (unsigned long)sum.status[k]);
+    }
+    STATS_PRINTF("# TYPE httpd_stage_duration_seconds histogram\n");
+    for (k = 0; k < N_STAGES; k++) {
+        cum = 0;
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            cum += sum.stages[k].buckets[b];
+            if (b == HIST_BUCKETS - 1 || (b & ((1 << HIST_SUB_BITS) - 1)) != (1 << HIST_SUB_BITS) - 1) continue;
+            STATS_PRINTF("httpd_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9f\"} %lu\n",
+                         stage_names[k], histogram_upper(b) / 1e9, (unsigned long)cum);
+        }
+        STATS_PRINTF("httpd_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n",
+                     stage_names[k], (unsigned long)cum);
+        STATS_PRINTF("httpd_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n",
+                     stage_names[k], sum.stages[k].sum / 1e9);
+        STATS_PRINTF("httpd_stage_duration_seconds_count{stage=\"%s\"} %lu\n",
+                     stage_names[k], (unsigned long)cum);
+    }
+#undef STATS_PRINTF
+    if (len >= STATS_BUF_SIZE) len = STATS_BUF_SIZE - 1;
+
+    output_common_header_fields(req, res, STATUS_LINE("200 OK"));
+    header = arena_alloc(res->arena, CACHE_HEADER_SIZE);
+    hlen = snprintf(header, CACHE_HEADER_SIZE,
+                    "Content-Length: %lu\r\nContent-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n\r\n",
+                    (unsigned long)len);
+    response_add(res, header, hlen);
+    if (strcmp(req->method, "HEAD") != 0) response_add(res, buf, len);
+}
+
+/**
+ * アクセスログのファイルを開き、ワーカーごとのリングを用意する
+ * SIGHUPで開き直すときにも使うので、相対パスは起動時のディレクトリを基準に絶対パスにしておく。
+ * --chrootの場合、開き直すパスはchroot後のルートからのものになる。
+ **/
+static void setup_access_log(const char *path)
+{
+    char cwd[PATH_MAX];
+    size_t size;
+
+    if (path[0] != '/') {
+        if (!getcwd(cwd, sizeof cwd)) log_exit("getcwd(3) failed: %s", strerror(errno));
+        access_log_path = xmalloc(strlen(cwd) + 1 + strlen(path) + 1);
+        sprintf(access_log_path, "%s/%s", cwd, path);
+    }
+    if (open_access_log() < 0)
+        log_exit("failed to open %s: %s", access_log_path, strerror(errno));
+    n_log_rings = n_workers > 0 ? n_workers : 1;
+    size = sizeof(struct LogRing) * n_log_rings;
+    log_rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (log_rings == MAP_FAILED) log_exit("mmap(2) failed: %s", strerror(errno));
+    // ワーカープールを使わない場合はこのプロセスか、接続ごとにfork()した子がリング0に書き込む
+    log_ring = &log_rings[0];
+    log_ring_shared = (n_workers == 0 && engine == ENGINE_BLOCKING);
+}
+
+/**
+ * access_log_pathを開いてaccess_log_fdを差し替える
+ * 開けなければ今のファイルを使い続け、-1を返す。
+ **/
+static int open_access_log(void)
+{
+    int fd;
+
+    fd = open(access_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (access_log_fd >= 0) close(access_log_fd);
+    access_log_fd = fd;
+    return 0;
+}
+
+/**
+ * リングの中身をファイルに書き出すロガープロセスを作成する
+ * 
+ **/
+static pid_t start_logger(void)
+{
+    pid_t parent = getpid();
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (pid == 0) {
+        logger_main(parent);
+        exit(0);
+    }
+    return pid;
+}
+
+/**
+ * ロガープロセスの本体
+ * 一定間隔で全てのワーカーのリングを見て回り、溜まった行を1回のwritev(2)でまとめて書き出す。
+ * SIGHUPでファイルを開き直し(ログのローテーション用)、親が終了したら残りを書き出してから終わる。
+ **/
+static void logger_main(pid_t parent)
+{
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
     struct sigaction act;
+    uint64_t dropped, reported = 0;
+    int i;
 
-    // no operation 何もしない関数をハンドラとして登録する
-    act.sa_handler = noop_handler;
+    // 親が先に終了してもSIGTERMで知らせてもらう
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
+        log_exit("prctl(2) failed: %s", strerror(errno));
+    // prctl()より前に親が終了していた場合
+    if (getppid() != parent) logger_terminating = 1;
+    signal(SIGINT, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    // nanosleep()を中断させたいのでSA_RESTARTは付けない
+    act.sa_handler = logger_hup;
     sigemptyset(&act.sa_mask);
-    // SA_NOCLDWAITによって子プロセス終了時にwait()を行わないということをカーネルに伝える。
-    // これによって親のために子プロセスの終了時ステータスをカーネルが保持し続ける子のゾンビ化を防ぐことができる。
-    act.sa_flags = SA_RESTART | SA_NOCLDWAIT;
-    // 子プロセスが停止あるいは終了した際に生成される
-    if (sigaction(SIGCHLD, &act, NULL) < 0) {
+    act.sa_flags = 0;
+    if (sigaction(SIGHUP, &act, NULL) < 0)
+        log_exit("sigaction() failed: %s", strerror(errno));
+    act.sa_handler = logger_term;
+    if (sigaction(SIGTERM, &act, NULL) < 0)
         log_exit("sigaction() failed: %s", strerror(errno));
+
+    for (;;) {
+        // 開き直す前の行は前のファイルに書き出す
+        if (flush_access_log() == 0 && !logger_reopen && !logger_terminating)
+            nanosleep(&interval, NULL);
+        if (logger_reopen) {
+            logger_reopen = 0;
+            if (open_access_log() < 0)
+                log_warn("failed to reopen %s: %s", access_log_path, strerror(errno));
+        }
+        if (logger_terminating) {
+            flush_access_log();
+            return;
+        }
+        for (i = 0, dropped = 0; i < n_log_rings; i++) {
+            dropped += __atomic_load_n(&log_rings[i].dropped, __ATOMIC_RELAXED);
+        }
+        if (dropped != reported) {
+            log_warn("access log: dropped %lu entries", (unsigned long)(dropped - reported));
+            reported = dropped;
+        }
     }
 }
 
 /**
- * no operation 何もしない関数
+ * 全てのリングに溜まっている行を書き出し、書き出したバイト数を返す
  * 
  **/
-static void noop_handler(int sig)
+static size_t flush_access_log(void)
 {
-    ;
+    struct iovec iov[MAX_WORKERS * 2];
+    uint64_t head[MAX_WORKERS], tail[MAX_WORKERS];
+    size_t total = 0, off, len;
+    ssize_t n;
+    int i, cnt = 0, first;
+
+    for (i = 0; i < n_log_rings; i++) {
+        head[i] = log_rings[i].head;
+        tail[i] = __atomic_load_n(&log_rings[i].tail, __ATOMIC_ACQUIRE);
+        if (head[i] == tail[i]) continue;
+        // 末尾で折り返していれば2つに分ける
+        off = head[i] & (LOG_RING_SIZE - 1);
+        len = tail[i] - head[i];
+        iov[cnt].iov_base = log_rings[i].buf + off;
+        iov[cnt].iov_len = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+        cnt++;
+        if (len > LOG_RING_SIZE - off) {
+            iov[cnt].iov_base = log_rings[i].buf;
+            iov[cnt].iov_len = len - (LOG_RING_SIZE - off);
+            cnt++;
+        }
+        total += len;
+    }
+    for (first = 0; first < cnt; ) {
+        n = writev(access_log_fd, iov + first, cnt - first);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // 書き出せないものは捨てる。ワーカーを止めないことを優先する
+            log_warn("failed to write access log: %s", strerror(errno));
+            break;
+        }
+        while (first < cnt && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < cnt) {
+            iov[first].iov_base = (char*)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    for (i = 0; i < n_log_rings; i++) {
+        __atomic_store_n(&log_rings[i].head, tail[i], __ATOMIC_RELEASE);
+    }
+    return total;
 }
 
 /**
- * signalの種別を受け取ってlogを出力してからexitする
+ * ロガーにファイルを開き直すよう記録する
  * 
  **/
-static void signal_exit(int sig)
+static void logger_hup(int sig)
 {
-    log_exit("exit by signal %d", sig);
+    logger_reopen = 1;
 }
 
 /**
- * malloc()を安全に呼び出す
+ * ロガーに終了するよう記録する
  * 
  **/
-static void* xmalloc(size_t sz)
+static void logger_term(int sig)
 {
-    void *p;
+    logger_terminating = 1;
+}
 
-    p = malloc(sz);
-    if (!p){
-        // 失敗時はexitするので呼び出す際のエラーチェックが不要
-        log_exit("failed to allocate memory.");
-    }
-    
-    return p;
+/**
+ * 受け取ったSIGHUPをロガーに伝える
+ * 
+ **/
+static void forward_hup(int sig)
+{
+    if (logger_pid > 0) kill(logger_pid, SIGHUP);
 }
 
-static void free_fileinfo(struct FileInfo *info)
+/**
+ * 送り終えた(あるいは送るのをやめた)レスポンスを1行に整形し、このプロセスのリングに書き込む
+ * --log-formatの%a(接続元)、%t(時刻)、%m(メソッド)、%U(パス)、%s(ステータス)、
+ * %b(送信したバイト数)、%D(レスポンスを組み立て始めてから送り終えるまでのマイクロ秒)を置き換える。
+ **/
+static void log_access(struct Connection *conn, struct timespec *now)
 {
-    // 中身からfree()する
-    free(info->path);
-    free(info);
+    static time_t log_time = 0;
+    static char log_time_buf[TIME_BUF_SIZE];
+    struct HTTPRequest *req = conn->req;
+    struct tm tm;
+    char line[LOG_LINE_MAX];
+    char *p = line, *end = line + LOG_LINE_MAX - 1;
+    const char *f;
+    long usec;
+
+    usec = (now->tv_sec - conn->started.tv_sec) * 1000000L + (now->tv_nsec - conn->started.tv_nsec) / 1000;
+    for (f = log_format; *f && p < end; f++) {
+        if (*f != '%' || f[1] == '\0') {
+            *p++ = *f;
+            continue;
+        }
+        switch (*++f) {
+        case 'a':
+            p = log_escape(p, end, conn->peer);
+            break;
+        case 't':
+            // 時刻の文字列は1秒に1回だけ作り直す
+            if (log_time != time(NULL)) {
+                log_time = time(NULL);
+                localtime_r(&log_time, &tm);
+                strftime(log_time_buf, sizeof log_time_buf, "%d/%b/%Y:%H:%M:%S %z", &tm);
+            }
+            p = log_escape(p, end, log_time_buf);
+            break;
+        case 'm':
+            p = log_escape(p, end, req ? req->method : "-");
+            break;
+        case 'U':
+            p = log_escape(p, end, req ? req->path : "-");
+            break;
+        case 's':
+            p += snprintf(p, end - p, "%d", conn->res.status);
+            break;
+        case 'b':
+            p += snprintf(p, end - p, "%lu", (unsigned long)conn->res.sent);
+            break;
+        case 'D':
+            p += snprintf(p, end - p, "%ld", usec);
+            break;
+        default:
+            *p++ = *f;
+            break;
+        }
+        if (p > end) p = end;
+    }
+    *p++ = '\n';
+    log_ring_put(log_ring, line, p - line);
 }
 
-static char* guess_content_type(struct FileInfo *info)
+/**
+ * strをpに書き込む。'"'と'\'と制御文字はエスケープし、JSONの中に置いても壊れないようにする
+ * endを越えては書かない。
+ **/
+static char* log_escape(char *p, char *end, const char *str)
 {
-    return "text/plain";   /* FIXME */
+    unsigned char c;
+
+    for (; *str && p < end; str++) {
+        c = *str;
+        if (c == '"' || c == '\\') {
+            if (end - p < 2) break;
+            *p++ = '\\';
+            *p++ = c;
+        }
+        else if (c < 0x20 || c == 0x7f) {
+            if (end - p < 6) break;
+            p += sprintf(p, "\\u%04x", c);
+        }
+        else {
+            *p++ = c;
+        }
+    }
+    return p;
 }
 
 /**
- * ログを出力しexitする
- * 
+ * リングにlenバイトを書き込む。空きがなければ捨てて数だけ数える
+ * 1つのプロセスだけが書き込むリングではロックを取らない。
  **/
-static void log_exit(char *fmt, ...)
+static void log_ring_put(struct LogRing *ring, const char *data, size_t len)
 {
-    va_list ap;
+    uint64_t tail;
+    size_t off, first;
 
-    va_start(ap, fmt);
-    // vfprintf()はva_listを渡すことのできるfprintf
-    vfprintf(stderr, fmt, ap);
-    fputc('\n', stderr);
-    va_end(ap);
-    exit(1);
+    if (log_ring_shared) {
+        while (__atomic_test_and_set(&ring->lock, __ATOMIC_ACQUIRE))
+            ;
+    }
+    tail = ring->tail;
+    if (tail + len - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > LOG_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        off = tail & (LOG_RING_SIZE - 1);
+        first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+        memcpy(ring->buf + off, data, first);
+        memcpy(ring->buf, data + first, len - first);
+        // 中身を書き終えてからロガーに見せる
+        __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    }
+    if (log_ring_shared) __atomic_clear(&ring->lock, __ATOMIC_RELEASE);
 }
 
 /**
- * ログを出力し退場する
+ * 処理は続けられるが知らせておきたいことを出力する
  * 
  **/
-static void log_exit(const char *fmt, ...)
+static void log_warn(const char *fmt, ...)
 {
     va_list ap;
 
     va_start(ap, fmt);
     if (debug_mode) {
-        // vfprintf()はva_listを渡すことのできるfprintf()
         vfprintf(stderr, fmt, ap);
         fputc('\n', stderr);
     }
     else {
-        // vsyslog()はva_listを渡すことのできるsyslog()
-        vsyslog(LOG_ERR, fmt, ap);
+        vsyslog(LOG_WARNING, fmt, ap);
     }
     va_end(ap);
-    exit(1);
 }
@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/**
+ * httpd2(とhttpd)のための負荷生成ツール
+ * 1つのプロセスがepollで多数の接続を同時に扱い、スループットとレイテンシの分布を報告する。
+ * --rateを指定すると一定間隔でリクエストを発行する開ループになり、予定時刻からの遅れもレイテンシに含める。
+ * (応答が遅れると次の送信も遅れる閉ループでは、遅い時間帯のリクエストが少なく数えられてしまう)
+ **/
+
+#define MAX_PATHS 32
+#define MAX_EVENTS 256
+#define BUF_SIZE (64 * 1024)
+#define REQUEST_SIZE 1024
+#define HIST_SUB_BITS 3 // 2のべき乗の区間をさらに2^HIST_SUB_BITSに分ける(誤差は12.5%以内)
+#define HIST_BUCKETS 304 // 2^40ナノ秒(約18分)まで
+
+#define USAGE "Usage: %s [--connections=n] [--duration=sec] [--rate=req/s] [--close] [--mix=path[:weight],...] <host> <port>\n"
+
+// 接続の状態
+enum ConnState
+{
+    CONN_IDLE, // 次のリクエストを待っている(開ループのみ)
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_RECEIVING
+};
+
+struct Target
+{
+    char *path;
+    int weight;
+    char request[REQUEST_SIZE];
+    size_t request_len;
+};
+
+struct Conn
+{
+    int fd;
+    enum ConnState state;
+    struct Target *target;
+    size_t sent; // 送信済みのリクエストのバイト数
+    char buf[BUF_SIZE]; // ヘッダを受け取るバッファ。ボディは読み捨てる
+    size_t buflen;
+    long body_remain; // ボディの残り。ヘッダを読み終えるまでは-1
+    int server_close; // サーバがConnection: closeを返した
+    int64_t start; // レイテンシの起点(ナノ秒)。開ループでは発行を予定していた時刻
+    struct Conn *next_idle;
+};
+
+struct Histogram
+{
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static void parse_mix(char *mix);
+static struct Target* pick_target(void);
+static void start_connect(struct Conn *c);
+static void start_request(struct Conn *c, int64_t start);
+static void handle_event(struct Conn *c, uint32_t events);
+static int do_send(struct Conn *c);
+static int do_recv(struct Conn *c);
+static void finish_request(struct Conn *c);
+static void fail_request(struct Conn *c);
+static void watch(struct Conn *c, uint32_t events, int op);
+static int64_t now_ns(void);
+static void record(struct Histogram *h, uint64_t ns);
+static int histogram_index(uint64_t ns);
+static uint64_t histogram_upper(int idx);
+static uint64_t percentile(struct Histogram *h, double p);
+static void report(int64_t elapsed);
+static void log_exit(const char *fmt, ...);
+
+static struct option longopts[] = {
+    {"connections", required_argument, NULL, 'c'},
+    {"duration", required_argument, NULL, 'd'},
+    {"rate", required_argument, NULL, 'r'},
+    {"close", no_argument, NULL, 'k'},
+    {"mix", required_argument, NULL, 'm'},
+    {"help", no_argument, NULL, 'h'},
+    {0, 0, 0, 0}
+};
+
+static int n_conns = 50;
+static int duration = 10;
+static double rate = 0; // 0なら閉ループ
+static int keep_alive = 1;
+static char *host;
+static struct Target targets[MAX_PATHS];
+static int n_targets = 0;
+static int total_weight = 0;
+static struct addrinfo *server_addr;
+static int epfd;
+static struct Conn *idle_conns = NULL;
+static int stopping = 0; // 測定時間が過ぎたら新しいリクエストを発行しない
+static uint64_t n_requests = 0;
+static uint64_t n_errors = 0;
+static uint64_t n_bytes = 0;
+static uint64_t n_backlog_max = 0; // 開ループで空いている接続を待ったリクエストの最大数
+static struct Histogram latency;
+static unsigned int seed = 1;
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints;
+    struct epoll_event events[MAX_EVENTS];
+    struct Conn *conns;
+    char mix_default[] = "/";
+    char *mix = mix_default;
+    int64_t t0, now, end, next_due = 0, interval = 0;
+    uint64_t backlog = 0;
+    int opt, err, i, n, timeout;
+
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            n_conns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'k':
+            keep_alive = 0;
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'h':
+            fprintf(stdout, USAGE, argv[0]);
+            exit(0);
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 2 || n_conns < 1 || duration < 1 || rate < 0) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+    host = argv[optind];
+    parse_mix(mix);
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, argv[optind + 1], &hints, &server_addr)) != 0)
+        log_exit("getaddrinfo(3): %s", gai_strerror(err));
+    signal(SIGPIPE, SIG_IGN);
+    epfd = epoll_create1(0);
+    if (epfd < 0) log_exit("epoll_create1(2) failed: %s", strerror(errno));
+
+    conns = calloc(n_conns, sizeof(struct Conn));
+    if (!conns) log_exit("failed to allocate memory");
+    t0 = now_ns();
+    end = t0 + (int64_t)duration * 1000000000L;
+    for (i = 0; i < n_conns; i++) {
+        conns[i].fd = -1;
+        if (rate > 0) {
+            conns[i].state = CONN_IDLE;
+            conns[i].next_idle = idle_conns;
+            idle_conns = &conns[i];
+        }
+        else {
+            start_request(&conns[i], t0);
+        }
+    }
+    if (rate > 0) {
+        interval = (int64_t)(1e9 / rate);
+        next_due = t0;
+    }
+
+    for (;;) {
+        now = now_ns();
+        if (now >= end) stopping = 1;
+        // 開ループでは予定時刻を過ぎたリクエストを空いている接続に割り当てる。
+        // 空きがなければ待たせるが、レイテンシの起点は予定時刻のまま
+        if (rate > 0 && !stopping) {
+            while (next_due <= now) {
+                backlog++;
+                next_due += interval;
+            }
+            if (backlog > n_backlog_max) n_backlog_max = backlog;
+            while (backlog > 0 && idle_conns) {
+                struct Conn *c = idle_conns;
+
+                idle_conns = c->next_idle;
+                start_request(c, next_due - (int64_t)backlog * interval);
+                backlog--;
+            }
+        }
+        if (stopping) {
+            // 送信中のものが終わるのを待つが、いつまでも待たない
+            for (i = 0; i < n_conns; i++) {
+                if (conns[i].state != CONN_IDLE) break;
+            }
+            if (i == n_conns || now >= end + 5000000000L) break;
+        }
+        timeout = 100;
+        if (rate > 0 && !stopping) {
+            timeout = (next_due - now) / 1000000;
+            if (timeout < 0) timeout = 0;
+            if (timeout > 100) timeout = 100;
+        }
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_exit("epoll_wait(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++) {
+            handle_event(events[i].data.ptr, events[i].events);
+        }
+    }
+    report(now_ns() - t0);
+    exit(n_requests > 0 ? 0 : 1);
+}
+
+/**
+ * "/a.html:80,/b.bin:20"のようなパスと重みの一覧を読み込み、リクエストを組み立てておく
+ *
+ **/
+static void parse_mix(char *mix)
+{
+    char *item, *colon, *save;
+    struct Target *t;
+
+    for (item = strtok_r(mix, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (n_targets == MAX_PATHS) log_exit("too many paths (max %d)", MAX_PATHS);
+        t = &targets[n_targets++];
+        t->weight = 1;
+        if ((colon = strchr(item, ':'))) {
+            *colon = '\0';
+            t->weight = atoi(colon + 1);
+            if (t->weight < 1) log_exit("invalid weight: %s", colon + 1);
+        }
+        t->path = item;
+        t->request_len = snprintf(t->request, REQUEST_SIZE,
+                                  "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\nConnection: %s\r\n\r\n",
+                                  t->path, host, keep_alive ? "keep-alive" : "close");
+        if (t->request_len >= REQUEST_SIZE) log_exit("path too long: %s", t->path);
+        total_weight += t->weight;
+    }
+    if (n_targets == 0) log_exit("no paths given");
+}
+
+/**
+ * 重みに従ってパスを1つ選ぶ
+ *
+ **/
+static struct Target* pick_target(void)
+{
+    int r, i;
+
+    if (n_targets == 1) return &targets[0];
+    r = rand_r(&seed) % total_weight;
+    for (i = 0; r >= targets[i].weight; i++)
+        r -= targets[i].weight;
+    return &targets[i];
+}
+
+/**
+ * ノンブロッキングで接続を始める
+ *
+ **/
+static void start_connect(struct Conn *c)
+{
+    int one = 1;
+
+    c->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) log_exit("socket(2) failed: %s", strerror(errno));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    if (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS)
+        log_exit("connect(2) failed: %s", strerror(errno));
+    c->state = CONN_CONNECTING;
+    watch(c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+/**
+ * 次のリクエストを送り始める。接続がなければ先に接続する
+ * startはレイテンシの起点。
+ **/
+static void start_request(struct Conn *c, int64_t start)
+{
+    c->target = pick_target();
+    c->sent = 0;
+    c->buflen = 0;
+    c->body_remain = -1;
+    c->server_close = 0;
+    c->start = start;
+    if (c->fd < 0) {
+        start_connect(c);
+        return;
+    }
+    c->state = CONN_SENDING;
+    if (do_send(c) < 0) fail_request(c);
+}
+
+/**
+ * 接続に起きたイベントを処理する
+ *
+ **/
+static void handle_event(struct Conn *c, uint32_t events)
+{
+    int err = 0;
+    socklen_t len = sizeof err;
+
+    switch (c->state) {
+    case CONN_CONNECTING:
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            fail_request(c);
+            return;
+        }
+        c->state = CONN_SENDING;
+        // fall through
+    case CONN_SENDING:
+        if (do_send(c) < 0) fail_request(c);
+        break;
+    case CONN_RECEIVING:
+        if (do_recv(c) < 0) fail_request(c);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * リクエストを送れるだけ送る。送り終えたら受信に移る
+ *
+ **/
+static int do_send(struct Conn *c)
+{
+    ssize_t n;
+
+    while (c->sent < c->target->request_len) {
+        n = send(c->fd, c->target->request + c->sent, c->target->request_len - c->sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(c, EPOLLOUT, EPOLL_CTL_MOD);
+                return 0;
+            }
+            return -1;
+        }
+        c->sent += n;
+    }
+    c->state = CONN_RECEIVING;
+    watch(c, EPOLLIN, EPOLL_CTL_MOD);
+    // 送った直後に届いていることが多いので待たずに読んでみる
+    return do_recv(c);
+}
+
+/**
+ * レスポンスを読めるだけ読む。Content-Lengthの分だけボディを読んだら1つ終わり
+ *
+ **/
+static int do_recv(struct Conn *c)
+{
+    char discard[BUF_SIZE];
+    char *end, *p;
+    ssize_t n;
+
+    for (;;) {
+        if (c->body_remain < 0) {
+            if (c->buflen == BUF_SIZE) return -1;
+            n = recv(c->fd, c->buf + c->buflen, BUF_SIZE - c->buflen, 0);
+        }
+        else if (c->body_remain > 0) {
+            n = recv(c->fd, discard, c->body_remain < BUF_SIZE ? c->body_remain : BUF_SIZE, 0);
+        }
+        else {
+            finish_request(c);
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) return -1;
+        n_bytes += n;
+        if (c->body_remain >= 0) {
+            c->body_remain -= n;
+            continue;
+        }
+        c->buflen += n;
+        end = memmem(c->buf, c->buflen, "\r\n\r\n", 4);
+        if (!end) continue;
+        // ステータスが2xxか304以外なら失敗として数える
+        if (c->buflen < 12 || memcmp(c->buf, "HTTP/1.", 7) != 0 || (c->buf[9] != '2' && memcmp(c->buf + 9, "304", 3) != 0))
+            return -1;
+        *end = '\0';
+        // max-requestsに達した接続はサーバが閉じるので、次は接続し直す
+        if (strcasestr(c->buf, "\r\nConnection: close")) c->server_close = 1;
+        p = strcasestr(c->buf, "\r\nContent-Length:");
+        if (!p) return -1;
+        c->body_remain = strtol(p + 17, NULL, 10);
+        // ヘッダと一緒に受け取ったボディの分を引く
+        c->body_remain -= c->buflen - (end + 4 - c->buf);
+        if (c->body_remain < 0) return -1;
+    }
+}
+
+/**
+ * レスポンスを受け取り終えた。レイテンシを記録して次のリクエストに進む
+ *
+ **/
+static void finish_request(struct Conn *c)
+{
+    n_requests++;
+    record(&latency, now_ns() - c->start);
+    if (!keep_alive || c->server_close) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (stopping) {
+        if (c->fd >= 0) {
+            close(c->fd);
+            c->fd = -1;
+        }
+        c->state = CONN_IDLE;
+    }
+    else if (rate > 0) {
+        c->state = CONN_IDLE;
+        c->next_idle = idle_conns;
+        idle_conns = c;
+    }
+    else {
+        start_request(c, now_ns());
+    }
+}
+
+/**
+ * リクエストが失敗した。接続を閉じ、作り直して続ける
+ *
+ **/
+static void fail_request(struct Conn *c)
+{
+    n_errors++;
+    close(c->fd);
+    c->fd = -1;
+    if (stopping) {
+        c->state = CONN_IDLE;
+    }
+    else if (rate > 0) {
+        c->state = CONN_IDLE;
+        c->next_idle = idle_conns;
+        idle_conns = c;
+    }
+    else {
+        // 接続できない状態が続いても空回りしないよう少し待つ
+        usleep(1000);
+        start_request(c, now_ns());
+    }
+}
+
+/**
+ * 監視するイベントを設定する
+ *
+ **/
+static void watch(struct Conn *c, uint32_t events, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, op, c->fd, &ev) < 0)
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+}
+
+/**
+ * 単調増加する時刻をナノ秒で返す
+ *
+ **/
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * nsを分布に加える
+ *
+ **/
+static void record(struct Histogram *h, uint64_t ns)
+{
+    h->count++;
+    if (ns > h->max) h->max = ns;
+    h->buckets[histogram_index(ns)]++;
+}
+
+/**
+ * nsが入るバケットの番号を返す。httpd2の/__statsと同じ区切り方
+ *
+ **/
+static int histogram_index(uint64_t ns)
+{
+    int e, idx;
+
+    if (ns < (1 << HIST_SUB_BITS)) return ns;
+    e = 63 - __builtin_clzll(ns);
+    idx = ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((ns >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/**
+ * バケットidxに入る最大の値を返す
+ *
+ **/
+static uint64_t histogram_upper(int idx)
+{
+    int e, m;
+
+    if (idx < (1 << HIST_SUB_BITS)) return idx;
+    e = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    m = idx & ((1 << HIST_SUB_BITS) - 1);
+    return ((uint64_t)((1 << HIST_SUB_BITS) + m + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+/**
+ * p(0〜1)の位置にある値の上限を返す
+ *
+ **/
+static uint64_t percentile(struct Histogram *h, double p)
+{
+    uint64_t rank, cum = 0;
+    int i;
+
+    if (h->count == 0) return 0;
+    rank = (uint64_t)(p * h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        cum += h->buckets[i];
+        if (cum > rank) break;
+    }
+    return histogram_upper(i) < h->max ? histogram_upper(i) : h->max;
+}
+
+/**
+ * 結果を表示する
+ *
+ **/
+static void report(int64_t elapsed)
+{
+    double sec = elapsed / 1e9;
+
+    printf("mode:        %s, %s, %d connections",
+           rate > 0 ? "open-loop" : "closed-loop", keep_alive ? "keep-alive" : "close", n_conns);
+    if (rate > 0) printf(", %.0f req/s target", rate);
+    printf("\n");
+    printf("requests:    %lu in %.2fs, %lu errors\n", (unsigned long)n_requests, sec, (unsigned long)n_errors);
+    printf("throughput:  %.0f req/s, %.2f MB/s\n", n_requests / sec, n_bytes / sec / (1024 * 1024));
+    printf("latency:     p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+           percentile(&latency, 0.5) / 1e3, percentile(&latency, 0.99) / 1e3,
+           percentile(&latency, 0.999) / 1e3, latency.max / 1e3);
+    if (rate > 0) printf("backlog:     %lu requests waited for a free connection at most\n", (unsigned long)n_backlog_max);
+}
+
+static void log_exit(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "backend_protocol.h"
+
+/**
+ * httpd2の--backend-commandで動かす見本のバックエンド
+ * 標準入力として渡された待ち受け用のソケットで接続を受け付け、多重化されたリクエストにepollで応える。
+ * レスポンスはプロセスID、メソッド、パス、受け取ったボディの長さとチェックサムを並べたテキスト。
+ * クエリで動きを変えられる。
+ *   ms=N      Nミリ秒待ってから応える(待つ間も他のリクエストには応えるので、応答の順番が入れ替わる)
+ *   size=N    Nバイトの詰め物をボディに加える
+ *   status=N  ステータスコードをNにする
+ **/
+
+#define MAX_EVENTS 64
+#define MAX_JOBS 4096
+#define PATH_MAX_LEN 1024
+#define TEXT_SIZE 2048
+
+// httpd2のワーカーからの1つの接続
+struct Peer
+{
+    int fd;
+    char inbuf[sizeof(struct BackendFrame) + BACKEND_FRAME_MAX];
+    size_t inlen;
+    char *outbuf;
+    size_t outpos;
+    size_t outlen;
+    size_t outsize;
+    uint32_t events;
+};
+
+// 処理中のリクエスト
+struct Job
+{
+    struct Peer *peer; // 使っていなければNULL
+    uint32_t id;
+    char method[16];
+    char path[PATH_MAX_LEN];
+    size_t body_len;
+    uint32_t sum; // ボディのAdler-32
+    int64_t due; // 応える時刻(ナノ秒)。ボディを受け取り終えるまでは0
+};
+
+static void accept_peers(void);
+static void handle_peer(struct Peer *p, uint32_t events);
+static int peer_input(struct Peer *p);
+static int peer_frame(struct Peer *p, struct BackendFrame *f, char *payload);
+static int peer_flush(struct Peer *p);
+static void peer_watch(struct Peer *p);
+static void close_peer(struct Peer *p);
+static void queue_frame(struct Peer *p, int type, uint32_t id, const void *data, size_t len);
+static struct Job* find_job(struct Peer *p, uint32_t id);
+static void run_due_jobs(void);
+static void respond(struct Job *job);
+static long query_param(const char *path, const char *name);
+static int64_t now_ns(void);
+static void log_exit(const char *fmt, ...);
+
+static int epfd;
+static struct Job jobs[MAX_JOBS];
+static int n_timed = 0; // 時刻を待っているジョブの数
+
+int main(int argc, char *argv[])
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    int64_t now, next;
+    int i, n, timeout;
+
+    // httpd2が標準入力として待ち受け用のソケットを渡す
+    if (fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK) < 0)
+        log_exit("fcntl(2) failed: %s", strerror(errno));
+    epfd = epoll_create1(0);
+    if (epfd < 0) log_exit("epoll_create1(2) failed: %s", strerror(errno));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, 0, &ev) < 0)
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+
+    for (;;) {
+        // 時刻を待っているジョブがあれば、一番早いものに間に合うように起きる
+        timeout = -1;
+        if (n_timed > 0) {
+            now = now_ns();
+            next = INT64_MAX;
+            for (i = 0; i < MAX_JOBS; i++) {
+                if (jobs[i].peer && jobs[i].due > 0 && jobs[i].due < next) next = jobs[i].due;
+            }
+            timeout = next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+        }
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_exit("epoll_wait(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < n; i++) {
+            if (!events[i].data.ptr)
+                accept_peers();
+            else
+                handle_peer(events[i].data.ptr, events[i].events);
+        }
+        run_due_jobs();
+    }
+}
+
+/**
+ * 待っている接続を全て受け付ける
+ *
+ **/
+static void accept_peers(void)
+{
+    struct epoll_event ev;
+    struct Peer *p;
+    int fd;
+
+    for (;;) {
+        fd = accept4(0, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            log_exit("accept4(2) failed: %s", strerror(errno));
+        }
+        p = calloc(1, sizeof(struct Peer));
+        if (!p) log_exit("failed to allocate memory.");
+        p->fd = fd;
+        p->events = EPOLLIN;
+        ev.events = p->events;
+        ev.data.ptr = p;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * 接続に起きたイベントを処理する
+ *
+ **/
+static void handle_peer(struct Peer *p, uint32_t events)
+{
+    if ((events & ~EPOLLOUT) && peer_input(p) < 0) {
+        close_peer(p);
+        return;
+    }
+    if (peer_flush(p) < 0) {
+        close_peer(p);
+        return;
+    }
+    peer_watch(p);
+}
+
+/**
+ * 読めるだけ読み込み、揃ったフレームを処理する
+ * 相手が閉じたか不正なフレームが届いたら-1を返す。
+ **/
+static int peer_input(struct Peer *p)
+{
+    struct BackendFrame f;
+    size_t pos;
+    ssize_t n;
+
+    for (;;) {
+        n = read(p->fd, p->inbuf + p->inlen, sizeof p->inbuf - p->inlen);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        p->inlen += n;
+        for (pos = 0; p->inlen - pos >= sizeof f; pos += sizeof f + f.len) {
+            memcpy(&f, p->inbuf + pos, sizeof f);
+            if (f.len > BACKEND_FRAME_MAX) return -1;
+            if (p->inlen - pos < sizeof f + f.len) break;
+            if (peer_frame(p, &f, p->inbuf + pos + sizeof f) < 0) return -1;
+        }
+        memmove(p->inbuf, p->inbuf + pos, p->inlen - pos);
+        p->inlen -= pos;
+    }
+}
+
+/**
+ * 届いたフレームを1つ処理する
+ *
+ **/
+static int peer_frame(struct Peer *p, struct BackendFrame *f, char *payload)
+{
+    struct Job *job = find_job(p, f->id);
+    char *name, *value, *end = payload + f->len;
+    long ms;
+    int i;
+
+    switch (f->type) {
+    case BACKEND_REQUEST:
+        if (job || f->len == 0 || end[-1] != '\0') return -1;
+        for (i = 0; i < MAX_JOBS && jobs[i].peer; i++)
+            ;
+        if (i == MAX_JOBS) return -1;
+        job = &jobs[i];
+        memset(job, 0, sizeof *job);
+        job->peer = p;
+        job->id = f->id;
+        job->sum = 1;
+        for (name = payload; name < end; name = value + strlen(value) + 1) {
+            value = name + strlen(name) + 1;
+            if (value >= end) return -1;
+            if (strcmp(name, ":method") == 0)
+                snprintf(job->method, sizeof job->method, "%s", value);
+            else if (strcmp(name, ":path") == 0)
+                snprintf(job->path, sizeof job->path, "%s", value);
+        }
+        return 0;
+    case BACKEND_BODY:
+        if (!job || job->due > 0) return 0;
+        if (f->len == 0) {
+            ms = query_param(job->path, "ms");
+            job->due = now_ns() + (ms > 0 ? ms * 1000000 : 0);
+            n_timed++;
+            return 0;
+        }
+        for (i = 0; i < (int)f->len; i++) {
+            uint32_t a = (job->sum & 0xffff), b = (job->sum >> 16);
+
+            a = (a + (unsigned char)payload[i]) % 65521;
+            b = (b + a) % 65521;
+            job->sum = (b << 16) | a;
+        }
+        job->body_len += f->len;
+        return 0;
+    case BACKEND_ABORT:
+        if (job) {
+            if (job->due > 0) n_timed--;
+            job->peer = NULL;
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * 時刻になったジョブに応える
+ *
+ **/
+static void run_due_jobs(void)
+{
+    int64_t now = now_ns();
+    struct Peer *p;
+    int i;
+
+    for (i = 0; i < MAX_JOBS; i++) {
+        if (!jobs[i].peer || jobs[i].due == 0 || jobs[i].due > now) continue;
+        p = jobs[i].peer;
+        respond(&jobs[i]);
+        jobs[i].peer = NULL;
+        n_timed--;
+        if (peer_flush(p) < 0)
+            close_peer(p);
+        else
+            peer_watch(p);
+    }
+}
+
+/**
+ * レスポンスのフレームを積む
+ *
+ **/
+static void respond(struct Job *job)
+{
+    char header[256], text[TEXT_SIZE], pad[BACKEND_FRAME_MAX];
+    size_t hlen, len, n;
+    long size, status;
+
+    status = query_param(job->path, "status");
+    if (status < 200 || status > 599) status = 200;
+    hlen = snprintf(header, sizeof header, ":status%c%ld %s%ccontent-type%ctext/plain%cx-backend-pid%c%d",
+                    0, status, status == 200 ? "OK" : "Sample", 0, 0, 0, 0, (int)getpid()) + 1;
+    queue_frame(job->peer, BACKEND_RESPONSE, job->id, header, hlen);
+    len = snprintf(text, sizeof text, "pid=%d method=%s path=%s body=%zu adler32=%08x\n",
+                   (int)getpid(), job->method, job->path, job->body_len, job->sum);
+    queue_frame(job->peer, BACKEND_BODY, job->id, text, len);
+    size = query_param(job->path, "size");
+    if (size > 0) {
+        memset(pad, 'x', sizeof pad);
+        for (; size > 0; size -= n) {
+            n = size < (long)sizeof pad ? (size_t)size : sizeof pad;
+            queue_frame(job->peer, BACKEND_BODY, job->id, pad, n);
+        }
+    }
+    queue_frame(job->peer, BACKEND_BODY, job->id, NULL, 0);
+}
+
+/**
+ * 送信待ちのフレームを送れるだけ送る
+ *
+ **/
+static int peer_flush(struct Peer *p)
+{
+    ssize_t n;
+
+    while (p->outpos < p->outlen) {
+        n = send(p->fd, p->outbuf + p->outpos, p->outlen - p->outpos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        p->outpos += n;
+    }
+    p->outpos = p->outlen = 0;
+    return 0;
+}
+
+/**
+ * 送り残しがあるときだけ書き込み可能になるのを待つ
+ *
+ **/
+static void peer_watch(struct Peer *p)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | (p->outpos < p->outlen ? EPOLLOUT : 0);
+    if (ev.events == p->events) return;
+    ev.data.ptr = p;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, p->fd, &ev) < 0)
+        log_exit("epoll_ctl(2) failed: %s", strerror(errno));
+    p->events = ev.events;
+}
+
+/**
+ * 接続を閉じ、処理中のジョブを捨てる
+ *
+ **/
+static void close_peer(struct Peer *p)
+{
+    int i;
+
+    for (i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].peer != p) continue;
+        if (jobs[i].due > 0) n_timed--;
+        jobs[i].peer = NULL;
+    }
+    close(p->fd);
+    free(p->outbuf);
+    free(p);
+}
+
+/**
+ * フレームを送信待ちに加える
+ *
+ **/
+static void queue_frame(struct Peer *p, int type, uint32_t id, const void *data, size_t len)
+{
+    struct BackendFrame f;
+
+    if (p->outlen + sizeof f + len > p->outsize) {
+        if (p->outsize == 0) p->outsize = sizeof f + BACKEND_FRAME_MAX;
+        while (p->outlen + sizeof f + len > p->outsize)
+            p->outsize *= 2;
+        p->outbuf = realloc(p->outbuf, p->outsize);
+        if (!p->outbuf) log_exit("failed to allocate memory.");
+    }
+    memset(&f, 0, sizeof f);
+    f.type = type;
+    f.id = id;
+    f.len = len;
+    memcpy(p->outbuf + p->outlen, &f, sizeof f);
+    if (len > 0) memcpy(p->outbuf + p->outlen + sizeof f, data, len);
+    p->outlen += sizeof f + len;
+}
+
+/**
+ * 接続とidからジョブを探す
+ *
+ **/
+static struct Job* find_job(struct Peer *p, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].peer == p && jobs[i].id == id) return &jobs[i];
+    }
+    return NULL;
+}
+
+/**
+ * パスのクエリからname=Nの値を取り出す
+ * なければ-1を返す。
+ **/
+static long query_param(const char *path, const char *name)
+{
+    const char *q = strchr(path, '?');
+    size_t len = strlen(name);
+
+    while (q) {
+        q++;
+        if (strncmp(q, name, len) == 0 && q[len] == '=') return atol(q + len + 1);
+        q = strchr(q, '&');
+    }
+    return -1;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void log_exit(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "sample_backend: ");
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/**
+ * httpd2の--proxyの転送先として動かす見本の上流サーバ
+ * 接続ごとにforkし、keep-aliveでリクエストに応える。
+ * レスポンスはプロセスID、メソッド、パス、受け取ったボディの長さを並べたテキスト。
+ * クエリで動きを変えられる。
+ *   ms=N       Nミリ秒待ってから応える
+ *   size=N     Nバイトの詰め物をボディに加える
+ *   status=N   ステータスコードをNにする
+ *   chunked=1  チャンク形式で送る
+ *   close=1    長さを付けずに送り、接続を閉じて終わりを伝える
+ * Usage: sample_upstream PORT
+ **/
+
+#define BUF_SIZE 65536
+#define TEXT_SIZE 2048
+
+static void serve(int fd);
+static long query_param(const char *path, const char *name);
+static int write_all(int fd, const char *buf, size_t len);
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr;
+    int server_fd, fd, one = 1;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s PORT\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(argv[1]));
+    if (bind(server_fd, (struct sockaddr*)&addr, sizeof addr) < 0 || listen(server_fd, 128) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    for (;;) {
+        fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            exit(1);
+        }
+        // ヘッダとボディを分けて書くので、Nagleで待たされないようにする
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        if (fork() == 0) {
+            close(server_fd);
+            serve(fd);
+            _exit(0);
+        }
+        close(fd);
+    }
+}
+
+/**
+ * 1つの接続でリクエストを読んでは応える
+ * ボディはContent-Lengthで送られたものだけを受け取る。
+ **/
+static void serve(int fd)
+{
+    static char buf[BUF_SIZE];
+    char method[16], path[1024], head[256], text[TEXT_SIZE], *end, *p;
+    size_t len = 0, hlen, body_len, total;
+    long ms, size, status, chunked, close_p;
+    ssize_t n;
+    int minor, keep_alive;
+
+    for (;;) {
+        // ヘッダの終わりまで読む
+        while (!(end = memmem(buf, len, "\r\n\r\n", 4))) {
+            if (len == sizeof buf) return;
+            n = read(fd, buf + len, sizeof buf - len);
+            if (n <= 0) return;
+            len += n;
+        }
+        hlen = end + 4 - buf;
+        *end = '\0';
+        if (sscanf(buf, "%15s %1023s HTTP/1.%d", method, path, &minor) != 3) return;
+        body_len = 0;
+        keep_alive = minor >= 1;
+        for (p = strstr(buf, "\r\n"); p; p = strstr(p + 2, "\r\n")) {
+            if (strncasecmp(p + 2, "content-length:", 15) == 0) body_len = strtoul(p + 17, NULL, 10);
+            if (strncasecmp(p + 2, "connection:", 11) == 0 && strcasestr(p + 13, "close")) keep_alive = 0;
+        }
+        // ボディは読み捨てる
+        if (len - hlen >= body_len) {
+            total = hlen + body_len;
+            memmove(buf, buf + total, len - total);
+            len -= total;
+        }
+        else {
+            for (total = len - hlen; total < body_len; total += n) {
+                n = read(fd, buf, sizeof buf < body_len - total ? sizeof buf : body_len - total);
+                if (n <= 0) return;
+            }
+            len = 0;
+        }
+
+        ms = query_param(path, "ms");
+        size = query_param(path, "size");
+        status = query_param(path, "status");
+        chunked = query_param(path, "chunked");
+        close_p = query_param(path, "close");
+        if (status <= 0) status = 200;
+        if (ms > 0) usleep(ms * 1000);
+        snprintf(text, sizeof text, "pid=%d method=%s path=%s body=%zu\n", (int)getpid(), method, path, body_len);
+        if (close_p) {
+            keep_alive = 0;
+            snprintf(head, sizeof head, "HTTP/1.1 %ld Sample\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n", status);
+        }
+        else if (chunked)
+            snprintf(head, sizeof head, "HTTP/1.1 %ld Sample\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n%s\r\n",
+                     status, keep_alive ? "" : "Connection: close\r\n");
+        else
+            snprintf(head, sizeof head, "HTTP/1.1 %ld Sample\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n%s\r\n",
+                     status, strlen(text) + (size > 0 ? size : 0), keep_alive ? "" : "Connection: close\r\n");
+        if (write_all(fd, head, strlen(head)) < 0) return;
+        if (strcmp(method, "HEAD") != 0) {
+            // 詰め物は'x'の並び。チャンク形式では区切りを細かく入れる
+            if (chunked) {
+                snprintf(head, sizeof head, "%zx\r\n", strlen(text));
+                if (write_all(fd, head, strlen(head)) < 0 || write_all(fd, text, strlen(text)) < 0 || write_all(fd, "\r\n", 2) < 0) return;
+            }
+            else if (write_all(fd, text, strlen(text)) < 0)
+                return;
+            memset(text, 'x', sizeof text);
+            while (size > 0) {
+                n = size < TEXT_SIZE ? size : TEXT_SIZE;
+                if (chunked) {
+                    snprintf(head, sizeof head, "%zx\r\n", (size_t)n);
+                    if (write_all(fd, head, strlen(head)) < 0 || write_all(fd, text, n) < 0 || write_all(fd, "\r\n", 2) < 0) return;
+                }
+                else if (write_all(fd, text, n) < 0)
+                    return;
+                size -= n;
+            }
+            if (chunked && write_all(fd, "0\r\n\r\n", 5) < 0) return;
+        }
+        if (!keep_alive) return;
+    }
+}
+
+/**
+ * パスのクエリからname=Nの値を取り出す
+ * なければ0を返す。
+ **/
+static long query_param(const char *path, const char *name)
+{
+    const char *q = strchr(path, '?');
+    size_t len = strlen(name);
+
+    while (q) {
+        q++;
+        if (strncmp(q, name, len) == 0 && q[len] == '=') return atol(q + len + 1);
+        q = strchr(q, '&');
+    }
+    return 0;
+}
+
+/**
+ * lenバイトを書き終えるまで書き込む
+ * 
+ **/
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}